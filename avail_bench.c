@@ -0,0 +1,258 @@
+/**
+ * This program measures how many files survive node failures and what it costs
+ * to keep their replicas. After all nodes join, every process inserts
+ * CORPUS_PER_NODE files, and process index 0 publishes the wall clock time the
+ * failures start at. Every FAIL_INTERVAL milliseconds from then on,
+ * FAIL_PER_ROUND of the highest indices that are still up fail by exiting
+ * without calling Leave(). Process index 0 audits the whole corpus with Lookup
+ * every AUDIT_INTERVAL milliseconds and prints one line per audit:
+ *
+ * avail,<ms since first failure>,<nodes up>,<files available>,<files>,<percent>
+ *
+ * A file is available if its look up returns the inserted content. After the
+ * last round and REPAIR_SETTLE milliseconds, every node still up publishes its
+ * repair counters, and process index 0 prints the totals and the repair delay
+ * histogram:
+ *
+ * repair,<replicas repaired>,<repair bytes>,<replication bytes>,<maintenance bytes>
+ * repair_delay,<below ms>,<replicas>
+ *
+ * The repair delay is counted from the leaf set change that removed the failed
+ * node, so the time to detect the failure, up to two exchange periods, comes on
+ * top. The last bucket has a below ms of -1 and holds the slower repairs.
+ * Lines starting with "avail,", "repair," and "repair_delay," are meant to be
+ * collected by scripts.
+ *
+ * Nodes can't rejoin after they exited, so recovery here is the repair of the
+ * replicas by the surviving nodes. Keep FAIL_ROUNDS * FAIL_PER_ROUND well below
+ * NUM_NODES.
+ *
+ * Run as: rednet -P 1 -N [other_flags] kernel -- avail_bench ##
+ * with NUM_NODES computers.
+ */
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rednet.h>
+#include <rednet-p2p.h>
+
+#include "overlay.h"
+
+#define NUM_NODES        32
+#define FAIL_ROUNDS      4
+#define FAIL_PER_ROUND   3
+#define FAIL_INTERVAL    20000
+#define AUDIT_INTERVAL   2000
+/* time after the last round before the repair counters are published */
+#define REPAIR_SETTLE    20000
+#define CORPUS_PER_NODE  4
+#define CORPUS_FID_BASE  0x3400
+#define START_FID        0xfbfe
+#define REPORT_FID_BASE  0xe800
+
+struct RepairReport {
+    int repaired_file_count;
+    long repair_bytes;
+    long replication_bytes;
+    long maintenance_bytes;
+    int repair_delays[repair_delay_buckets];
+};
+
+nodeID Nid;
+int Idx;
+
+char data[64];
+char buff[P2P_FILE_MAXSIZE];
+
+long long
+WallMillis(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+void
+SleepUntil(long long deadline) {
+    long long now = WallMillis();
+    if (deadline > now) {
+        MilliSleep(deadline - now);
+    }
+}
+
+/* the round a node fails in, FAIL_ROUNDS if it stays up */
+int
+FailRound(int idx) {
+    int from_top = NUM_NODES - 1 - idx;
+    if (idx == 0 || from_top >= FAIL_ROUNDS * FAIL_PER_ROUND) {
+        return FAIL_ROUNDS;
+    }
+    return from_top / FAIL_PER_ROUND;
+}
+
+int
+NodesUp(long long since_start) {
+    int count = 0;
+    int i;
+    for (i = 0; i < NUM_NODES; i++) {
+        if ((long long) FailRound(i) * FAIL_INTERVAL > since_start) {
+            count++;
+        }
+    }
+    return count;
+}
+
+void
+Audit(long long start) {
+    long long since_start = WallMillis() - start;
+    int files = NUM_NODES * CORPUS_PER_NODE;
+    int available = 0;
+    int status;
+    int i;
+
+    for (i = 0; i < files; i++) {
+        sprintf(data, "avail corpus %d", i);
+        status = Lookup(CORPUS_FID_BASE + i, buff, sizeof(buff));
+        if (status == (int) strlen(data) + 1 && strcmp(buff, data) == 0) {
+            available++;
+        }
+    }
+    printf("avail,%lld,%d,%d,%d,%.1f\n", since_start, NodesUp(since_start),
+           available, files, 100.0 * available / files);
+    fflush(stdout);
+}
+
+void
+PrintRepairs(void) {
+    struct RepairReport report;
+    struct RepairReport total;
+    int i;
+    int j;
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < NUM_NODES; i++) {
+        if (FailRound(i) < FAIL_ROUNDS) {
+            continue;
+        }
+        if (Lookup(REPORT_FID_BASE + i, &report, sizeof(report)) != sizeof(report)) {
+            fprintf(stderr, "ERROR: repair report of index %d missing!\n", i);
+            continue;
+        }
+        total.repaired_file_count += report.repaired_file_count;
+        total.repair_bytes += report.repair_bytes;
+        total.replication_bytes += report.replication_bytes;
+        total.maintenance_bytes += report.maintenance_bytes;
+        for (j = 0; j < repair_delay_buckets; j++) {
+            total.repair_delays[j] += report.repair_delays[j];
+        }
+    }
+    printf("repair,%d,%ld,%ld,%ld\n", total.repaired_file_count, total.repair_bytes,
+           total.replication_bytes, total.maintenance_bytes);
+    for (j = 0; j < repair_delay_buckets; j++) {
+        printf("repair_delay,%d,%d\n",
+               j < repair_delay_buckets - 1 ? repair_delay_base << j : -1,
+               total.repair_delays[j]);
+    }
+    fflush(stdout);
+}
+
+int
+main(int argc, char **argv) {
+    int status;
+    int i;
+    long long start;
+    long long end;
+    NodeStats stats;
+    struct RepairReport report;
+
+    if (argc < 2) {
+        fprintf(stderr,
+                "Process index argument missing: run with ## on command line.\n");
+        exit(1);
+    }
+
+    Idx = atoi(argv[1]);    /* number from 0 to NUM_NODES - 1 */
+    Nid = GetNodeID();
+
+    fprintf(stderr, "Pid %d nodeID %04x index %d\n", GetPid(), Nid, Idx);
+
+    /* same join schedule as store1.c */
+    if (Idx != 0) {
+        MilliSleep(25 * 1000);
+    }
+    status = Join(Nid);
+    if (status != 0) {
+        fprintf(stderr, "ERROR: Join returned %d!\n", status);
+        exit(1);
+    }
+    if (Idx == 0) {
+        MilliSleep(25 * 1000);
+    }
+    MilliSleep(25 * 1000);
+
+    for (i = 0; i < CORPUS_PER_NODE; i++) {
+        sprintf(data, "avail corpus %d", Idx * CORPUS_PER_NODE + i);
+        status = Insert(CORPUS_FID_BASE + Idx * CORPUS_PER_NODE + i, data, strlen(data) + 1);
+        if (status != 0) {
+            fprintf(stderr, "ERROR: Insert of corpus file %d returned %d!\n", i, status);
+        }
+    }
+    if (Idx == 0) {
+        /* late enough for everyone to read it */
+        start = WallMillis() + 30 * 1000;
+        status = Insert(START_FID, &start, sizeof(start));
+        if (status != 0) {
+            fprintf(stderr, "ERROR: Insert of start time returned %d!\n", status);
+        }
+    }
+
+    MilliSleep(25 * 1000);  /* allow all Inserts to finish */
+
+    if (Lookup(START_FID, &start, sizeof(start)) != sizeof(start)) {
+        fprintf(stderr, "ERROR: start time missing!\n");
+        exit(1);
+    }
+    end = start + (long long) FAIL_ROUNDS * FAIL_INTERVAL + REPAIR_SETTLE;
+
+    if (Idx == 0) {
+        printf("avail,ms,nodes_up,files_available,files,percent\n");
+        SleepUntil(start);
+        while (WallMillis() < end) {
+            long long next = WallMillis() + AUDIT_INTERVAL;
+            Audit(start);
+            SleepUntil(next);
+        }
+    } else if (FailRound(Idx) < FAIL_ROUNDS) {
+        SleepUntil(start + (long long) FailRound(Idx) * FAIL_INTERVAL);
+        fprintf(stderr, "Process Idx %d fails in round %d\n", Idx, FailRound(Idx));
+        exit(0);
+    } else {
+        SleepUntil(end);
+    }
+
+    if (GetStats(&stats) != 0) {
+        fprintf(stderr, "ERROR: GetStats failed!\n");
+        exit(1);
+    }
+    report.repaired_file_count = stats.repaired_file_count;
+    report.repair_bytes = stats.repair_bytes;
+    report.replication_bytes = stats.replication_bytes;
+    report.maintenance_bytes = stats.maintenance_bytes;
+    memcpy(report.repair_delays, stats.repair_delays, sizeof(report.repair_delays));
+    status = Insert(REPORT_FID_BASE + Idx, &report, sizeof(report));
+    if (status != 0) {
+        fprintf(stderr, "ERROR: Insert of repair report returned %d!\n", status);
+    }
+
+    if (Idx == 0) {
+        MilliSleep(5 * 1000);   /* allow the other reports to arrive */
+        printf("repair,repaired,repair_bytes,replication_bytes,maintenance_bytes\n");
+        PrintRepairs();
+    }
+
+    MilliSleep(25 * 1000);
+    exit(0);
+}
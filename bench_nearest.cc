@@ -0,0 +1,93 @@
+/**
+ * Microbenchmark of the nearest-node search used by Route(). For 4 to 1024
+ * candidates, it times the entry by entry search Route() used to do, the
+ * scalar NearestCandidateScalar() and the vector NearestCandidate(), and
+ * checks that all of them pick the same candidate.
+ *
+ * Build with "make -f Makefile.sys bench_nearest", add CXXFLAGS=-mavx2 to
+ * use AVX2 instead of SSE2.
+ *
+ * Run as: ./bench_nearest
+ */
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "nearest.h"
+
+const int RING_SIZE = 65536;
+const int NUM_KEYS = 1 << 12;
+const int MIN_SEARCHES = 1 << 20;
+
+// the search as Route() did it before the candidates were stored as arrays
+int NearestCandidateLegacy(const nodeID* ids, int count, nodeID key) {
+    int index = -1;
+    unsigned short min_distance = 0;
+    for (int i = 0; i < count; i++) {
+        unsigned short distance = std::min(std::abs(ids[i] - key), RING_SIZE - std::abs(ids[i] - key));
+        if (index < 0 || distance < min_distance) {
+            min_distance = distance;
+            index = i;
+        }
+    }
+    return index;
+}
+
+typedef int (*SearchFunction)(const nodeID*, int, nodeID);
+
+double TimeSearch(SearchFunction search, const std::vector<nodeID> &ids,
+                  const std::vector<nodeID> &keys, long* checksum) {
+    int rounds = std::max(1, MIN_SEARCHES / (int) keys.size() / std::max(1, (int) ids.size() / 16));
+    long sum = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++) {
+        for (nodeID key : keys) {
+            sum += search(ids.data(), ids.size(), key);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    *checksum = sum / rounds;
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    return ns / ((double) rounds * keys.size());
+}
+
+int main() {
+    srand(420);
+    std::vector<nodeID> keys(NUM_KEYS);
+    for (auto &key : keys) {
+        key = rand() % RING_SIZE;
+    }
+#if defined(__AVX2__)
+    const char* isa = "avx2";
+#elif defined(__SSE2__)
+    const char* isa = "sse2";
+#else
+    const char* isa = "scalar";
+#endif
+    printf("# nearest-node search, vector search uses %s\n", isa);
+    printf("# candidates legacy_ns scalar_ns vector_ns speedup\n");
+    for (int count = 4; count <= 1024; count *= 2) {
+        std::vector<nodeID> ids(count);
+        for (auto &id : ids) {
+            id = rand() % RING_SIZE;
+        }
+        for (nodeID key : keys) {
+            int expected = NearestCandidateLegacy(ids.data(), count, key);
+            if (NearestCandidateScalar(ids.data(), count, key) != expected
+                    || NearestCandidate(ids.data(), count, key) != expected) {
+                fprintf(stderr, "ERROR: searches disagree for %d candidates and key %04x\n",
+                        count, key);
+                return 1;
+            }
+        }
+        long legacy_sum, scalar_sum, vector_sum;
+        double legacy = TimeSearch(NearestCandidateLegacy, ids, keys, &legacy_sum);
+        double scalar = TimeSearch(NearestCandidateScalar, ids, keys, &scalar_sum);
+        double vector = TimeSearch(NearestCandidate, ids, keys, &vector_sum);
+        printf("%d %.1f %.1f %.1f %.2f\n", count, legacy, scalar, vector, legacy / vector);
+    }
+    return 0;
+}
@@ -0,0 +1,314 @@
+/**
+ * This program measures how the overlay copes with churn. After all nodes
+ * join, every process inserts CORPUS_PER_NODE files and publishes its nodeID
+ * at NODE_FID_BASE + index, and process index 0 publishes the wall clock time
+ * the churn starts at. Every CHURN_INTERVAL milliseconds from then on,
+ * CHURN_PER_ROUND of the highest indices that are still up go away, every
+ * other one by calling Leave() and the rest by just exiting. The others keep
+ * looking up files of the corpus and count the look ups that fail or return
+ * the wrong content. Near the end of every round, every node still up
+ * publishes its leaf set and traffic counters at REPORT_FID_BASE, and process
+ * index 0 compares the leaf sets with the ideal ones computed from the nodeIDs
+ * of the nodes still up and prints one line per round:
+ *
+ * churn,<round>,<nodes up>,<leaf sets matching>,<converge ms>,<converge rounds>,
+ *   <maintenance bytes per node per s>,<look ups>,<failed look ups>
+ *
+ * converge ms and rounds are the time and exchange rounds from the start of
+ * the round to the last leaf set change, -1 if some leaf set still differs.
+ * Lines starting with "churn," are meant to be collected by scripts.
+ *
+ * Nodes can't rejoin after they exited or left, so churn here only removes
+ * nodes. Keep CHURN_ROUNDS * CHURN_PER_ROUND well below NUM_NODES.
+ *
+ * Run as: rednet -P 1 -N [other_flags] kernel -- churn_bench ##
+ * with NUM_NODES computers.
+ */
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rednet.h>
+#include <rednet-p2p.h>
+
+#include "overlay.h"
+
+#define NUM_NODES        32
+#define CHURN_ROUNDS     4
+#define CHURN_PER_ROUND  3
+#define CHURN_INTERVAL   20000
+/* time before the end of a round the reports are published */
+#define REPORT_MARGIN    5000
+#define LOOKUP_DELAY     200
+#define CORPUS_PER_NODE  2
+#define CORPUS_FID_BASE  0x3300
+#define NODE_FID_BASE    0xfc00
+#define START_FID        0xfbff
+#define REPORT_FID_BASE  0xe000
+
+struct RoundReport {
+    Entry leaf_set[P2P_LEAF_SIZE];
+    long long leaf_set_changed;
+    int leaf_set_rounds;
+    long maintenance_bytes;
+    int lookups;
+    int failed_lookups;
+};
+
+nodeID Nid;
+int Idx;
+nodeID node_ids[NUM_NODES];
+
+char data[64];
+char buff[P2P_FILE_MAXSIZE];
+
+long long
+WallMillis(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+void
+SleepUntil(long long deadline) {
+    long long now = WallMillis();
+    if (deadline > now) {
+        MilliSleep(deadline - now);
+    }
+}
+
+/* the round a node goes away in, CHURN_ROUNDS if it stays */
+int
+LeaveRound(int idx) {
+    int from_top = NUM_NODES - 1 - idx;
+    if (idx == 0 || from_top >= CHURN_ROUNDS * CHURN_PER_ROUND) {
+        return CHURN_ROUNDS;
+    }
+    return from_top / CHURN_PER_ROUND;
+}
+
+int
+CompareIds(const void *a, const void *b) {
+    return (int) *(const nodeID *) a - (int) *(const nodeID *) b;
+}
+
+/* whether a reported leaf set holds the two closest nodes on each side of id */
+int
+LeafSetMatches(nodeID id, const Entry *leaf_set, const nodeID *alive, int count) {
+    nodeID expected[P2P_LEAF_SIZE];
+    nodeID reported[P2P_LEAF_SIZE];
+    int expected_count = 0;
+    int reported_count = 0;
+    int self = 0;
+    int i;
+    while (alive[self] != id) {
+        self++;
+    }
+    for (i = 1; i <= P2P_LEAF_SIZE / 2 && i < count; i++) {
+        expected[expected_count++] = alive[(self + count - i) % count];
+        if (alive[(self + i) % count] != alive[(self + count - i) % count]) {
+            expected[expected_count++] = alive[(self + i) % count];
+        }
+    }
+    for (i = 0; i < P2P_LEAF_SIZE; i++) {
+        if (leaf_set[i].pid != 0) {
+            reported[reported_count++] = leaf_set[i].id;
+        }
+    }
+    if (expected_count != reported_count) {
+        return 0;
+    }
+    qsort(expected, expected_count, sizeof(nodeID), CompareIds);
+    qsort(reported, reported_count, sizeof(nodeID), CompareIds);
+    return memcmp(expected, reported, expected_count * sizeof(nodeID)) == 0;
+}
+
+void
+PrintRound(int round, long long round_start) {
+    nodeID alive[NUM_NODES];
+    struct RoundReport report;
+    int count = 0;
+    int reported = 0;
+    int matching = 0;
+    long long last_change = round_start;
+    int max_rounds = 0;
+    long bytes = 0;
+    long lookups = 0;
+    long failed = 0;
+    int i;
+    int status;
+
+    for (i = 0; i < NUM_NODES; i++) {
+        if (LeaveRound(i) > round) {
+            alive[count++] = node_ids[i];
+        }
+    }
+    qsort(alive, count, sizeof(nodeID), CompareIds);
+    for (i = 0; i < NUM_NODES; i++) {
+        if (LeaveRound(i) <= round) {
+            continue;
+        }
+        status = Lookup(REPORT_FID_BASE + round * NUM_NODES + i, &report, sizeof(report));
+        if (status != sizeof(report)) {
+            fprintf(stderr, "ERROR: round %d report of index %d missing!\n", round, i);
+            continue;
+        }
+        reported++;
+        matching += LeafSetMatches(node_ids[i], report.leaf_set, alive, count);
+        if (report.leaf_set_changed > last_change) {
+            last_change = report.leaf_set_changed;
+        }
+        if (report.leaf_set_rounds > max_rounds) {
+            max_rounds = report.leaf_set_rounds;
+        }
+        bytes += report.maintenance_bytes;
+        lookups += report.lookups;
+        failed += report.failed_lookups;
+    }
+    if (reported == 0) {
+        return;
+    }
+    printf("churn,%d,%d,%d,%lld,%d,%.1f,%ld,%ld\n",
+           round, count, matching,
+           matching == count ? last_change - round_start : -1LL,
+           matching == count ? max_rounds : -1,
+           (double) bytes / reported / ((CHURN_INTERVAL - REPORT_MARGIN) / 1000.0),
+           lookups, failed);
+    fflush(stdout);
+}
+
+int
+main(int argc, char **argv) {
+    int status;
+    int i;
+    int round;
+    long long start;
+    NodeStats stats;
+
+    if (argc < 2) {
+        fprintf(stderr,
+                "Process index argument missing: run with ## on command line.\n");
+        exit(1);
+    }
+
+    Idx = atoi(argv[1]);    /* number from 0 to NUM_NODES - 1 */
+    Nid = GetNodeID();
+
+    fprintf(stderr, "Pid %d nodeID %04x index %d\n", GetPid(), Nid, Idx);
+
+    /* same join schedule as store1.c */
+    if (Idx != 0) {
+        MilliSleep(25 * 1000);
+    }
+    status = Join(Nid);
+    if (status != 0) {
+        fprintf(stderr, "ERROR: Join returned %d!\n", status);
+        exit(1);
+    }
+    if (Idx == 0) {
+        MilliSleep(25 * 1000);
+    }
+    MilliSleep(25 * 1000);
+
+    for (i = 0; i < CORPUS_PER_NODE; i++) {
+        sprintf(data, "churn corpus %d", Idx * CORPUS_PER_NODE + i);
+        status = Insert(CORPUS_FID_BASE + Idx * CORPUS_PER_NODE + i, data, strlen(data) + 1);
+        if (status != 0) {
+            fprintf(stderr, "ERROR: Insert of corpus file %d returned %d!\n", i, status);
+        }
+    }
+    status = Insert(NODE_FID_BASE + Idx, &Nid, sizeof(Nid));
+    if (status != 0) {
+        fprintf(stderr, "ERROR: Insert of nodeID returned %d!\n", status);
+    }
+    if (Idx == 0) {
+        /* late enough for everyone to read it */
+        start = WallMillis() + 30 * 1000;
+        status = Insert(START_FID, &start, sizeof(start));
+        if (status != 0) {
+            fprintf(stderr, "ERROR: Insert of start time returned %d!\n", status);
+        }
+    }
+
+    MilliSleep(25 * 1000);  /* allow all Inserts to finish */
+
+    if (Lookup(START_FID, &start, sizeof(start)) != sizeof(start)) {
+        fprintf(stderr, "ERROR: start time missing!\n");
+        exit(1);
+    }
+    if (Idx == 0) {
+        for (i = 0; i < NUM_NODES; i++) {
+            if (Lookup(NODE_FID_BASE + i, &node_ids[i], sizeof(nodeID)) != sizeof(nodeID)) {
+                fprintf(stderr, "ERROR: nodeID of index %d missing!\n", i);
+                exit(1);
+            }
+        }
+        printf("churn,round,nodes_up,leaf_sets_matching,converge_ms,converge_rounds,"
+               "maintenance_bytes_per_node_per_s,lookups,failed_lookups\n");
+    }
+
+    srand(Idx + 1);
+    for (round = 0; round < CHURN_ROUNDS; round++) {
+        long long round_start = start + (long long) round * CHURN_INTERVAL;
+        struct RoundReport report;
+        int first_exchange_round;
+        long first_bytes;
+
+        SleepUntil(round_start);
+        if (LeaveRound(Idx) == round) {
+            if (Idx % 2 == 0) {
+                status = Leave();
+                fprintf(stderr, "Process Idx %d left in round %d with status %d\n", Idx, round, status);
+            } else {
+                fprintf(stderr, "Process Idx %d exits in round %d\n", Idx, round);
+            }
+            exit(0);
+        }
+        if (GetStats(&stats) != 0) {
+            fprintf(stderr, "ERROR: GetStats failed!\n");
+            exit(1);
+        }
+        first_exchange_round = stats.exchange_round;
+        first_bytes = stats.maintenance_bytes;
+
+        report.lookups = 0;
+        report.failed_lookups = 0;
+        while (WallMillis() < round_start + CHURN_INTERVAL - REPORT_MARGIN - LOOKUP_DELAY) {
+            int file = rand() % (NUM_NODES * CORPUS_PER_NODE);
+            sprintf(data, "churn corpus %d", file);
+            status = Lookup(CORPUS_FID_BASE + file, buff, sizeof(buff));
+            report.lookups++;
+            if (status < 0 || strcmp(buff, data) != 0) {
+                report.failed_lookups++;
+            }
+            MilliSleep(LOOKUP_DELAY);
+        }
+
+        if (GetStats(&stats) != 0) {
+            fprintf(stderr, "ERROR: GetStats failed!\n");
+            exit(1);
+        }
+        memcpy(report.leaf_set, stats.leaf_set, sizeof(report.leaf_set));
+        report.leaf_set_changed = WallMillis() - stats.leaf_set_age;
+        report.leaf_set_rounds = stats.leaf_set_round - first_exchange_round;
+        if (report.leaf_set_rounds < 0) {
+            report.leaf_set_rounds = 0;
+        }
+        report.maintenance_bytes = stats.maintenance_bytes - first_bytes;
+        status = Insert(REPORT_FID_BASE + round * NUM_NODES + Idx, &report, sizeof(report));
+        if (status != 0) {
+            fprintf(stderr, "ERROR: Insert of round %d report returned %d!\n", round, status);
+        }
+
+        if (Idx == 0) {
+            SleepUntil(round_start + CHURN_INTERVAL - REPORT_MARGIN / 2);
+            PrintRound(round, round_start);
+        }
+    }
+
+    MilliSleep(25 * 1000);
+    exit(0);
+}
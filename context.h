@@ -0,0 +1,22 @@
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+/**
+ * State of a kernel that isn't running on the current thread, see kernel.cc
+ */
+struct KernelContext;
+
+/**
+ * Allocate the state of a kernel that hasn't joined yet
+ * @return the new context
+ */
+KernelContext* NewKernelContext();
+
+/**
+ * Make a context the kernel state of the current thread
+ * @param context the context to run the kernel with, NULL for the one of the
+ *                kernel process itself
+ */
+void SetKernelContext(KernelContext* context);
+
+#endif
@@ -0,0 +1,99 @@
+/**
+ * This program reports how often look ups are hedged. After all nodes
+ * join, process index 0 inserts NUM_FILES files. Every process then
+ * looks each of them up ROUNDS times and prints the look up and hedge
+ * counters of its own node, so the lines can be summed up. detoured counts
+ * the hedges that left the node by another first hop than their look up,
+ * which should be all of them unless a node has a single way to the root.
+ *
+ * Run it with hedge_lookups set to true and false in kernel.cc to
+ * compare how long the look ups take.
+ *
+ * Run as: rednet -P 1 -N [other_flags] kernel -- hedge_report ##
+ */
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rednet.h>
+#include <rednet-p2p.h>
+
+#include "overlay.h"
+
+#define NUM_FILES   16
+#define ROUNDS      8
+#define FID_BASE    0x3300
+
+nodeID Nid;
+int Idx;
+
+char data[] = "hedge report file";
+char buff[P2P_FILE_MAXSIZE];
+
+int
+main(int argc, char **argv) {
+    int status;
+    int i;
+    int round;
+    int failed = 0;
+    NodeStats stats;
+
+    if (argc < 2) {
+        fprintf(stderr,
+                "Process index argument missing: run with ## on command line.\n");
+        exit(1);
+    }
+
+    Idx = atoi(argv[1]);    /* number from 0 to 31 */
+    Nid = GetNodeID();
+
+    fprintf(stderr, "Pid %d nodeID %04x index %d\n", GetPid(), Nid, Idx);
+
+    /* same join schedule as store1.c */
+    if (Idx != 0) {
+        MilliSleep(25 * 1000);
+    }
+    status = Join(Nid);
+    if (status != 0) {
+        fprintf(stderr, "ERROR: Join returned %d!\n", status);
+        exit(1);
+    }
+    if (Idx == 0) {
+        MilliSleep(25 * 1000);
+    }
+    MilliSleep(25 * 1000);
+
+    if (Idx == 0) {
+        /* spread the files over the ring */
+        for (i = 0; i < NUM_FILES; i++) {
+            status = Insert(FID_BASE + i * 0x0f00, data, sizeof(data));
+            if (status != 0) {
+                fprintf(stderr, "ERROR: Insert %d returned %d!\n", i, status);
+            }
+        }
+    }
+
+    MilliSleep(25 * 1000);  /* allow all Inserts to finish */
+
+    for (round = 0; round < ROUNDS; round++) {
+        for (i = 0; i < NUM_FILES; i++) {
+            status = Lookup(FID_BASE + i * 0x0f00, buff, sizeof(buff));
+            if (status != sizeof(data) || memcmp(buff, data, status) != 0) {
+                failed++;
+            }
+        }
+    }
+
+    if (GetStats(&stats) != 0) {
+        fprintf(stderr, "ERROR: GetStats failed!\n");
+        exit(1);
+    }
+    printf("hedge report: index %d lookups %d failed %d hedged %d detoured %d won %d delay %d ms\n",
+           Idx, stats.lookup_count, failed, stats.hedge_count, stats.hedge_detour_count,
+           stats.hedge_win_count, stats.hedge_delay);
+
+    MilliSleep(25 * 1000);
+    exit(0);
+}
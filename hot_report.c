@@ -0,0 +1,131 @@
+/**
+ * This program reports how the look ups of a single hot file are spread
+ * over the nodes. After all nodes join, process index 0 inserts HOT_FID
+ * and every process looks it up ROUNDS times. Every process then publishes
+ * the statistics of its own node as a small file at fileID STATS_FID_BASE
+ * + index, and process index 0 looks all of them up and prints how many
+ * nodes answered look ups and the share of the busiest one.
+ *
+ * Run it with replicate_hot_keys and path_caching set to true and false in
+ * kernel.cc to compare how much of the load the root of the hot file takes.
+ *
+ * Run as: rednet -P 1 -N [other_flags] kernel -- hot_report ##
+ */
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rednet.h>
+#include <rednet-p2p.h>
+
+#include "overlay.h"
+
+#define NUM_NODES       32
+#define ROUNDS          16
+#define HOT_FID         0x4400
+#define STATS_FID_BASE  0xfd00
+
+nodeID Nid;
+int Idx;
+
+char data[] = "hot report file";
+char buff[P2P_FILE_MAXSIZE];
+
+int
+main(int argc, char **argv) {
+    int status;
+    int i;
+    NodeStats stats;
+
+    if (argc < 2) {
+        fprintf(stderr,
+                "Process index argument missing: run with ## on command line.\n");
+        exit(1);
+    }
+
+    Idx = atoi(argv[1]);    /* number from 0 to 31 */
+    Nid = GetNodeID();
+
+    fprintf(stderr, "Pid %d nodeID %04x index %d\n", GetPid(), Nid, Idx);
+
+    /* same join schedule as store1.c */
+    if (Idx != 0) {
+        MilliSleep(25 * 1000);
+    }
+    status = Join(Nid);
+    if (status != 0) {
+        fprintf(stderr, "ERROR: Join returned %d!\n", status);
+        exit(1);
+    }
+    if (Idx == 0) {
+        MilliSleep(25 * 1000);
+    }
+    MilliSleep(25 * 1000);
+
+    if (Idx == 0) {
+        status = Insert(HOT_FID, data, sizeof(data));
+        if (status != 0) {
+            fprintf(stderr, "ERROR: Insert returned %d!\n", status);
+        }
+    }
+    MilliSleep(25 * 1000);  /* allow the Insert to finish */
+
+    for (i = 0; i < ROUNDS; i++) {
+        status = Lookup(HOT_FID, buff, sizeof(buff));
+        if (status != sizeof(data)) {
+            fprintf(stderr, "ERROR: Lookup %d returned %d!\n", i, status);
+        }
+        /* spread the look ups over a few exchange periods */
+        MilliSleep(250);
+    }
+
+    MilliSleep(5 * 1000);
+    if (GetStats(&stats) != 0) {
+        fprintf(stderr, "ERROR: GetStats failed!\n");
+        exit(1);
+    }
+    fprintf(stderr, "index %d answered %d look ups, %d hot files\n",
+            Idx, stats.served_lookup_count, stats.hot_key_count);
+    status = Insert(STATS_FID_BASE + Idx, &stats, sizeof(stats));
+    if (status != 0) {
+        fprintf(stderr, "ERROR: Insert of stats returned %d!\n", status);
+    }
+
+    MilliSleep(25 * 1000);  /* allow everyone to publish their stats */
+
+    if (Idx == 0) {
+        int reported = 0;
+        int serving = 0;
+        int hot = 0;
+        long cached = 0;
+        long total = 0;
+        int max = 0;
+        for (i = 0; i < NUM_NODES; i++) {
+            status = Lookup(STATS_FID_BASE + i, &stats, sizeof(stats));
+            if (status != sizeof(stats)) {
+                fprintf(stderr, "ERROR: stats of index %d missing!\n", i);
+                continue;
+            }
+            reported++;
+            total += stats.served_lookup_count;
+            hot += stats.hot_key_count;
+            cached += stats.path_cache_hit_count;
+            if (stats.served_lookup_count > 0) {
+                serving++;
+            }
+            if (stats.served_lookup_count > max) {
+                max = stats.served_lookup_count;
+            }
+        }
+        if (total > 0) {
+            printf("hot report: %d nodes, %ld look ups answered by %d nodes, "
+                   "busiest node answered %.0f%%, %d hot files, %ld answered from path caches\n",
+                   reported, total, serving, 100.0 * max / total, hot, cached);
+        }
+    }
+
+    MilliSleep(25 * 1000);
+    exit(0);
+}
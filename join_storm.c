@@ -0,0 +1,144 @@
+/**
+ * This program measures how long the leaf sets take to converge when
+ * many nodes join at the same time. Process index 0 joins first, then
+ * all the other processes join within JOIN_SPREAD milliseconds of each
+ * other. After the leaf sets had time to settle, every process publishes
+ * when it started to join, when Join returned and when its leaf set last
+ * changed as a small file at fileID STATS_FID_BASE + index, and process
+ * index 0 looks all of them up and prints the time from the first join
+ * of the storm to the last leaf set change.
+ *
+ * Run it once with the default kernel and once with batch_joins set to
+ * false in kernel.cc to compare the convergence times.
+ *
+ * Run as: rednet -P 1 -N [other_flags] kernel -- join_storm ##
+ * with NUM_NODES computers.
+ */
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rednet.h>
+#include <rednet-p2p.h>
+
+#include "overlay.h"
+
+#define NUM_NODES       128
+#define JOIN_SPREAD     1000
+#define STATS_FID_BASE  0xfe00
+
+struct JoinReport {
+    long long join_started;
+    long long joined;
+    long long converged;
+    int leaf_set_change_count;
+    int batched_join_count;
+};
+
+nodeID Nid;
+int Idx;
+
+long long
+WallMillis(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+int
+main(int argc, char **argv) {
+    int status;
+    int i;
+    NodeStats stats;
+    struct JoinReport report;
+
+    if (argc < 2) {
+        fprintf(stderr,
+                "Process index argument missing: run with ## on command line.\n");
+        exit(1);
+    }
+
+    Idx = atoi(argv[1]);    /* number from 0 to NUM_NODES - 1 */
+    Nid = GetNodeID();
+
+    fprintf(stderr, "Pid %d nodeID %04x index %d\n", GetPid(), Nid, Idx);
+
+    /* everybody but index 0 joins within JOIN_SPREAD milliseconds */
+    if (Idx != 0) {
+        MilliSleep(25 * 1000 + Idx * JOIN_SPREAD / NUM_NODES);
+    }
+    report.join_started = WallMillis();
+    status = Join(Nid);
+    if (status != 0) {
+        fprintf(stderr, "ERROR: Join returned %d!\n", status);
+        exit(1);
+    }
+    report.joined = WallMillis();
+    if (Idx == 0) {
+        MilliSleep(25 * 1000);
+    }
+    MilliSleep(30 * 1000);  /* allow the leaf sets to settle */
+
+    if (GetStats(&stats) != 0) {
+        fprintf(stderr, "ERROR: GetStats failed!\n");
+        exit(1);
+    }
+    report.converged = WallMillis() - stats.leaf_set_age;
+    report.leaf_set_change_count = stats.leaf_set_change_count;
+    report.batched_join_count = stats.batched_join_count;
+    status = Insert(STATS_FID_BASE + Idx, &report, sizeof(report));
+    if (status != 0) {
+        fprintf(stderr, "ERROR: Insert of report returned %d!\n", status);
+    }
+
+    MilliSleep(25 * 1000);  /* allow everyone to publish their reports */
+
+    if (Idx == 0) {
+        int reported = 0;
+        long long first_join = 0;
+        long long last_join = 0;
+        long long last_change = 0;
+        long long max_join_time = 0;
+        long changes = 0;
+        long batched = 0;
+        for (i = 0; i < NUM_NODES; i++) {
+            status = Lookup(STATS_FID_BASE + i, &report, sizeof(report));
+            if (status != sizeof(report)) {
+                fprintf(stderr, "ERROR: report of index %d missing!\n", i);
+                continue;
+            }
+            batched += report.batched_join_count;
+            if (i == 0) {
+                /* index 0 is not part of the storm */
+                continue;
+            }
+            if (reported == 0 || report.join_started < first_join) {
+                first_join = report.join_started;
+            }
+            if (report.join_started > last_join) {
+                last_join = report.join_started;
+            }
+            if (report.converged > last_change) {
+                last_change = report.converged;
+            }
+            if (report.joined - report.join_started > max_join_time) {
+                max_join_time = report.joined - report.join_started;
+            }
+            changes += report.leaf_set_change_count;
+            reported++;
+        }
+        if (reported > 0) {
+            printf("join storm: %d nodes joined within %lld ms, slowest join %lld ms, "
+                   "converged %lld ms after the first join, "
+                   "%.1f leaf set changes per node, %ld joins answered in batches\n",
+                   reported, last_join - first_join, max_join_time,
+                   last_change - first_join, (double) changes / reported, batched);
+        }
+    }
+
+    MilliSleep(25 * 1000);
+    exit(0);
+}
@@ -8,46 +8,485 @@
 #include <utility>
 #include <iterator>
 #include <set>
+#include <list>
+#include <map>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <climits>
+#include <cstddef>
 
+#include "context.h"
 #include "message.h"
+#include "nearest.h"
+#include "sketch.h"
+#include "trace.h"
 
 const int NORMAL = 0;
 const int RINGSEARCH = 1;
 const int JOINING = 2;
+const int LEAVING = 3;
+const int LEFT = 4;
 
 /**
- * Mode of kernel.
+ * Variables for expanding ring search.
  */
-int mode = 0;
+const int hop_count_limit = 5;
 
-std::unordered_map<int, int> sequence_number_map;
+/**
+ * Overlay network.
+ */
+const int RING_SIZE = 65536;
 
 /**
- * Variables for expanding ring search.
+ * Virtual nodes. A kernel joins the ring under virtual_node_count nodeIDs, each
+ * with its own leaf set, so that a kernel owns several smaller pieces of the ring
+ * instead of a single one. The first virtual node uses the nodeID given to Join().
  */
-const int hop_count_limit = 5;
+const int virtual_node_count = 1;
 
-int sequence_number = 0;
-int hop_count = 0;
-int alarm_round = 0;
+struct VirtualNode {
+    nodeID id;
+    Entry leaf_set[P2P_LEAF_SIZE];
+};
 
 /**
- * Overlay network.
+ * Hash fileIDs before placing them on the ring so that clustered or sequential
+ * fileIDs spread uniformly over the nodes.
  */
-bool joined_overlay_network = false;
-nodeID node_id;
-const int RING_SIZE = 65536;
+const bool hash_file_ids = false;
+/**
+ * Chain replication. Files of at least chain_min_size bytes are sent by the root
+ * to its left neighbor only, which stores and passes them on to the right neighbor.
+ * The last node of the chain confirms to the root. Smaller files are sent to both
+ * neighbors at once, which confirms sooner.
+ */
+const bool chain_replication = true;
+const int chain_min_size = P2P_FILE_MAXSIZE / 4;
+
+/**
+ * Direct payloads. An insert or write of the local user process with at least
+ * direct_payload_min_size bytes isn't routed itself. A LOCATE with only the fileID is
+ * routed to the root instead, the root answers it with LOCATE_RES straight to the
+ * origin, and the origin sends the request to the pid of the root, so the payload
+ * crosses the network once instead of once per hop. A retry locates the root again.
+ * Smaller requests are routed as before, the extra round trip would cost more.
+ */
+const bool direct_payloads = true;
+const int direct_payload_min_size = P2P_FILE_MAXSIZE / 4;
+
+/**
+ * Offered transfers. The LOCATE of an insert carries the length and content hash of
+ * the file, and a root that already has that content inserts its own copy instead of
+ * asking for the payload. A root that gets the content it already has, for example
+ * from a retry, keeps its copy and sends its replicas REPLICATE_OFFER instead of the
+ * file, and a leaving node sends HANDOFF_OFFER. The receiver of an offer confirms if
+ * its copy has the same length and hash and pulls the file otherwise.
+ */
+const bool offer_transfers = true;
 
-Entry leaf_set[P2P_LEAF_SIZE] = {{0, 0}, {0, 0}, {0, 0}, {0, 0}};
-// nodes in leaf set where I haven't get response from an exchange message
-std::set<nodeID> dead_node;
 /**
  * Storage
  */
-// fileID to <file, file_len> pair
-std::unordered_map<fileID, std::pair<char*, int>> file_map;
-// fileID to <pid, wait_count> pair
-std::unordered_map<fileID, std::pair<int, int>> confirmation_waiting_map;
+// per node storage budget in bytes
+const int storage_capacity = 64 * P2P_FILE_MAXSIZE;
+
+/**
+ * Content deduplication. The contents in file_map are kept once per distinct
+ * content, keyed by a hash of the bytes and counted by the fileIDs referring to
+ * them. A file is freed when its last fileID is removed, and a patch copies the
+ * content before changing it. storage_used still counts every fileID, so placement
+ * and spilling don't depend on what else a node happens to store.
+ */
+const bool dedup_contents = true;
+
+struct Content {
+    char* data;
+    int len;
+    int refs;
+};
+
+/**
+ * Timeouts. A request of the local user process that isn't answered in time is
+ * routed again, avoiding the first hop of the previous attempt, and the timeout
+ * doubles with every attempt. After request_retry_limit retries the user process
+ * gets TIMEOUT_ERROR. Deadlines are checked on every alarm tick.
+ */
+// timeout of the first attempt in milliseconds
+const int request_timeout = 2000;
+const int request_retry_limit = 3;
+// how long the root of a file waits for the confirmations of the other copies
+const int confirmation_timeout = request_timeout;
+
+struct PendingRequest {
+    // the request as sent by the user process
+    std::vector<char> message;
+    // time of the first attempt
+    long sent_at;
+    // time the current attempt times out
+    long expires_at;
+    int attempts;
+    // pid the current attempt was sent to
+    int next_hop;
+    bool hedged;
+    // number of requests of a hedged look up that failed
+    int failures;
+};
+
+struct ConfirmationWait {
+    // pid of the node that sent the request
+    int origin;
+    int wait_count;
+    long expires_at;
+    // INSERT_CONFIRM or RECLAIM_CONFIRM
+    int reply_type;
+};
+
+/**
+ * Message coalescing. Small background messages, which no request waits for, to
+ * a pid we sent to within the last coalesce_delay milliseconds are held back and
+ * packed into one ENVELOPE, which is sent once it is full or its first message
+ * waited coalesce_delay. RedNet has no timers, so the deadline is only checked
+ * whenever the kernel handles a message or an alarm. Off by default, it saves
+ * few messages.
+ */
+const bool coalesce_messages = false;
+// larger messages are always sent right away
+const int coalesce_max_message = 64;
+const int coalesce_delay = 20;
+
+struct PendingSpill {
+    // leaf set member the new version is spilled to
+    Entry holder;
+    // pid of the node that sent the insert
+    int origin;
+    // the new version, replicated once the holder confirms
+    std::vector<char> data;
+    long expires_at;
+};
+
+struct Outbox {
+    std::vector<char> envelope;
+    int count;
+    // time the first message in the envelope was queued
+    long opened_at;
+    // time we last sent something to the pid
+    long last_sent_at;
+};
+
+/**
+ * Hedged look ups. If the root hasn't answered a look up of the local user process
+ * within the hedge_percentile latency of recent look ups, a second request is sent
+ * towards a replica. Whichever answer arrives first is delivered, the other one
+ * is ignored. Pending look ups are checked on every alarm tick.
+ */
+const bool hedge_lookups = true;
+const int hedge_percentile = 95;
+// number of recent look up latencies the percentile is taken over
+const int hedge_latency_window = 64;
+// lower bound of the hedge delay in milliseconds, also used until there are enough samples
+const int hedge_min_delay = 50;
+
+/**
+ * Load-aware reads. The root of a file, or a current immediate replica that a look
+ * up passes on the way to the root, serves the look up from whichever copy has served
+ * the fewest look ups recently, so that a hot file doesn't pin a single kernel.
+ */
+const bool balance_lookups = true;
+
+/**
+ * Hot keys. The root counts the look ups of each file in a count-min sketch whose
+ * counters are halved every exchange period. A file counted hot_key_threshold times
+ * gets extra read replicas at the outer members of the root's leaf set, which the root
+ * passes look ups to like the regular replicas. They never answer look ups passing them
+ * on the way to the root. The extra replicas are released once the count falls below
+ * hot_key_cool_threshold, or when the file is written, inserted again or reclaimed.
+ * The release isn't acknowledged; a copy is stamped with the version of the file at the
+ * root, and a holder that missed the release hands look ups with a newer one back.
+ */
+const bool replicate_hot_keys = true;
+const int hot_key_threshold = 32;
+const int hot_key_cool_threshold = 8;
+
+/**
+ * Key summaries. Every exchange message carries a Bloom filter of the fileIDs the
+ * sender stores or is the root of, and a node tells its leaf set right away with
+ * KEY_ADDED when it stores a new one. A node forwarding a look up to the root fails
+ * it on the spot when neither the root nor any member of the root's leaf set may have
+ * the file. A root without the file passes the look up to a leaf set member that may
+ * have it, for example the old root of a range we just took over. A file inserted
+ * while leaf sets were changing can sit at a member the summaries don't show yet, and
+ * a member that dropped us from its leaf set stops sending us its summary. So a look
+ * up is only failed early while every summary involved arrived in the last
+ * summary_settle_rounds exchange periods and none of their leaf sets changed in that
+ * time. Otherwise the root decides.
+ */
+const bool filter_lookups = true;
+const int summary_settle_rounds = 2;
+
+struct NeighborSummary {
+    int pid;
+    KeyFilter keys;
+    Entry leaf_set[P2P_LEAF_SIZE];
+    // exchange round we last saw its leaf set change in
+    int leaf_set_round;
+    // exchange round we last got its summary in
+    int updated_round;
+};
+
+/**
+ * Read leases. A look up with lease set is answered by the root, which remembers the
+ * requester for lease_duration and sends it LEASE_INVALIDATE before the file is
+ * inserted again, written or reclaimed. The kernel of the requester keeps the lease
+ * until then, and the user process asks it with LEASE_CHECK whether its cached copy
+ * is still good, which doesn't leave the node. Expired leases are dropped on the alarm.
+ * The root confirms the change only once every holder answered LEASE_INVALIDATE_CONFIRM
+ * or its lease ran out. A root handing a file to a new root sends its leases along
+ * with LEASE_TRANSFER. A node taking a file over from a failed root, or that joined
+ * less than lease_duration ago, can't know the leases granted before and holds back
+ * confirmations of changes until they would have run out.
+ */
+const int lease_duration = 5000;
+
+/**
+ * Path caching. The node answering a look up of a file counted path_cache_threshold
+ * times pushes a copy, stamped with the version of the file at its root, to the last
+ * node that forwarded the look up. That node keeps it in a cache of path_cache_capacity
+ * bytes apart from file_map and answers look ups passing it for the ttl of the copy.
+ * An expired copy is checked with the node answering the next look up, which renews it
+ * if the version still matches. Copies are never invalidated, so a look up may see a
+ * file up to path_cache_ttl old; the kernel of a writer skips the cached copies of the
+ * files it changed until that much time passed since the change was confirmed.
+ * Other clients can still read the old content for that long after a confirmed
+ * change, so path caching is off unless the application can live with that.
+ */
+const bool path_caching = false;
+const int path_cache_capacity = 16 * P2P_FILE_MAXSIZE;
+const int path_cache_ttl = 2000;
+const int path_cache_threshold = 4;
+
+struct PathCacheEntry {
+    std::vector<char> data;
+    int version;
+    long expires_at;
+    std::list<fileID>::iterator position;
+};
+
+/**
+ * Join batching. Joins that reach this node as their root within join_batch_delay
+ * of each other are answered together, each with the leaf set the joiner would
+ * build from our leaf sets and the other joiners. Nodes we answered within the last
+ * join_recent_window are sent the joiners that belong in their leaf set, so that
+ * nodes joining at the same time learn about each other without waiting for
+ * exchanges. A join with no other join in the last join_batch_delay is answered
+ * right away. The deadline is checked whenever the kernel handles a message or an alarm.
+ */
+const bool batch_joins = true;
+const int join_batch_delay = 50;
+const int join_recent_window = 2000;
+
+struct Joiner {
+    nodeID id;
+    int pid;
+    long joined_at;
+};
+
+/**
+ * Leaving. Leave() hands every file this node is the root of to the remote leaf set
+ * member closest to its placement key, which becomes its root once we are gone, and
+ * waits for the confirmations. Only then the leaf set members are told that we leave,
+ * so look ups find a node with the file the whole time. A handoff that isn't confirmed
+ * in time is sent again with the timeout doubled, up to request_retry_limit times.
+ */
+struct Handoff {
+    // pid of the new root
+    int owner;
+    int attempts;
+    long expires_at;
+};
+
+/**
+ * Replica repair. Replicas only get their copies when a file is inserted or written,
+ * so a file whose root or replica died keeps fewer copies until it is lost with the
+ * last one. On the first exchange after its leaf sets changed, a kernel takes over the
+ * files it holds and is now the root of, and sends its immediate neighbors
+ * REPLICATE_OFFER for every file it is the root of. A neighbor missing the file pulls
+ * it, which repairs the replica.
+ */
+const bool repair_replicas = true;
+
+/**
+ * Message recording. With record_messages set, every call of HandleMessage is
+ * appended to record_prefix.<pid> with its time, source, destination, length, type
+ * and content hash, and with the message itself if record_payloads is set. The log
+ * is flushed on every alarm. replay feeds a log with payloads back into this kernel.
+ */
+const bool record_messages = false;
+const bool record_payloads = true;
+const char* const record_prefix = "kernel-trace";
+
+/**
+ * State of a kernel. A kernel process keeps its state in main_context. A simulator
+ * keeps one context for every kernel it runs and points kernel at the context of the
+ * kernel it handles a message for, so switching between kernels is a pointer swap.
+ */
+struct KernelContext {
+    // NORMAL, RINGSEARCH, JOINING, LEAVING or LEFT
+    int mode = 0;
+    std::unordered_map<int, int> sequence_number_map;
+
+    // expanding ring search
+    int sequence_number = 0;
+    int hop_count = 0;
+    int alarm_round = 0;
+    // number of times the current join was restarted, and when the current attempt times out
+    int join_attempts = 0;
+    long join_expires_at = 0;
+
+    bool joined_overlay_network = false;
+    VirtualNode virtual_nodes[virtual_node_count];
+    // nodeID and leaf set of the first virtual node
+    nodeID& node_id = virtual_nodes[0].id;
+    Entry (&leaf_set)[P2P_LEAF_SIZE] = virtual_nodes[0].leaf_set;
+    // nodes in leaf set where I haven't get response from an exchange message
+    std::set<nodeID> dead_node;
+    // leaf set members of every virtual node hosted by other kernels, the candidates
+    // for the next hop in Route(). Rebuilt when a leaf set changes.
+    CandidateSet route_candidates;
+    bool route_candidates_dirty = true;
+
+    // scan started by the local user process. Batches may arrive out of order, they
+    // are delivered by sequence number whenever the user process asks for the next one.
+    std::map<int, std::vector<char>> scan_batches;
+    int scan_next_sequence = 0;
+    bool scan_waiting = false;
+
+    // number of bytes currently stored in file_map
+    int storage_used = 0;
+    // fileID to <file, file_len> pair, files with the same content share it
+    std::unordered_map<fileID, std::pair<char*, int>> file_map;
+    // content hash to the contents with that hash
+    std::unordered_map<unsigned long long, std::vector<Content>> content_store;
+    // number of bytes of distinct contents
+    int content_bytes = 0;
+    // fileID to <holder, file_len> pair of the files this node spilled to a leaf set member
+    std::unordered_map<fileID, std::pair<Entry, int>> spill_map;
+    // fileID to the pid of the root that spilled a file we hold to us
+    std::unordered_map<fileID, int> spill_roots;
+    // fileID to the new version of a file we spilled, until its holder confirms
+    std::unordered_map<fileID, PendingSpill> pending_spills;
+    // nodeID to free capacity advertised in the last exchange with that node
+    std::unordered_map<nodeID, int> neighbor_capacity;
+    // fileIDs of tagged look ups sent by the local user process
+    std::set<fileID> tagged_lookups;
+    // fileIDs of the files this node is the root of, including the spilled ones.
+    // It is ordered so that a scan can walk a range of fileIDs.
+    std::set<fileID> primary_index;
+
+    // fileID to request of the local user process waiting for an answer
+    std::unordered_map<fileID, PendingRequest> pending_requests;
+    // chunks of streams the local user process waits for, and its chunk requests
+    // held back until fewer than stream_window are in flight
+    std::set<fileID> chunk_requests;
+    std::deque<std::vector<char>> held_chunk_requests;
+    bool releasing_chunk_requests = false;
+    // fileID to the confirmations the root of the file still waits for
+    std::unordered_map<fileID, ConfirmationWait> confirmation_waiting_map;
+    // pid to messages waiting to be sent to it
+    std::unordered_map<int, Outbox> outboxes;
+
+    // latencies in milliseconds of the most recent look ups
+    std::deque<int> lookup_latencies;
+    int lookup_count = 0;
+    int hedge_count = 0;
+    int hedge_win_count = 0;
+    int hedge_detour_count = 0;
+    // look ups served during the last exchange period, advertised in exchange messages
+    int lookup_load = 0;
+    // look ups served since the last exchange
+    int served_lookups = 0;
+    // nodeID to look ups served in its last exchange period, plus the ones we passed to it since
+    std::unordered_map<nodeID, int> neighbor_load;
+    // look ups answered since the kernel started
+    int total_served_lookups = 0;
+    // fileID to the pid of the root that sent us our copy as one of its immediate replicas
+    std::unordered_map<fileID, int> replica_roots;
+
+    CountMinSketch lookup_sketch;
+    // fileID to the nodes holding an extra read replica of it
+    std::unordered_map<fileID, std::vector<Entry>> hot_replicas;
+    // fileID to the version of the extra replica we hold for the root of a hot file
+    std::unordered_map<fileID, int> hot_copies;
+    // summary of the fileIDs of this kernel, rebuilt every exchange period
+    KeyFilter local_keys;
+    // nodeID to the key summary and leaf set it sent in its last exchange
+    std::unordered_map<nodeID, NeighborSummary> neighbor_summaries;
+    int filtered_lookup_count = 0;
+
+    // fileID to the pids holding a lease on it and when their lease expires
+    std::unordered_map<fileID, std::unordered_map<int, long>> leases;
+    // fileID to when the lease of the local user process on it expires
+    std::unordered_map<fileID, long> client_leases;
+    // fileID to the pids we sent LEASE_INVALIDATE and when their lease expires, until they confirm
+    std::unordered_map<fileID, std::unordered_map<int, long>> revoked_leases;
+    // fileID to until when a file we took over from a failed root may be leased by it
+    std::unordered_map<fileID, long> lease_fences;
+
+    // fileID to cached copy, and the fileIDs from most to least recently used
+    std::unordered_map<fileID, PathCacheEntry> path_cache;
+    std::list<fileID> path_cache_order;
+    int path_cache_used = 0;
+    int path_cache_hit_count = 0;
+    // fileID to version stamp of a file we are the root of, a new one after every change
+    std::unordered_map<fileID, int> file_versions;
+    int file_version_count = 0;
+    // fileID to until when look ups of the local user process skip cached copies
+    std::unordered_map<fileID, long> recent_writes;
+
+    // joins waiting for the current batch to be answered
+    std::vector<Joiner> pending_joins;
+    // time the first join of the current batch arrived
+    long join_batch_opened_at = 0;
+    // time the last join arrived
+    long last_join_at = 0;
+    // joiners answered within the last join_recent_window
+    std::vector<Joiner> recent_joins;
+    // joins answered as part of a batch of more than one
+    int batched_join_count = 0;
+    // time and number of changes of the leaf sets of this kernel
+    long leaf_set_changed_at = 0;
+    int leaf_set_change_count = 0;
+    // exchange periods so far, and the one the leaf sets last changed in
+    int exchange_round = 0;
+    int leaf_set_round = 0;
+    // bytes sent to keep the overlay up, and to copy files between nodes
+    long maintenance_bytes = 0;
+    long replication_bytes = 0;
+
+    // fileID to handoff waiting for its confirmation
+    std::unordered_map<fileID, Handoff> handoffs;
+    // files handed off since Leave() was called
+    std::set<fileID> handed_off;
+    bool handoff_failed = false;
+
+    // leaf set change the last repair pass ran for
+    int repaired_change_count = 0;
+    // time of the leaf set change the current repair pass runs for
+    long repair_started_at = 0;
+    // files offered by the current repair pass
+    std::set<fileID> repair_offers;
+    // replicas repaired, the bytes sent for them and the histogram of their delays
+    int repaired_file_count = 0;
+    long repair_bytes = 0;
+    int repair_delays[repair_delay_buckets] = {0};
+
+    TraceWriter recorder;
+    bool recorder_opened = false;
+};
+
+KernelContext main_context;
+// state of the kernel the current thread runs
+thread_local KernelContext* kernel = &main_context;
 
 void HandleJoinMessage(int src, int dest, const void *msg, int len);
 void HandleJoinResponseMessage(int src, int dest, const void *msg, int len);
@@ -61,16 +500,190 @@ void HandleReplicateMessage(int src, int dest, const void *msg, int len);
 void HandleLookupMessage(int src, int dest, const void *msg, int len);
 void HandleReclaimMessage(int src, int dest, const void *msg, int len);
 void HandleReclaimReplicateMessage(int src, int dest, const void *msg, int len);
+void HandleSpillMessage(int src, int dest, const void *msg, int len);
+void HandleSpillFailMessage(int src, int dest, const void *msg, int len);
+void HandleSpillReleaseMessage(int src, int dest, const void *msg, int len);
+void HandleLookupLocalMessage(int src, int dest, const void *msg, int len);
+void HandleStatsMessage(int src, int dest, const void *msg, int len);
+void HandleScanMessage(int src, int dest, const void *msg, int len);
+void HandleWriteMessage(int src, int dest, const void *msg, int len);
+void HandleWriteReplicateMessage(int src, int dest, const void *msg, int len);
+void HandleScanBatchMessage(int src, int dest, const void *msg, int len);
+void HandleScanNextMessage(int src, int dest, const void *msg, int len);
+void HandleEnvelopeMessage(int src, int dest, const void *msg, int len);
+void HandleChainReplicateMessage(int src, int dest, const void *msg, int len);
+void HandleRequestConfirmMessage(int src, int dest, const void *msg, int len);
+void HandleRequestFailMessage(int src, int dest, const void *msg, int len);
+void HandleReplicateConfirmMessage(int src, int dest, const void *msg, int len);
+void HandleLookupConfirmMessage(int src, int dest, const void *msg, int len);
+void HandleLookupFailMessage(int src, int dest, const void *msg, int len);
+void HandleLeaveMessage(int src, int dest, const void *msg, int len);
+void HandleLeaveNoticeMessage(int src, int dest, const void *msg, int len);
+void HandleHandoffMessage(int src, int dest, const void *msg, int len);
+void HandleHandoffConfirmMessage(int src, int dest, const void *msg, int len);
+void HandleHotReplicateMessage(int src, int dest, const void *msg, int len);
+void HandleHotReleaseMessage(int src, int dest, const void *msg, int len);
+void HandleKeyAddedMessage(int src, int dest, const void *msg, int len);
+void HandleLeaseCheckMessage(int src, int dest, const void *msg, int len);
+void HandleLeaseInvalidateMessage(int src, int dest, const void *msg, int len);
+void HandlePathCacheMessage(int src, int dest, const void *msg, int len);
+void HandlePathRenewMessage(int src, int dest, const void *msg, int len);
+void HandleLocateMessage(int src, int dest, const void *msg, int len);
+void HandleLocateResponseMessage(int src, int dest, const void *msg, int len);
+void HandleReplicateOfferMessage(int src, int dest, const void *msg, int len);
+void HandleReplicatePullMessage(int src, int dest, const void *msg, int len);
+void HandleHandoffOfferMessage(int src, int dest, const void *msg, int len);
+void HandleHandoffPullMessage(int src, int dest, const void *msg, int len);
+void HandleChunkInsertMessage(int src, int dest, const void *msg, int len);
+void HandleLeaseInvalidateConfirmMessage(int src, int dest, const void *msg, int len);
+void HandleLeaseTransferMessage(int src, int dest, const void *msg, int len);
+void HandleSpillHandoffMessage(int src, int dest, const void *msg, int len);
 
 /**
- * Route a given message to a destination in the overlay network
+ * Registry of the messages a kernel handles, indexed by type. A message
+ * shorter than min_len of its type is dropped before it is cast to its struct.
+ * min_len only covers the fixed header; the variable part after it is checked
+ * by the Parse* helper reading it or by the handler against len.
+ */
+struct MessageHandler {
+    int type;
+    int min_len;
+    void (*handle)(int src, int dest, const void *msg, int len);
+};
+
+constexpr MessageHandler message_handlers[] = {
+    {JOIN, sizeof(JoinMessage), HandleJoinMessage},
+    {JOIN_RES, sizeof(JoinResponseMessage), HandleJoinResponseMessage},
+    {FLOOD, sizeof(FloodMessage), HandleFloodMessage},
+    {FLOOD_RES, sizeof(Message), HandleFloodResponseMessage},
+    {EXCHANGE, sizeof(ExchangeMessage), HandleExchangeMessage},
+    {EXCHANGE_RES, sizeof(ExchangeResponseMessage), HandleExchangeResponseMessage},
+    {INSERT, data_message_header_size, HandleInsertMessage},
+    {INSERT_CONFIRM, sizeof(FileMessage), HandleRequestConfirmMessage},
+    {REPLICATE, data_message_header_size, HandleReplicateMessage},
+    {REPLICATE_CONFIRM, sizeof(ReplicateConfirmMessage), HandleReplicateConfirmMessage},
+    {LOOK_UP, sizeof(LookupMessage), HandleLookupMessage},
+    {LOOK_UP_CONFIRM, data_message_header_size, HandleLookupConfirmMessage},
+    {LOOK_UP_FAIL, sizeof(FileMessage), HandleLookupFailMessage},
+    {RECLAIM, sizeof(FileMessage), HandleReclaimMessage},
+    {RECLAIM_CONFIRM, sizeof(FileMessage), HandleRequestConfirmMessage},
+    {RECLAIM_FAIL, sizeof(FileMessage), HandleRequestFailMessage},
+    {RECLAIM_REPLICATE, sizeof(FileMessage), HandleReclaimReplicateMessage},
+    {RECLAIM_REPLICATE_CONFIRM, sizeof(FileMessage), HandleReplicateConfirmMessage},
+    {INSERT_FAIL, sizeof(FileMessage), HandleRequestFailMessage},
+    {SPILL, data_message_header_size, HandleSpillMessage},
+    {SPILL_FAIL, sizeof(FileMessage), HandleSpillFailMessage},
+    {SPILL_RELEASE, sizeof(FileMessage), HandleSpillReleaseMessage},
+    {LOOK_UP_LOCAL, sizeof(LookupMessage), HandleLookupLocalMessage},
+    {STATS, sizeof(Message), HandleStatsMessage},
+    {SCAN, sizeof(ScanMessage), HandleScanMessage},
+    {SCAN_BATCH, scan_batch_header_size, HandleScanBatchMessage},
+    {SCAN_NEXT, sizeof(Message), HandleScanNextMessage},
+    {WRITE, write_message_header_size, HandleWriteMessage},
+    {WRITE_REPLICATE, write_message_header_size, HandleWriteReplicateMessage},
+    {LOOK_UP_HEDGE_CONFIRM, data_message_header_size, HandleLookupConfirmMessage},
+    {ENVELOPE, envelope_header_size, HandleEnvelopeMessage},
+    {CHAIN_REPLICATE, chain_message_header_size, HandleChainReplicateMessage},
+    {LEAVE, sizeof(Message), HandleLeaveMessage},
+    {LEAVE_NOTICE, sizeof(LeaveMessage), HandleLeaveNoticeMessage},
+    {HANDOFF, data_message_header_size, HandleHandoffMessage},
+    {HANDOFF_CONFIRM, sizeof(FileMessage), HandleHandoffConfirmMessage},
+    {HANDOFF_FAIL, sizeof(FileMessage), HandleHandoffConfirmMessage},
+    {HOT_REPLICATE, write_message_header_size, HandleHotReplicateMessage},
+    {HOT_RELEASE, sizeof(FileMessage), HandleHotReleaseMessage},
+    {KEY_ADDED, sizeof(FileMessage), HandleKeyAddedMessage},
+    {LOOK_UP_LEASE_CONFIRM, data_message_header_size, HandleLookupConfirmMessage},
+    {LEASE_CHECK, sizeof(FileMessage), HandleLeaseCheckMessage},
+    {LEASE_INVALIDATE, sizeof(FileMessage), HandleLeaseInvalidateMessage},
+    {PATH_CACHE, path_cache_header_size, HandlePathCacheMessage},
+    {PATH_RENEW, sizeof(PathRenewMessage), HandlePathRenewMessage},
+    {LOCATE, sizeof(OfferMessage), HandleLocateMessage},
+    {LOCATE_RES, sizeof(FileMessage), HandleLocateResponseMessage},
+    {REPLICATE_OFFER, sizeof(OfferMessage), HandleReplicateOfferMessage},
+    {REPLICATE_PULL, sizeof(FileMessage), HandleReplicatePullMessage},
+    {HANDOFF_OFFER, sizeof(OfferMessage), HandleHandoffOfferMessage},
+    {HANDOFF_PULL, sizeof(FileMessage), HandleHandoffPullMessage},
+    {CHUNK_INSERT, write_message_header_size, HandleChunkInsertMessage},
+    {LEASE_INVALIDATE_CONFIRM, sizeof(FileMessage), HandleLeaseInvalidateConfirmMessage},
+    {LEASE_TRANSFER, sizeof(LeaseTransferMessage), HandleLeaseTransferMessage},
+    {SPILL_HANDOFF, sizeof(SpillHandoffMessage), HandleSpillHandoffMessage},
+};
+
+constexpr int message_type_count = sizeof(message_handlers) / sizeof(MessageHandler);
+
+constexpr bool IndexedByType(int i) {
+    return i == message_type_count || (message_handlers[i].type == i && IndexedByType(i + 1));
+}
+
+static_assert(IndexedByType(0), "message_handlers must list every message type in order");
+
+/**
+ * Handle a message addressed to this node
  * @param src  original source of the message
- * @param dest destination node id
+ * @param dest pid of this node, 0 for requests of the local user process
  * @param msg  raw message
  * @param len  length of the message
- * @param type type of the message
  */
-void Route(int src, nodeID dest, const void *msg, int len, int type);
+void HandleReceivedMessage(int src, int dest, const void *msg, int len);
+
+/**
+ * Send a message, holding it back to coalesce it with other small messages to the same pid
+ * @param  src  original source of the message
+ * @param  dest pid to send the message to
+ * @param  msg  raw message
+ * @param  len  length of the message
+ * @return      negative if the message couldn't be sent, 0 if it was sent or queued
+ */
+int QueueMessage(int src, int dest, const void *msg, int len);
+
+/**
+ * Send a message right away, counting it in the traffic statistics
+ * @param  src  source pid
+ * @param  dest destination pid, -1 to broadcast
+ * @param  msg  the message
+ * @param  len  length of the message
+ * @return      status of TransmitMessage()
+ */
+int TransmitCounted(int src, int dest, const void *msg, int len);
+
+/**
+ * Add a message we send to the bytes of its kind of traffic
+ * @param msg the message
+ * @param len length of the message
+ */
+void CountTraffic(const void *msg, int len);
+
+/**
+ * Whether nobody waits for a message, so it can be held back for coalescing
+ * @param  msg the message
+ * @param  len length of the message
+ * @return     true for releases, notices and renewals that no request depends on
+ */
+bool IsBackgroundMessage(const void *msg, int len);
+
+/**
+ * Send the envelope of messages queued for a pid
+ * @param pid pid to flush the messages of
+ */
+void FlushOutbox(int pid);
+
+/**
+ * Send the envelopes whose first message waited coalesce_delay
+ * @param all send every envelope regardless of its age
+ */
+void FlushOutboxes(bool all);
+
+/**
+ * Route a given message to a destination in the overlay network
+ * @param  src   original source of the message
+ * @param  dest  destination node id
+ * @param  msg   raw message
+ * @param  len   length of the message
+ * @param  type  type of the message
+ * @param  avoid pid not to forward the message to unless it is the only way forward
+ * @return       pid the message was forwarded to, our own pid if it was handled here
+ */
+int Route(int src, nodeID dest, const void *msg, int len, int type, int avoid = 0);
 
 /**
  * The distance from x(smaller) to y(larger).
@@ -91,655 +704,3723 @@ unsigned short Distance(nodeID x, nodeID y);
 unsigned short AbsoluteDistance(nodeID x, nodeID y);
 
 /**
- * Update leaf set of this node
+ * Rebuild route_candidates from the leaf sets of the virtual nodes
+ */
+void RebuildRouteCandidates();
+
+/**
+ * Update leaf set of every virtual node of this node
  * @param id  the new node id to consider
  * @param src the pid of the node with the new node id
  */
 void UpdateLeafSet(nodeID id, int src);
 
 /**
- * Update the upperhalf of leaf set of this node
- * @param id  the new node id to consider
- * @param src the pid of the node with the new node id
+ * Update leaf set of a virtual node
+ * @param vnode the virtual node to update
+ * @param id    the new node id to consider
+ * @param src   the pid of the node with the new node id
+ */
+void UpdateLeafSet(VirtualNode &vnode, nodeID id, int src);
+
+/**
+ * Update the upperhalf of leaf set of a virtual node
+ * @param vnode the virtual node to update
+ * @param id    the new node id to consider
+ * @param src   the pid of the node with the new node id
  */
-void UpdateUpperLeafSet(nodeID id, int src);
+void UpdateUpperLeafSet(VirtualNode &vnode, nodeID id, int src);
 
 /**
- * Remove the node with the given node id from leaf set
+ * Remove the node with the given node id from leaf set of every virtual node
  * @param id node id of the node to remove
  */
 void RemoveNodeFromLeafSet(nodeID id);
 
 /**
- * Print leaf set with TracePrintf()
+ * Bring every leaf set member hosted by the given pid back to life
+ * @param pid pid of the node that we just heard from
  */
-void PrintLeafSet();
+void MarkAlive(int pid);
 
-void HandleMessage(int src, int dest, const void *msg, int len) {
-    int pid = GetPid();
+/**
+ * The virtual node of this node that is numerically closest to the given id
+ * @param  id node id
+ * @return    closest virtual node
+ */
+VirtualNode& ClosestVirtualNode(nodeID id);
 
-    if (src == 0 && dest == 0 && len == 0) {
-        // periodic alarm, only handle alarm every 2 period
-        if (alarm_round % 2 == 0) {
-            switch (mode) {
-            case RINGSEARCH: {
-                // ring search timeout, increase ring size and redo ring search
-                // https://piazza.com/class/is5hhwlricz17p?cid=51
-                if (hop_count < hop_count_limit) {
-                    RingSearch(GetPid(), ++sequence_number, ++hop_count);
-                } else {
-                    // we cannot find any existing node, assume we are the first node
-                    mode = NORMAL;
-                    joined_overlay_network = true;
-                    // confirm join
-                    int status = 0;
-                    DeliverMessage(src, GetPid(), &status, sizeof(int));
-                    std::cerr << GetPid() << " joined network as first node" << std::endl;
-                }
-                break;
-            }
-            case NORMAL: {
-                // remove dead node from leaf set
-                for (nodeID id : dead_node) {
-                    RemoveNodeFromLeafSet(id);
-                }
-                PrintLeafSet();
-                ExchangeMessage* message = new ExchangeMessage(node_id, leaf_set);
-                for (const auto &e : leaf_set) {
-                    dead_node.insert(e.id);
-                    if (e.pid > 0 && TransmitMessage(GetPid(), e.pid, message, sizeof(ExchangeMessage)) < 0) {
-                        std::cerr << "Fail to send exchange message from "
-                                  << GetPid() << " to " << e.pid << std::endl;
-                    }
-                }
-                delete message;
-                break;
-            }
-            }
-        }
-        alarm_round = (alarm_round + 1) % 2;
-    } else if (src == pid && dest != 0) {
-        // TODO: send message
-        TracePrintf(10, "Send message from %d to %d\n", src, dest);
-    } else if (pid == dest || dest == 0 || dest == -1) {
-        // Received message
-        Message* message = (Message*) msg;
-        switch (message->type) {
-        case JOIN: {
-            HandleJoinMessage(src, dest, msg, len);
-            break;
-        }
-        case JOIN_RES: {
-            HandleJoinResponseMessage(src, dest, msg, len);
-            break;
-        }
-        case FLOOD: {
-            HandleFloodMessage(src, dest, msg, len);
-            break;
-        }
-        case FLOOD_RES: {
-            HandleFloodResponseMessage(src, dest, msg, len);
-            break;
-        }
-        case EXCHANGE: {
-            HandleExchangeMessage(src, dest, msg, len);
-            break;
-        }
-        case EXCHANGE_RES: {
-            HandleExchangeResponseMessage(src, dest, msg, len);
-            break;
-        }
-        case INSERT: {
-            HandleInsertMessage(src, dest, msg, len);
-            break;
-        }
-        case INSERT_CONFIRM: {
-            TracePrintf(10, "Received insert confirmation message from %d\n", src);
-            // forward confirmation
-            int status = 0;
-            DeliverMessage(src, GetPid(), &status, sizeof(int));
-            break;
-        }
-        case REPLICATE: {
-            HandleReplicateMessage(src, dest, msg, len);
-            break;
-        }
-        case REPLICATE_CONFIRM: {
-            TracePrintf(10, "Received replicate confirmation message from %d\n", src);
-            ReplicateConfirmMessage* message = (ReplicateConfirmMessage*) msg;
-            confirmation_waiting_map[message->fid].second--;
-            TracePrintf(10, "Still need %d confirmations\n", confirmation_waiting_map[message->fid].second);
-            if (confirmation_waiting_map[message->fid].second == 0) {
-                // send insert confirmation message
-                if (GetPid() == confirmation_waiting_map[message->fid].first) {
-                    // current node is the destination
-                    int status = 0;
-                    DeliverMessage(GetPid(), GetPid(), &status, sizeof(int));
-                } else {
-                    TracePrintf(10, "Send insert confirm from %d to %d\n", GetPid(), confirmation_waiting_map[message->fid].first);
-                    Message* reply = new Message(INSERT_CONFIRM);
-                    if (TransmitMessage(GetPid(), confirmation_waiting_map[message->fid].first, reply, sizeof(Message)) < 0) {
-                        std::cerr << "Fail to send insert confirmation from "
-                                  << GetPid() << " to " << confirmation_waiting_map[message->fid].first << std::endl;
-                    }
-                    delete reply;
-                }
-            }
-            break;
-        }
-        case LOOK_UP: {
-            HandleLookupMessage(src, dest, msg, len);
-            break;
-        }
-        case LOOK_UP_CONFIRM: {
-            TracePrintf(10, "Received look up response from %d of length %d\n", src, len);
-            int status = 0;
-            // we get the file
-            int file_len = len - data_message_header_size;
-            status = file_len;
-            char* buf = new char[file_len];
-            ParseDataMessageContent(msg, len, buf, file_len);
-            DeliverMessage(src, dest, &status, sizeof(int));
-            DeliverMessage(src, dest, buf, file_len);
-            delete[] buf;
-            break;
-        }
-        case LOOK_UP_FAIL: {
-            int status = -1;
-            DeliverMessage(src, dest, &status, sizeof(int));
-            break;
-        }
-        case RECLAIM: {
-            HandleReclaimMessage(src, dest, msg, len);
-            break;
-        }
-        case RECLAIM_CONFIRM: {
-            TracePrintf(10, "Received reclaim confirmation message from %d\n", src);
-            // forward confirmation
-            int status = 0;
-            DeliverMessage(src, GetPid(), &status, sizeof(int));
-            break;
-        }
-        case RECLAIM_FAIL: {
-            TracePrintf(10, "Received reclaim fail message from %d\n", src);
-            int status = -1;
-            DeliverMessage(src, GetPid(), &status, sizeof(int));
-            break;
-        }
-        case RECLAIM_REPLICATE: {
-            HandleReclaimReplicateMessage(src, dest, msg, len);
-            break;
-        }
-        case RECLAIM_REPLICATE_CONFIRM: {
-            TracePrintf(10, "Received reclaim replicate confirmation message from %d\n", src);
-            FileMessage* message = (FileMessage*) msg;
-            confirmation_waiting_map[message->fid].second--;
-            TracePrintf(10, "Still need %d confirmations\n", confirmation_waiting_map[message->fid].second);
-            if (confirmation_waiting_map[message->fid].second == 0) {
-                if (GetPid() == confirmation_waiting_map[message->fid].first) {
-                    //current node is the destination
-                    int status = 0;
-                    DeliverMessage(GetPid(), GetPid(), &status, sizeof(int));
-                } else {
-                    // send reclaim confirmation message
-                    Message* reply = new Message(RECLAIM_CONFIRM);
-                    if (TransmitMessage(GetPid(), confirmation_waiting_map[message->fid].first, reply, sizeof(Message)) < 0) {
-                        std::cerr << "Fail to send reclaim confirmation from "
-                                  << GetPid() << " to " << confirmation_waiting_map[message->fid].first << std::endl;
-                    }
-                    delete reply;
-                }
-            }
-            break;
-        }
-        default:
-            std::cerr << "Unknown message type: " << message->type << std::endl;
-            break;
-        }
-    }
-}
+/**
+ * Derive the node id of a virtual node
+ * @param  id    node id given to Join()
+ * @param  index index of the virtual node
+ * @return       node id of the virtual node
+ */
+nodeID VirtualNodeID(nodeID id, int index);
 
-void HandleJoinMessage(int src, int dest, const void *msg, int len) {
-    TracePrintf(10, "Received join message from %d\n", src);
-    JoinMessage* message = (JoinMessage*) msg;
-    if (GetPid() == src) {
-        // this is the initial join message
-        node_id = message->id;
-        RingSearch(GetPid(), ++sequence_number, ++hop_count);
-    } else {
-        // this is the join message from some other node that is
-        // not in the overlay network. Route it.
-        Route(src, message->id, msg, len, JOIN);
-    }
-}
+/**
+ * Route a join message for every virtual node other than the first one
+ * @param contact pid of a node in the overlay network
+ */
+void JoinVirtualNodes(int contact);
 
-void HandleJoinResponseMessage(int src, int dest, const void *msg, int len) {
-    if (mode == JOINING) {
-        TracePrintf(10, "Received join response message from %d\n", src);
-        mode = NORMAL;
-        JoinResponseMessage* message = (JoinResponseMessage*) msg;
-        joined_overlay_network = true;
-        std::copy(message->leaf_set, message->leaf_set + P2P_LEAF_SIZE, leaf_set);
-        UpdateLeafSet(message->id, src);
+/**
+ * The key on the ring a file is placed at
+ * @param  fid fileID
+ * @return     the fileID itself, or its hash if hash_file_ids is set or the
+ *             fileID is one of a chunk, so that the chunks of a stream spread out
+ */
+nodeID PlacementKey(fileID fid);
 
-        // confirm join
-        int status = 0;
-        DeliverMessage(src, GetPid(), &status, sizeof(int));
-        std::cerr << GetPid() << " joined by attaching to " << src << std::endl;
-    }
-}
+/**
+ * The pid of a leaf set entry if it is hosted by another kernel
+ * @param  e leaf set entry
+ * @return   pid of the entry, 0 if the entry is empty or one of our virtual nodes
+ */
+int RemotePid(const Entry &e);
 
-void RingSearch(int src, int sequence_number, int hop_count) {
-    TracePrintf(10, "RingSearch with sequence number %d and hop count %d\n",
-                sequence_number, hop_count);
-    mode = RINGSEARCH;
-    FloodMessage* message = new FloodMessage(sequence_number, hop_count);
-    if (TransmitMessage(src, -1, message, sizeof(FloodMessage)) < 0) {
-        std::cerr << "Fail to send flood message from " << src << std::endl;
-    }
-    delete message;
-}
+/**
+ * Report the files of a virtual node that are part of a scan to the origin of the
+ * scan, then pass the scan on to the successor of the virtual node if the scanned
+ * range is not covered yet.
+ * @param origin  pid of the node that started the scan
+ * @param vnode   virtual node that owns the cursor of the scan
+ * @param message the scan message
+ */
+void ScanVirtualNode(int origin, const VirtualNode &vnode, const ScanMessage* message);
 
-void HandleFloodMessage(int src, int dest, const void *msg, int len) {
-    TracePrintf(10, "Received flood message from %d\n", src);
-    int pid = GetPid();
-    FloodMessage* fmessage = (FloodMessage*) msg;
-    if (sequence_number_map.find(src) != sequence_number_map.end()
-            && fmessage->sequence_number <= sequence_number_map[src]) {
+/**
+ * Send a scan batch to the node that started the scan
+ * @param origin pid of the node that started the scan
+ * @param batch  the batch
+ * @param len    length of the batch
+ */
+void SendScanBatch(int origin, const char* batch, int len);
+
+/**
+ * Deliver the next scan batch to the user process if it is waiting for it
+ * and the batch has arrived
+ */
+void DeliverScanBatch();
+
+/**
+ * Send a confirmation or failure message to the node that originated a request.
+ * If the current node is the origin, the status is delivered to the user process directly.
+ * @param origin pid of the origin node
+ * @param type   type of the message to send
+ * @param fid    fileID the request is about
+ * @param status status to deliver to the user process
+ */
+void ReplyToOrigin(int origin, int type, fileID fid, int status);
+
+/**
+ * Number of look ups this node served recently
+ */
+int LookupLoad();
+
+/**
+ * Load of a leaf set member as last advertised to us
+ * @param  id node id of the member
+ * @return    recent look ups of the member, -1 if it never advertised its load
+ */
+int NeighborLoad(nodeID id);
+
+/**
+ * Remember that our copy of a file came from the root as one of its immediate
+ * replicas. Ignored unless root is the node we route the file to.
+ * @param fid  fileID
+ * @param root pid of the root that sent the copy
+ */
+void NoteReplicaRoot(fileID fid, int root);
+
+/**
+ * Whether our copy of a file may answer a look up passing us on the way to its
+ * root: the copy came from the node we route the file to as one of its immediate
+ * replicas, and that node has advertised us as an immediate neighbor ever since,
+ * so it sent us every change. An old root, spilled, hot and leftover copies don't.
+ * @param  fid fileID
+ * @return     whether the copy is the current version of the root
+ */
+bool IsCurrentReplica(fileID fid);
+
+/**
+ * Pick the copy of a file a look up at its root is served from
+ * @param  root virtual node that is the root of the file
+ * @param  fid  fileID, its extra read replicas are candidates too
+ * @return      index in the leaf set of the replica to pass the look up to,
+ *              -1 if the root should answer itself
+ */
+int SelectReplica(const VirtualNode &root, fileID fid);
+
+/**
+ * Answer the join of a node we are the root of, or add it to the current batch
+ * @param id  nodeID of the joining node
+ * @param pid pid of the joining node
+ */
+void QueueJoin(nodeID id, int pid);
+
+/**
+ * Answer the current batch of joins once its first join waited join_batch_delay
+ * @param all answer the batch regardless of its age
+ */
+void FlushJoins(bool all);
+
+/**
+ * Send a joiner the leaf set it would build from a pool of known nodes
+ * @param joiner node to send the leaf set to
+ * @param pool   known nodes, entries of the joiner's own kernel are skipped
+ * @param news   only send it if the leaf set has one of these nodes, NULL to always send
+ */
+void SendJoinLeafSet(const Joiner &joiner, const std::vector<Entry> &pool,
+                     const std::vector<Joiner> *news);
+
+/**
+ * Record a change of the leaf sets of this kernel
+ */
+void NoteLeafSetChange();
+
+/**
+ * Whether no member of our leaf sets is closer to the placement key of a file than we are
+ * @param  fid the file
+ * @return     whether we are the root of the file
+ */
+bool IsRootOf(fileID fid);
+
+/**
+ * Take over the files we are now the root of, hand the ones a node that joined
+ * is closer to over to it, and offer the files we are the root of to our
+ * immediate neighbors
+ */
+void RepairReplicas();
+
+/**
+ * Count a look up of a file this node is the root of, and give the file extra
+ * read replicas once it is hot and replicate_hot_keys is set
+ * @param root virtual node the look up reached
+ * @param fid  fileID
+ */
+void CountLookup(const VirtualNode &root, fileID fid);
+
+/**
+ * Release the extra read replicas of a file
+ * @param fid fileID
+ */
+void ReleaseHotReplicas(fileID fid);
+
+/**
+ * Release the extra replicas of files that cooled down
+ */
+void CoolHotKeys();
+
+/**
+ * Rebuild the summary of the fileIDs this kernel stores or is the root of
+ */
+void RebuildKeyFilter();
+
+/**
+ * Remember the key summary and leaf set a leaf set member sent in an exchange
+ * @param id       nodeID of the member
+ * @param pid      pid of the member
+ * @param keys     its key summary
+ * @param leaf_set its leaf set
+ */
+void UpdateSummary(nodeID id, int pid, const KeyFilter &keys, const Entry* leaf_set);
+
+/**
+ * Whether a key summary is recent and its leaf set settled, so that it shows the
+ * files stored while the leaf sets were changing
+ * @param  summary key summary of a node
+ * @return         whether it arrived in the last summary_settle_rounds exchange periods
+ *                 and its leaf set didn't change in that time
+ */
+bool SettledSummary(const NeighborSummary &summary);
+
+/**
+ * Whether the key summaries show that the file doesn't exist. Only true if the
+ * next hop is the root of the file as far as its own leaf set tells, we are in that
+ * leaf set so that we hear of new files, no member of it may have the file, and
+ * all of their summaries are settled.
+ * @param  id  nodeID of the next hop
+ * @param  fid fileID
+ * @return     whether the file is known to be missing
+ */
+bool KnownMissing(nodeID id, fileID fid);
+
+/**
+ * Find a leaf set member whose key summary says it may have a file
+ * @param  root virtual node that is the root of the file
+ * @param  fid  fileID
+ * @return      pid of the member, 0 if there is none
+ */
+int SummaryHolder(const VirtualNode &root, fileID fid);
+
+/**
+ * Remember that a node holds a lease on a file we are the root of
+ * @param fid fileID
+ * @param pid pid of the node
+ */
+void GrantLease(fileID fid, int pid);
+
+/**
+ * Tell the holders of leases on a file that it changes, and the holders that
+ * haven't confirmed an earlier invalidation again
+ * @param fid fileID
+ */
+void InvalidateLeases(fileID fid);
+
+/**
+ * Whether no node may still read a cached copy of a file we changed: every holder
+ * confirmed the invalidation or its lease ran out, and no lease we don't know of
+ * may be left from before we became the root of the file
+ * @param  fid fileID
+ * @return     whether a change of the file may be confirmed
+ */
+bool LeasesRevoked(fileID fid);
+
+/**
+ * Hand the leases granted on a file to its new root, and forget them
+ * @param fid   fileID
+ * @param owner pid of the new root
+ */
+void TransferLeases(fileID fid, int owner);
+
+/**
+ * Drop the leases that expired, granted and held, and confirm the changes that
+ * only waited for them
+ */
+void ExpireLeases();
+
+/**
+ * Version stamp of a file this node is the root of
+ * @param  fid fileID
+ * @return     stamp, unique among the versions of the file
+ */
+int FileVersion(fileID fid);
+
+/**
+ * Answer a look up passing this node from its path cache
+ * @param  src     pid of the node that requested the file
+ * @param  message the look up
+ * @param  version set to the version of our copy if it expired
+ * @return         whether the look up was answered
+ */
+bool ServePathCopy(int src, const LookupMessage* message, int* version);
+
+/**
+ * Renew the copy of the node that forwarded a look up to us if its version matches,
+ * or push it a new one if the file is popular enough
+ * @param via      pid of the node that forwarded the look up, 0 if none did
+ * @param fid      fileID
+ * @param data     content of the file
+ * @param file_len length of the file
+ * @param version  version of our copy
+ * @param ttl      milliseconds our copy is good for
+ * @param cached   version of the copy of via, 0 if it has none
+ */
+void PushPathCopy(int via, fileID fid, char* data, int file_len, int version, int ttl, int cached);
+
+/**
+ * Remove a file from the path cache
+ * @param fid fileID
+ */
+void DropPathCopy(fileID fid);
+
+/**
+ * Whether the local user process changed a file recently enough that its look ups
+ * skip the cached copies
+ * @param fid fileID
+ */
+bool RecentlyWritten(fileID fid);
+
+/**
+ * Hand off the files this node is the root of that weren't handed off yet,
+ * and finish leaving if there are none left
+ */
+void HandOffFiles();
+
+/**
+ * Send a file this node is the root of, and the leases on it, to the node that
+ * becomes its root when we leave or that joined closer to it
+ * @param  fid      fileID
+ * @param  attempts number of times the handoff was sent before
+ * @return          whether there is a node to hand the file to
+ */
+bool SendHandoff(fileID fid, int attempts);
+
+/**
+ * Send again the handoffs that weren't confirmed in time
+ */
+void ExpireHandoffs();
+
+/**
+ * Tell the leaf set members that we leave, drop our files and answer Leave()
+ */
+void FinishLeave();
+
+/**
+ * Milliseconds on a monotonic clock, the recorded time while a log is replayed
+ */
+long NowMillis();
+
+/**
+ * Append a call of HandleMessage to the message log of this kernel
+ * @param src  source pid
+ * @param dest destination pid
+ * @param msg  the message
+ * @param len  length of the message
+ */
+void RecordMessage(int src, int dest, const void *msg, int len);
+
+/**
+ * Delay before a pending look up is hedged
+ * @return hedge_percentile latency of recent look ups in milliseconds
+ */
+int HedgeDelay();
+
+/**
+ * Send the second request of every pending look up that waited longer than HedgeDelay()
+ */
+void SendHedges();
+
+/**
+ * Remember a request of the local user process until it is answered
+ * @param fid fileID the request is about
+ * @param msg the request
+ * @param len length of the request
+ */
+void TrackRequest(fileID fid, const void *msg, int len);
+
+/**
+ * Send a request of the local user process for a chunk of a stream, or hold it
+ * back while stream_window of them are in flight
+ * @param msg the request
+ * @param len length of the request
+ */
+void SubmitChunkRequest(const void *msg, int len);
+
+/**
+ * Send the held back chunk requests that fit in the stream window
+ */
+void ReleaseChunkRequests();
+
+/**
+ * Route a request of the local user process towards the root of its file, or a
+ * LOCATE for it if its payload is sent to the root directly
+ * @param fid   fileID the request is about
+ * @param msg   the request
+ * @param len   length of the request
+ * @param avoid pid the previous attempt was sent to, 0 for the first attempt
+ */
+void RouteRequest(fileID fid, const void *msg, int len, int avoid);
+
+/**
+ * Retry every request of the local user process whose attempt timed out, and
+ * fail the ones that ran out of retries
+ */
+void ExpireRequests();
+
+/**
+ * Stop waiting for confirmations that didn't arrive in time. The origin of the
+ * request retries it. A change only waiting for leases to be revoked is kept, the
+ * leases run out within lease_duration.
+ */
+void ExpireConfirmations();
+
+/**
+ * Wait for the copies of a changed file to confirm before the origin is answered
+ * @param origin     pid of the node that sent the request
+ * @param fid        fileID
+ * @param count      number of confirmations to wait for
+ * @param reply_type INSERT_CONFIRM or RECLAIM_CONFIRM
+ */
+void AwaitConfirmations(int origin, fileID fid, int count, int reply_type);
+
+/**
+ * Answer the origin of a change once all copies confirmed it and the leases on
+ * the file are revoked
+ * @param fid fileID
+ */
+void FinishConfirmation(fileID fid);
+
+/**
+ * Account for an answer to a request of the local user process
+ * @param  fid     fileID
+ * @param  hedge   whether the answer came from the second request of a hedged look up
+ * @param  success whether the request succeeded
+ * @return         whether the answer should be delivered to the user process
+ */
+bool FinishRequest(fileID fid, bool hedge, bool success);
+
+/**
+ * Print leaf set with TracePrintf()
+ */
+void PrintLeafSet();
+
+/**
+ * Store a file in file_map, freeing any existing copy of it
+ * @param  fid      fileID
+ * @param  data     content of the file allocated with new[], owned by file_map afterwards
+ *                  and freed right away if the same content is stored already
+ * @param  file_len length of the content
+ * @return          the stored content, to be used instead of data from then on
+ */
+char* StoreFile(fileID fid, char* data, int file_len);
+
+/**
+ * Add a reference to a content, sharing an equal one that is already stored
+ * @param  data content allocated with new[], freed if an equal one is shared instead
+ * @param  len  length of the content
+ * @return      the stored content
+ */
+char* AcquireContent(char* data, int len);
+
+/**
+ * Drop a reference to a stored content and free it with its last reference
+ * @param data stored content
+ * @param len  length of the content
+ */
+void ReleaseContent(char* data, int len);
+
+/**
+ * Whether file_map has a file with the given content
+ * @param  fid  fileID
+ * @param  len  length of the content, -1 never matches
+ * @param  hash content hash
+ * @return      whether the stored copy matches
+ */
+bool HasContent(fileID fid, int len, unsigned long long hash);
+
+/**
+ * Offer a file we are the root of and already have to the replicas, and wait for
+ * their confirmations before confirming to the origin
+ * @param origin pid of the node that requested the insert
+ * @param root   virtual node that is the root of the file
+ * @param fid    fileID
+ */
+void OfferReplicas(int origin, const VirtualNode &root, fileID fid);
+
+/**
+ * Send a new version of a file we are the root of to its replicas, and wait for
+ * their confirmations before confirming the insert to the origin
+ * @param origin pid of the node that requested the insert
+ * @param fid    fileID
+ * @param data   content of the new version
+ * @param len    length of the content
+ * @param holder pid the file is spilled to, which has a copy already, 0 if none
+ */
+void ReplicateInsert(int origin, fileID fid, const char* data, int len, int holder);
+
+/**
+ * Drop our copy of a file and the pointer to where it was spilled, once a new
+ * version replaces them
+ * @param fid    fileID
+ * @param holder pid the new version is spilled to, 0 if we store it ourselves
+ */
+void DropOldVersion(fileID fid, int holder);
+
+/**
+ * Make a spilled new version of a file the current one after its holder confirmed
+ * @param fid fileID
+ */
+void CommitSpill(fileID fid);
+
+/**
+ * Remove a file from file_map and free it
+ * @param  fid fileID
+ * @return     whether the file was stored at this node
+ */
+bool RemoveFile(fileID fid);
+
+/**
+ * Check whether a file fits into the storage budget of this node. The existing
+ * copy of the file, if any, is considered to be replaced.
+ * @param  fid      fileID
+ * @param  file_len length of the new content
+ * @return          whether the file fits
+ */
+bool FitsInStorage(fileID fid, int file_len);
+
+/**
+ * Number of bytes this node can still store
+ */
+int FreeCapacity();
+
+/**
+ * Find the leaf set member of a virtual node with the most advertised free
+ * capacity that can hold a file of the given length
+ * @param  vnode    virtual node that is the root of the file
+ * @param  file_len length of the file to spill
+ * @return          index in leaf set, -1 if no member has enough space
+ */
+int FindSpillTarget(const VirtualNode &vnode, int file_len);
+
+/**
+ * Answer a look up from file_map of this node without routing it any further
+ * @param src     pid of the node that requested the file
+ * @param fid     fileID
+ * @param offset  offset of the first byte to send back
+ * @param buf_len length of the requester's buffer
+ * @param hedge   whether the look up is the second request of a hedged look up
+ * @param lease   whether the root granted the requester a lease on the file
+ */
+void ServeLookup(int src, fileID fid, int offset, int buf_len, bool hedge = false, bool lease = false);
+
+/**
+ * Send the requested part of a file in reply to a look up
+ * @param src      pid of the node that requested the file
+ * @param fid      fileID
+ * @param data     content of the file
+ * @param file_len length of the file
+ * @param offset   offset of the first byte to send back
+ * @param buf_len  length of the requester's buffer
+ * @param type     type of the reply
+ */
+void SendFilePart(int src, fileID fid, char* data, int file_len, int offset, int buf_len, int type);
+
+/**
+ * Overwrite part of a stored file, growing it if the patch goes past its end
+ * @param fid       fileID
+ * @param offset    where the patch starts, at most the length of the file
+ * @param patch     new content
+ * @param patch_len length of the new content
+ */
+void PatchFile(fileID fid, int offset, const char* patch, int patch_len);
+
+void HandleMessage(int src, int dest, const void *msg, int len) {
+    int pid = GetPid();
+    if (record_messages && replay_time < 0) {
+        RecordMessage(src, dest, msg, len);
+    }
+
+    if (src == 0 && dest == 0 && len == 0) {
+        FlushOutboxes(true);
+        if (kernel->mode == NORMAL) {
+            FlushJoins(true);
+            ExpireRequests();
+            ExpireConfirmations();
+            ExpireLeases();
+            ExpireHandoffs();
+            if (hedge_lookups) {
+                SendHedges();
+            }
+        } else if (kernel->mode == LEAVING) {
+            ExpireHandoffs();
+        }
+        // periodic alarm, only handle alarm every 2 period
+        if (kernel->alarm_round % 2 == 0) {
+            switch (kernel->mode) {
+            case RINGSEARCH: {
+                // ring search timeout, increase ring size and redo ring search
+                // https://piazza.com/class/is5hhwlricz17p?cid=51
+                if (kernel->hop_count < hop_count_limit) {
+                    RingSearch(GetPid(), ++kernel->sequence_number, ++kernel->hop_count);
+                } else {
+                    // we cannot find any existing node, assume we are the first node
+                    kernel->mode = NORMAL;
+                    kernel->joined_overlay_network = true;
+                    JoinVirtualNodes(0);
+                    // confirm join
+                    int status = 0;
+                    DeliverMessage(src, GetPid(), &status, sizeof(int));
+                    std::cerr << GetPid() << " joined network as first node" << std::endl;
+                }
+                break;
+            }
+            case JOINING: {
+                if (NowMillis() < kernel->join_expires_at) {
+                    break;
+                }
+                kernel->hop_count = 0;
+                if (kernel->join_attempts < request_retry_limit) {
+                    // the join or its response got lost, look for a contact again
+                    kernel->join_attempts++;
+                    RingSearch(GetPid(), ++kernel->sequence_number, ++kernel->hop_count);
+                } else {
+                    kernel->mode = NORMAL;
+                    kernel->join_attempts = 0;
+                    int status = TIMEOUT_ERROR;
+                    DeliverMessage(GetPid(), GetPid(), &status, sizeof(int));
+                    std::cerr << GetPid() << " timed out joining network" << std::endl;
+                }
+                break;
+            }
+            case LEAVING:
+                // keep exchanging so that we aren't evicted before the handoff is done
+            case NORMAL: {
+                // remove dead node from leaf set
+                for (nodeID id : kernel->dead_node) {
+                    RemoveNodeFromLeafSet(id);
+                }
+                PrintLeafSet();
+                if (repair_replicas && kernel->mode == NORMAL
+                        && kernel->repaired_change_count != kernel->leaf_set_change_count) {
+                    RepairReplicas();
+                }
+                kernel->exchange_round++;
+                kernel->lookup_load = kernel->served_lookups;
+                kernel->served_lookups = 0;
+                RebuildKeyFilter();
+                kernel->lookup_sketch.Decay();
+                if (replicate_hot_keys) {
+                    CoolHotKeys();
+                }
+                for (auto &vnode : kernel->virtual_nodes) {
+                    ExchangeMessage message(vnode.id, vnode.leaf_set, FreeCapacity(), kernel->lookup_load,
+                                            kernel->local_keys);
+                    for (const auto &e : vnode.leaf_set) {
+                        if (RemotePid(e) == 0) {
+                            continue;
+                        }
+                        kernel->dead_node.insert(e.id);
+                        if (TransmitCounted(GetPid(), e.pid, &message, sizeof(ExchangeMessage)) < 0) {
+                            std::cerr << "Fail to send exchange message from "
+                                      << GetPid() << " to " << e.pid << std::endl;
+                        }
+                    }
+                }
+                break;
+            }
+            }
+        }
+        kernel->alarm_round = (kernel->alarm_round + 1) % 2;
+    } else if (src == pid && dest != 0) {
+        // TODO: send message
+        TracePrintf(10, "Send message from %d to %d\n", src, dest);
+    } else if (pid == dest || dest == 0 || dest == -1) {
+        HandleReceivedMessage(src, dest, msg, len);
+    }
+    FlushJoins(false);
+    FlushOutboxes(false);
+}
+
+void HandleReceivedMessage(int src, int dest, const void *msg, int len) {
+    int type = -1;
+    if (len >= (int) sizeof(int)) {
+        std::memcpy(&type, msg, sizeof(int));
+    }
+    if (type < 0 || type >= message_type_count || message_handlers[type].handle == NULL) {
+        std::cerr << "Unknown message type: " << type << std::endl;
+        return;
+    }
+    if (len < message_handlers[type].min_len) {
+        std::cerr << "Drop message of type " << type << " from " << src
+                  << " with length " << len << std::endl;
+        return;
+    }
+    message_handlers[type].handle(src, dest, msg, len);
+}
+
+void HandleRequestConfirmMessage(int src, int dest, const void *msg, int len) {
+    TracePrintf(10, "Received confirmation message from %d\n", src);
+    const FileMessage* message = (const FileMessage*) msg;
+    if (!FinishRequest(message->fid, false, true)) {
+        // answer to an attempt we already gave up on
+        return;
+    }
+    if (kernel->recent_writes.find(message->fid) != kernel->recent_writes.end()) {
+        // copies cached before the change may be renewed until path_cache_ttl from now
+        kernel->recent_writes[message->fid] = NowMillis() + path_cache_ttl;
+    }
+    // forward confirmation
+    int status = 0;
+    DeliverMessage(src, GetPid(), &status, sizeof(int));
+}
+
+void HandleRequestFailMessage(int src, int dest, const void *msg, int len) {
+    TracePrintf(10, "Received fail message from %d\n", src);
+    const FileMessage* message = (const FileMessage*) msg;
+    if (!FinishRequest(message->fid, false, false)) {
+        return;
+    }
+    int status = -1;
+    DeliverMessage(src, GetPid(), &status, sizeof(int));
+}
+
+void HandleReplicateConfirmMessage(int src, int dest, const void *msg, int len) {
+    TracePrintf(10, "Received replicate confirmation message from %d\n", src);
+    const FileMessage* message = (const FileMessage*) msg;
+    auto spill = kernel->pending_spills.find(message->fid);
+    if (spill != kernel->pending_spills.end() && spill->second.holder.pid == src) {
+        // the holder stored the new version, now it can replace the old one
+        CommitSpill(message->fid);
+        return;
+    }
+    if (kernel->confirmation_waiting_map.find(message->fid) == kernel->confirmation_waiting_map.end()) {
+        // the request has already been failed
+        return;
+    }
+    ConfirmationWait &wait = kernel->confirmation_waiting_map[message->fid];
+    wait.wait_count--;
+    TracePrintf(10, "Still need %d confirmations\n", wait.wait_count);
+    FinishConfirmation(message->fid);
+}
+
+void HandleLookupConfirmMessage(int src, int dest, const void *msg, int len) {
+    TracePrintf(10, "Received look up response from %d of length %d\n", src, len);
+    const Message* message = (const Message*) msg;
+    // we get the file
+    int file_len = len - data_message_header_size;
+    int status = file_len;
+    fileID fid = 0;
+    ParseDataMessageHeader(msg, len, &fid);
+    auto pending = kernel->pending_requests.find(fid);
+    if (message->type == LOOK_UP_LEASE_CONFIRM && pending != kernel->pending_requests.end()) {
+        // the lease started after we sent the look up
+        kernel->client_leases[fid] = pending->second.sent_at + lease_duration;
+    }
+    if (!FinishRequest(fid, message->type == LOOK_UP_HEDGE_CONFIRM, true)) {
+        // the other request of a hedged look up was faster
+        return;
+    }
+    if (kernel->tagged_lookups.erase(fid) > 0) {
+        // deliver status, fileID and content as one message
+        char* reply = new char[len];
+        std::memcpy(reply, msg, len);
+        std::memcpy(reply, &status, sizeof(int));
+        DeliverMessage(src, dest, reply, len);
+        delete[] reply;
+        return;
+    }
+    DeliverMessage(src, dest, &status, sizeof(int));
+    DeliverMessage(src, dest, (char*) msg + data_message_header_size, file_len);
+}
+
+void HandleLookupFailMessage(int src, int dest, const void *msg, int len) {
+    const FileMessage* message = (const FileMessage*) msg;
+    if (!FinishRequest(message->fid, false, false)) {
+        return;
+    }
+    if (kernel->tagged_lookups.erase(message->fid) > 0) {
+        FileMessage reply(-1, message->fid);
+        DeliverMessage(src, dest, &reply, sizeof(FileMessage));
+        return;
+    }
+    int status = -1;
+    DeliverMessage(src, dest, &status, sizeof(int));
+}
+
+void HandleJoinMessage(int src, int dest, const void *msg, int len) {
+    TracePrintf(10, "Received join message from %d\n", src);
+    JoinMessage* message = (JoinMessage*) msg;
+    if (GetPid() == src && dest == 0) {
+        // this is the initial join message
+        kernel->node_id = message->id;
+        for (int i = 1; i < virtual_node_count; i++) {
+            kernel->virtual_nodes[i].id = VirtualNodeID(kernel->node_id, i);
+        }
+        // virtual nodes of the same kernel are neighbors of each other
+        for (const auto &vnode : kernel->virtual_nodes) {
+            UpdateLeafSet(vnode.id, GetPid());
+        }
+        RingSearch(GetPid(), ++kernel->sequence_number, ++kernel->hop_count);
+    } else {
+        // this is the join message from some other node that is
+        // not in the overlay network. Route it.
+        Route(src, message->id, msg, len, JOIN);
+    }
+}
+
+void HandleJoinResponseMessage(int src, int dest, const void *msg, int len) {
+    if (kernel->mode == JOINING) {
+        TracePrintf(10, "Received join response message from %d\n", src);
+        kernel->mode = NORMAL;
+        JoinResponseMessage* message = (JoinResponseMessage*) msg;
+        kernel->joined_overlay_network = true;
+        kernel->join_attempts = 0;
+        std::copy(message->leaf_set, message->leaf_set + P2P_LEAF_SIZE, kernel->leaf_set);
+        NoteLeafSetChange();
+        UpdateLeafSet(message->id, src);
+        for (Entry e : message->leaf_set) {
+            UpdateLeafSet(e.id, e.pid);
+        }
+        JoinVirtualNodes(src);
+
+        // confirm join
+        int status = 0;
+        DeliverMessage(src, GetPid(), &status, sizeof(int));
+        std::cerr << GetPid() << " joined by attaching to " << src << std::endl;
+    } else if (kernel->joined_overlay_network) {
+        // response to the join of one of our other virtual nodes
+        TracePrintf(10, "Received virtual node join response message from %d\n", src);
+        JoinResponseMessage* message = (JoinResponseMessage*) msg;
+        UpdateLeafSet(message->id, src);
+        for (Entry e : message->leaf_set) {
+            UpdateLeafSet(e.id, e.pid);
+        }
+    }
+}
+
+void HandleLeaveMessage(int src, int dest, const void *msg, int len) {
+    if (dest != 0) {
+        return;
+    }
+    if (kernel->mode != NORMAL || !kernel->joined_overlay_network) {
+        int status = -1;
+        DeliverMessage(GetPid(), GetPid(), &status, sizeof(int));
+        return;
+    }
+    TracePrintf(10, "%04x starts leaving with %d files\n", kernel->node_id,
+                (int) kernel->primary_index.size());
+    kernel->mode = LEAVING;
+    kernel->handed_off.clear();
+    kernel->handoff_failed = false;
+    HandOffFiles();
+}
+
+void HandleLeaveNoticeMessage(int src, int dest, const void *msg, int len) {
+    const LeaveMessage* message = (const LeaveMessage*) msg;
+    TracePrintf(10, "%04x leaves, notified by %d\n", message->id, src);
+    RemoveNodeFromLeafSet(message->id);
+    // evict it again if a dated exchange message brings it back
+    kernel->dead_node.insert(message->id);
+    kernel->neighbor_capacity.erase(message->id);
+    kernel->neighbor_load.erase(message->id);
+    for (Entry e : message->leaf_set) {
+        if (e.pid != src && kernel->dead_node.find(e.id) == kernel->dead_node.end()) {
+            UpdateLeafSet(e.id, e.pid);
+        }
+    }
+}
+
+void HandleHandoffMessage(int src, int dest, const void *msg, int len) {
+    fileID fid = 0;
+    ParseDataMessageHeader(msg, len, &fid);
+    int file_len = len - data_message_header_size;
+    int type = HANDOFF_FAIL;
+    if (FitsInStorage(fid, file_len)) {
+        char* data = new char[file_len];
+        ParseDataMessageContent(msg, len, data, file_len);
+        StoreFile(fid, data, file_len);
+        kernel->primary_index.insert(fid);
+        type = HANDOFF_CONFIRM;
+        TracePrintf(10, "Take over file %d of size %d from %d\n", fid, file_len, src);
+    }
+    FileMessage reply(type, fid);
+    if (QueueMessage(GetPid(), src, &reply, sizeof(FileMessage)) < 0) {
+        std::cerr << "Fail to send handoff reply from "
+                  << GetPid() << " to " << src << std::endl;
+    }
+}
+
+void HandleHandoffOfferMessage(int src, int dest, const void *msg, int len) {
+    const OfferMessage* message = (const OfferMessage*) msg;
+    if (!HasContent(message->fid, message->len, message->hash)) {
+        FileMessage pull(HANDOFF_PULL, message->fid);
+        if (QueueMessage(GetPid(), src, &pull, sizeof(FileMessage)) < 0) {
+            std::cerr << "Fail to send handoff pull from "
+                      << GetPid() << " to " << src << std::endl;
+        }
+        return;
+    }
+    kernel->primary_index.insert(message->fid);
+    TracePrintf(10, "Take over file %d from %d with the copy we have\n", message->fid, src);
+    FileMessage reply(HANDOFF_CONFIRM, message->fid);
+    if (QueueMessage(GetPid(), src, &reply, sizeof(FileMessage)) < 0) {
+        std::cerr << "Fail to send handoff reply from "
+                  << GetPid() << " to " << src << std::endl;
+    }
+}
+
+void HandleHandoffPullMessage(int src, int dest, const void *msg, int len) {
+    const FileMessage* message = (const FileMessage*) msg;
+    auto it = kernel->handoffs.find(message->fid);
+    if (it == kernel->handoffs.end() || it->second.owner != src
+            || kernel->file_map.find(message->fid) == kernel->file_map.end()) {
+        return;
+    }
+    int file_len = kernel->file_map[message->fid].second;
+    char* handoff = MakeDataMessage(message->fid, kernel->file_map[message->fid].first, file_len, HANDOFF);
+    if (TransmitCounted(GetPid(), src, handoff, data_message_header_size + file_len) < 0) {
+        std::cerr << "Fail to send handoff message from "
+                  << GetPid() << " to " << src << std::endl;
+    }
+    delete[] handoff;
+}
+
+void HandleChunkInsertMessage(int src, int dest, const void *msg, int len) {
+    if (dest != 0) {
+        return;
+    }
+    fileID fid = 0;
+    int index = 0;
+    int header_len = ParseWriteMessageHeader(msg, len, &fid, &index);
+    int payload_len = len - header_len;
+    if (index < 0 || index >= chunk_fid_count || payload_len > stream_chunk_size) {
+        int status = -1;
+        DeliverMessage(GetPid(), GetPid(), &status, sizeof(int));
+        return;
+    }
+    fileID chunk = ChunkFileID(fid, index);
+    TracePrintf(10, "Insert chunk %d of stream %hu as file %hu\n", index, fid, chunk);
+    kernel->client_leases.erase(chunk);
+    kernel->recent_writes[chunk] = NowMillis() + path_cache_ttl;
+    // the stored chunk starts with its header, so readers can tell whose chunk it is
+    char* content = new char[chunk_header_size + payload_len];
+    MakeChunkHeader(content, fid, index);
+    std::memcpy(content + chunk_header_size, (const char*) msg + header_len, payload_len);
+    char* insert = MakeDataMessage(chunk, content, chunk_header_size + payload_len, INSERT);
+    SubmitChunkRequest(insert, data_message_header_size + chunk_header_size + payload_len);
+    delete[] insert;
+    delete[] content;
+}
+
+void HandleHandoffConfirmMessage(int src, int dest, const void *msg, int len) {
+    const FileMessage* message = (const FileMessage*) msg;
+    auto it = kernel->handoffs.find(message->fid);
+    if (it == kernel->handoffs.end() || it->second.owner != src) {
+        // reply to a handoff we already sent again
+        return;
+    }
+    if (message->type == HANDOFF_FAIL) {
+        std::cerr << "Node " << src << " has no room for file " << message->fid << std::endl;
+        kernel->handoff_failed = true;
+    } else if (kernel->mode == NORMAL) {
+        // a node joined closer to the file, our copy is at most a replica from now on
+        kernel->primary_index.erase(message->fid);
+        kernel->spill_map.erase(message->fid);
+    }
+    kernel->handoffs.erase(it);
+    if (kernel->mode == LEAVING && kernel->handoffs.empty()) {
+        HandOffFiles();
+    }
+}
+
+void HandleHotReplicateMessage(int src, int dest, const void *msg, int len) {
+    fileID fid = 0;
+    int version = 0;
+    int header_len = ParseWriteMessageHeader(msg, len, &fid, &version);
+    int file_len = len - header_len;
+    if (!FitsInStorage(fid, file_len)) {
+        // the root hands look ups we can't answer back to itself
+        // a copy we kept from an earlier time keeps its older version
+        TracePrintf(10, "Skip extra replica of file %d, %d bytes free\n", fid, FreeCapacity());
+        return;
+    }
+    char* data = new char[file_len];
+    std::memcpy(data, (const char*) msg + header_len, file_len);
+    StoreFile(fid, data, file_len);
+    kernel->hot_copies[fid] = version;
+    TracePrintf(10, "Store extra replica of hot file %d from %d\n", fid, src);
+}
+
+void HandleHotReleaseMessage(int src, int dest, const void *msg, int len) {
+    const FileMessage* message = (const FileMessage*) msg;
+    kernel->hot_copies.erase(message->fid);
+    if (kernel->primary_index.find(message->fid) != kernel->primary_index.end()) {
+        // we became the root of the file since
+        return;
+    }
+    TracePrintf(10, "Release extra replica of file %hu at %d\n", message->fid, GetPid());
+    RemoveFile(message->fid);
+}
+
+void HandleKeyAddedMessage(int src, int dest, const void *msg, int len) {
+    const FileMessage* message = (const FileMessage*) msg;
+    for (auto &it : kernel->neighbor_summaries) {
+        if (it.second.pid == src) {
+            it.second.keys.Add(message->fid);
+        }
+    }
+}
+
+void HandleLeaseCheckMessage(int src, int dest, const void *msg, int len) {
+    if (dest != 0) {
+        return;
+    }
+    const FileMessage* message = (const FileMessage*) msg;
+    auto it = kernel->client_leases.find(message->fid);
+    int status = it != kernel->client_leases.end() && NowMillis() < it->second ? 0 : -1;
+    if (status < 0 && it != kernel->client_leases.end()) {
+        kernel->client_leases.erase(it);
+    }
+    DeliverMessage(GetPid(), GetPid(), &status, sizeof(int));
+}
+
+void HandleLeaseInvalidateMessage(int src, int dest, const void *msg, int len) {
+    const FileMessage* message = (const FileMessage*) msg;
+    TracePrintf(10, "Lease on file %hu invalidated by %d\n", message->fid, src);
+    kernel->client_leases.erase(message->fid);
+    FileMessage reply(LEASE_INVALIDATE_CONFIRM, message->fid);
+    if (TransmitCounted(GetPid(), src, &reply, sizeof(FileMessage)) < 0) {
+        std::cerr << "Fail to send lease invalidation confirmation from "
+                  << GetPid() << " to " << src << std::endl;
+    }
+}
+
+void HandleLeaseInvalidateConfirmMessage(int src, int dest, const void *msg, int len) {
+    const FileMessage* message = (const FileMessage*) msg;
+    auto it = kernel->revoked_leases.find(message->fid);
+    if (it == kernel->revoked_leases.end()) {
+        return;
+    }
+    it->second.erase(src);
+    if (it->second.empty()) {
+        kernel->revoked_leases.erase(it);
+    }
+    FinishConfirmation(message->fid);
+}
+
+void HandleLeaseTransferMessage(int src, int dest, const void *msg, int len) {
+    const LeaseTransferMessage* message = (const LeaseTransferMessage*) msg;
+    TracePrintf(10, "Take over lease of %d on file %hu from %d\n", message->pid, message->fid, src);
+    long &lease = kernel->leases[message->fid][message->pid];
+    lease = std::max(lease, NowMillis() + message->expires_in);
+}
+
+void HandlePathCacheMessage(int src, int dest, const void *msg, int len) {
+    fileID fid = 0;
+    int version = 0;
+    int ttl = 0;
+    int header_len = ParsePathCacheHeader(msg, len, &fid, &version, &ttl);
+    int file_len = len - header_len;
+    if (kernel->file_map.find(fid) != kernel->file_map.end() || file_len > path_cache_capacity) {
+        // look ups passing us are answered from our own copy
+        return;
+    }
+    DropPathCopy(fid);
+    while (kernel->path_cache_used + file_len > path_cache_capacity) {
+        DropPathCopy(kernel->path_cache_order.back());
+    }
+    kernel->path_cache_order.push_front(fid);
+    PathCacheEntry &entry = kernel->path_cache[fid];
+    entry.data.assign((const char*) msg + header_len, (const char*) msg + len);
+    entry.version = version;
+    entry.expires_at = NowMillis() + ttl;
+    entry.position = kernel->path_cache_order.begin();
+    kernel->path_cache_used += file_len;
+    TracePrintf(10, "Cache file %d of size %d from %d on the look up path\n", fid, file_len, src);
+}
+
+void HandlePathRenewMessage(int src, int dest, const void *msg, int len) {
+    const PathRenewMessage* message = (const PathRenewMessage*) msg;
+    auto it = kernel->path_cache.find(message->fid);
+    if (it != kernel->path_cache.end() && it->second.version == message->version) {
+        it->second.expires_at = NowMillis() + message->ttl;
+    }
+}
+
+void HandleLocateMessage(int src, int dest, const void *msg, int len) {
+    const OfferMessage* message = (const OfferMessage*) msg;
+    Route(src, PlacementKey(message->fid), msg, len, LOCATE);
+}
+
+void HandleLocateResponseMessage(int src, int dest, const void *msg, int len) {
+    const FileMessage* message = (const FileMessage*) msg;
+    auto it = kernel->pending_requests.find(message->fid);
+    if (it == kernel->pending_requests.end()) {
+        // the request was answered or gave up meanwhile
+        return;
+    }
+    const std::vector<char> &request = it->second.message;
+    TracePrintf(10, "Send %d bytes of request for file %d to its root %d\n",
+                (int) request.size(), message->fid, src);
+    // the root routes it on if it isn't the root anymore
+    if (QueueMessage(GetPid(), src, request.data(), request.size()) < 0) {
+        std::cerr << "Fail to send request for file " << message->fid
+                  << " to its root " << src << std::endl;
+    }
+}
+
+void RingSearch(int src, int sequence_number, int hop_count) {
+    TracePrintf(10, "RingSearch with sequence number %d and hop count %d\n",
+                sequence_number, hop_count);
+    kernel->mode = RINGSEARCH;
+    FloodMessage message(sequence_number, hop_count);
+    if (TransmitCounted(src, -1, &message, sizeof(FloodMessage)) < 0) {
+        std::cerr << "Fail to send flood message from " << src << std::endl;
+    }
+}
+
+void HandleFloodMessage(int src, int dest, const void *msg, int len) {
+    TracePrintf(10, "Received flood message from %d\n", src);
+    int pid = GetPid();
+    FloodMessage* fmessage = (FloodMessage*) msg;
+    if (kernel->sequence_number_map.find(src) != kernel->sequence_number_map.end()
+            && fmessage->sequence_number <= kernel->sequence_number_map[src]) {
+        return;
+    }
+    kernel->sequence_number_map[src] = fmessage->sequence_number;
+    // process the message
+    if (kernel->joined_overlay_network) {
+        TracePrintf(10, "Response to flood message from %d\n", src);
+        // we are part of the overlay, reply to the src
+        Message reply(FLOOD_RES);
+        if (TransmitCounted(pid, src, &reply, sizeof(Message)) < 0) {
+            std::cerr << "Failed to send reply to flood message from "
+                      << pid << " to " << src << std::endl;
+        }
+    } else {
+        if (--(fmessage->hop_count) == 0) {
+            return;
+        }
+        TracePrintf(10, "Forward flood message from %d\n", src);
+        if (TransmitCounted(src, -1, fmessage, len) < 0) {
+            std::cerr << "Failed to forward flood message from " << src << std::endl;
+        }
+    }
+}
+
+void HandleFloodResponseMessage(int src, int dest, const void *msg, int len) {
+    if (kernel->mode == RINGSEARCH) {
+        TracePrintf(10, "Received flood response message from %d\n", src);
+        kernel->mode = JOINING;
+        kernel->join_expires_at = NowMillis() + (request_timeout << kernel->join_attempts);
+
+        JoinMessage message(kernel->node_id);
+        if (TransmitCounted(GetPid(), src, &message, sizeof(JoinMessage)) < 0) {
+            std::cerr << "Fail to send join message from "
+                      << GetPid() << " to " << src << std::endl;
+        }
+    } else {
+        TracePrintf(10, "Discard flood response message from %d. Current mode %d\n", src, kernel->mode);
+    }
+}
+
+void HandleExchangeMessage(int src, int dest, const void *msg, int len) {
+    TracePrintf(10, "Received exchange message from %d\n", src);
+    ExchangeMessage* message = (ExchangeMessage*) msg;
+    // send back reply before update, from the virtual node the sender is most interested in
+    VirtualNode &vnode = ClosestVirtualNode(message->id);
+    ExchangeResponseMessage reply(vnode.id, vnode.leaf_set, FreeCapacity(), kernel->lookup_load,
+                                  kernel->local_keys);
+    if (TransmitCounted(GetPid(), src, &reply, sizeof(ExchangeResponseMessage)) < 0) {
+        std::cerr << "Fail to send exchange reply from " << GetPid()
+                  << " to " << src << std::endl;
+    }
+
+    //Update leaf set based on the information
+    UpdateLeafSet(message->id, src);
+    kernel->neighbor_capacity[message->id] = message->free_capacity;
+    kernel->neighbor_load[message->id] = message->load;
+    UpdateSummary(message->id, src, message->keys, message->leaf_set);
+
+    // we received an exchange message from a dead node
+    // bring it back to life
+    kernel->dead_node.erase(message->id);
+    MarkAlive(src);
+
+    for (Entry e : message->leaf_set) {
+        // only update node we know that is not dead
+        // to avoid "ghost" effect where a removed node
+        // is added back from dated exchange message
+        // by other nodes
+        if (kernel->dead_node.find(e.id) == kernel->dead_node.end()) {
+            UpdateLeafSet(e.id, e.pid);
+        }
+    }
+}
+
+void HandleExchangeResponseMessage(int src, int dest, const void *msg, int len) {
+    TracePrintf(10, "Received exchange response message from %d\n", src);
+    ExchangeResponseMessage* message = (ExchangeResponseMessage*) msg;
+    kernel->dead_node.erase(message->id);
+    MarkAlive(src);
+    //Update leaf set based on the information
+    UpdateLeafSet(message->id, src);
+    kernel->neighbor_capacity[message->id] = message->free_capacity;
+    kernel->neighbor_load[message->id] = message->load;
+    UpdateSummary(message->id, src, message->keys, message->leaf_set);
+    for (Entry e : message->leaf_set) {
+        UpdateLeafSet(e.id, e.pid);
+    }
+}
+
+void HandleInsertMessage(int src, int dest, const void *msg, int len) {
+    TracePrintf(10, "%04x received insert message from %d\n", kernel->node_id, src);
+    fileID fid = 0;
+    ParseDataMessageHeader(msg, len, &fid);
+    if (dest == 0) {
+        // request of the local user process
+        if (IsChunkFileID(fid)) {
+            // only InsertStream() stores chunks, with CHUNK_INSERT
+            TracePrintf(10, "Refuse insert of file %d in the chunk range\n", fid);
+            int status = -1;
+            DeliverMessage(GetPid(), GetPid(), &status, sizeof(int));
+            return;
+        }
+        kernel->client_leases.erase(fid);
+        kernel->recent_writes[fid] = NowMillis() + path_cache_ttl;
+        TrackRequest(fid, msg, len);
+        RouteRequest(fid, msg, len, 0);
+        return;
+    }
+    Route(src, PlacementKey(fid), msg, len, INSERT);
+}
+
+void HandleReplicateMessage(int src, int dest, const void *msg, int len) {
+    TracePrintf(10, "Received replicate message from %d\n", src);
+    fileID fid = 0;
+    ParseDataMessageHeader(msg, len, &fid);
+    int file_len = len - data_message_header_size;
+    if (FitsInStorage(fid, file_len)) {
+        char* data = new char[file_len];
+        ParseDataMessageContent(msg, len, data, file_len);
+        data = StoreFile(fid, data, file_len);
+        NoteReplicaRoot(fid, src);
+        TracePrintf(10, "Store(replicate) file %d of size %d at pid: %d nodeID: %d content: %s\n",
+                    fid, file_len, GetPid(), kernel->node_id, data);
+    } else {
+        // a replica is only an extra copy, skip it rather than going over budget
+        TracePrintf(10, "Skip replicate of file %d of size %d, %d bytes free\n",
+                    fid, file_len, FreeCapacity());
+        RemoveFile(fid);
+    }
+    ReplicateConfirmMessage reply(fid);
+    if (QueueMessage(GetPid(), src, &reply, sizeof(ReplicateConfirmMessage)) < 0) {
+        std::cerr << "Fail to send replicate confirmation from "
+                  << GetPid() << " to " << src << std::endl;
+    }
+}
+
+void HandleReplicateOfferMessage(int src, int dest, const void *msg, int len) {
+    const OfferMessage* message = (const OfferMessage*) msg;
+    if (!HasContent(message->fid, message->len, message->hash)) {
+        FileMessage pull(REPLICATE_PULL, message->fid);
+        if (QueueMessage(GetPid(), src, &pull, sizeof(FileMessage)) < 0) {
+            std::cerr << "Fail to send replicate pull from "
+                      << GetPid() << " to " << src << std::endl;
+        }
+        return;
+    }
+    TracePrintf(10, "Replica of file %d at %d is up to date\n", message->fid, GetPid());
+    NoteReplicaRoot(message->fid, src);
+    ReplicateConfirmMessage reply(message->fid);
+    if (QueueMessage(GetPid(), src, &reply, sizeof(ReplicateConfirmMessage)) < 0) {
+        std::cerr << "Fail to send replicate confirmation from "
+                  << GetPid() << " to " << src << std::endl;
+    }
+}
+
+void HandleReplicatePullMessage(int src, int dest, const void *msg, int len) {
+    const FileMessage* message = (const FileMessage*) msg;
+    fileID fid = message->fid;
+    bool repair = kernel->confirmation_waiting_map.find(fid) == kernel->confirmation_waiting_map.end();
+    if (kernel->file_map.find(fid) == kernel->file_map.end()
+            || (repair && kernel->repair_offers.find(fid) == kernel->repair_offers.end())) {
+        // the insert was given up on or the file changed since
+        return;
+    }
+    int file_len = kernel->file_map[fid].second;
+    if (repair) {
+        TracePrintf(10, "Repair replica of file %d at %d\n", fid, src);
+        kernel->repaired_file_count++;
+        kernel->repair_bytes += data_message_header_size + file_len;
+        kernel->repair_delays[RepairDelayBucket(NowMillis() - kernel->repair_started_at)]++;
+    }
+    char* replicate = MakeDataMessage(fid, kernel->file_map[fid].first, file_len, REPLICATE);
+    if (QueueMessage(GetPid(), src, replicate, data_message_header_size + file_len) < 0) {
+        std::cerr << "Fail to send replicate message from "
+                  << GetPid() << " to " << src << std::endl;
+    }
+    delete[] replicate;
+}
+
+void HandleChainReplicateMessage(int src, int dest, const void *msg, int len) {
+    fileID fid = 0;
+    int root = 0;
+    int position = 0;
+    int length = 0;
+    int chain[P2P_LEAF_SIZE];
+    int header_len = ParseChainMessageHeader(msg, &fid, &root, &position, &length, chain);
+    if (length < 1 || length > P2P_LEAF_SIZE || position < 0 || position >= length
+        || len < header_len) {
+        std::cerr << "Drop chain replicate message of file " << fid << " from " << src
+                  << " at " << position << " of " << length << std::endl;
+        return;
+    }
+    int file_len = len - header_len;
+    TracePrintf(10, "Received chain replicate message of file %d from %d, %d of %d\n",
+                fid, src, position + 1, length);
+    if (position + 1 < length) {
+        // pass the copy on before storing it
+        char* next = new char[len];
+        std::memcpy(next, msg, len);
+        SetChainPosition(next, position + 1);
+        if (QueueMessage(GetPid(), chain[position + 1], next, len) < 0) {
+            std::cerr << "Fail to forward chain replicate message from "
+                      << GetPid() << " to " << chain[position + 1] << std::endl;
+        }
+        delete[] next;
+    }
+    if (FitsInStorage(fid, file_len)) {
+        char* data = new char[file_len];
+        std::memcpy(data, (const char*) msg + header_len, file_len);
+        StoreFile(fid, data, file_len);
+        NoteReplicaRoot(fid, root);
+    } else {
+        TracePrintf(10, "Skip chain replicate of file %d of size %d, %d bytes free\n",
+                    fid, file_len, FreeCapacity());
+        RemoveFile(fid);
+    }
+    if (position + 1 == length) {
+        // tail of the chain, confirm for everyone
+        ReplicateConfirmMessage reply(fid);
+        if (QueueMessage(GetPid(), root, &reply, sizeof(ReplicateConfirmMessage)) < 0) {
+            std::cerr << "Fail to send chain replicate confirmation from "
+                      << GetPid() << " to " << root << std::endl;
+        }
+    }
+}
+
+void HandleLookupMessage(int src, int dest, const void *msg, int len) {
+    TracePrintf(10, "%04x received lookup message from %d\n", kernel->node_id, src);
+    LookupMessage* message = (LookupMessage*) msg;
+    if (dest == 0) {
+        if (message->tagged) {
+            kernel->tagged_lookups.insert(message->fid);
+        }
+        LookupMessage request = *message;
+        if (path_caching && RecentlyWritten(message->fid)) {
+            // read our own write
+            request.nocache = 1;
+        }
+        if (IsChunkFileID(message->fid)) {
+            SubmitChunkRequest(&request, sizeof(LookupMessage));
+            return;
+        }
+        TrackRequest(message->fid, &request, sizeof(LookupMessage));
+        RouteRequest(message->fid, &request, sizeof(LookupMessage), 0);
+        return;
+    }
+    Route(src, PlacementKey(message->fid), msg, len, LOOK_UP);
+}
+
+void HandleReclaimMessage(int src, int dest, const void *msg, int len) {
+    TracePrintf(10, "Received reclaim message from %d\n", src);
+    FileMessage* message = (FileMessage*) msg;
+    if (dest == 0) {
+        kernel->client_leases.erase(message->fid);
+        kernel->recent_writes[message->fid] = NowMillis() + path_cache_ttl;
+        TrackRequest(message->fid, msg, len);
+        RouteRequest(message->fid, msg, len, 0);
+        return;
+    }
+    Route(src, PlacementKey(message->fid), msg, len, RECLAIM);
+}
+
+void HandleReclaimReplicateMessage(int src, int dest, const void *msg, int len) {
+    TracePrintf(10, "%04x received reclaim replicate message from %d\n", kernel->node_id, src);
+    FileMessage* message = (FileMessage*) msg;
+    fileID fid = message->fid;
+    if (RemoveFile(fid)) {
+        TracePrintf(10 , "Find file %hu to reclaim at %d\n", fid, GetPid());
+    }
+    // send back confirmation
+    FileMessage reply(RECLAIM_REPLICATE_CONFIRM, fid);
+    if (QueueMessage(GetPid(), src, &reply, sizeof(FileMessage)) < 0) {
+        std::cerr << "Fail to send reclaim replicate confirmation"
+                  << " from " << GetPid() << " to " << src;
+    }
+}
+
+void HandleSpillMessage(int src, int dest, const void *msg, int len) {
+    TracePrintf(10, "Received spill message from %d\n", src);
+    fileID fid = 0;
+    ParseDataMessageHeader(msg, len, &fid);
+    int file_len = len - data_message_header_size;
+    if (!FitsInStorage(fid, file_len)) {
+        // our advertised capacity is out of date
+        FileMessage reply(SPILL_FAIL, fid);
+        if (QueueMessage(GetPid(), src, &reply, sizeof(FileMessage)) < 0) {
+            std::cerr << "Fail to send spill fail message from "
+                      << GetPid() << " to " << src << std::endl;
+        }
+        return;
+    }
+    char* data = new char[file_len];
+    ParseDataMessageContent(msg, len, data, file_len);
+    StoreFile(fid, data, file_len);
+    kernel->spill_roots[fid] = src;
+    TracePrintf(10, "Store(spill) file %d of size %d at pid: %d nodeID: %04x\n",
+                fid, file_len, GetPid(), kernel->node_id);
+    ReplicateConfirmMessage reply(fid);
+    if (QueueMessage(GetPid(), src, &reply, sizeof(ReplicateConfirmMessage)) < 0) {
+        std::cerr << "Fail to send spill confirmation from "
+                  << GetPid() << " to " << src << std::endl;
+    }
+}
+
+void HandleSpillFailMessage(int src, int dest, const void *msg, int len) {
+    TracePrintf(10, "Received spill fail message from %d\n", src);
+    FileMessage* message = (FileMessage*) msg;
+    fileID fid = message->fid;
+    auto it = kernel->pending_spills.find(fid);
+    if (it == kernel->pending_spills.end() || it->second.holder.pid != src) {
+        // the file was inserted again since
+        return;
+    }
+    // the old version and its replicas were never touched, only the insert fails
+    int origin = it->second.origin;
+    kernel->pending_spills.erase(it);
+    ReplyToOrigin(origin, INSERT_FAIL, fid, -1);
+}
+
+void HandleSpillReleaseMessage(int src, int dest, const void *msg, int len) {
+    FileMessage* message = (FileMessage*) msg;
+    if (kernel->spill_roots.find(message->fid) == kernel->spill_roots.end()) {
+        // our copy is a replica by now
+        return;
+    }
+    TracePrintf(10, "Release spilled file %hu at %d\n", message->fid, GetPid());
+    RemoveFile(message->fid);
+}
+
+void HandleSpillHandoffMessage(int src, int dest, const void *msg, int len) {
+    const SpillHandoffMessage* message = (const SpillHandoffMessage*) msg;
+    fileID fid = message->fid;
+    bool from_holder = src == message->holder.pid;
+    auto spilled = kernel->spill_map.find(fid);
+    if (message->holder.pid == GetPid()) {
+        // the file was spilled to us, we are its root now
+        if (kernel->file_map.find(fid) != kernel->file_map.end()) {
+            kernel->primary_index.insert(fid);
+            kernel->spill_roots.erase(fid);
+        }
+    } else if (from_holder && (spilled != kernel->spill_map.end()
+            || kernel->primary_index.find(fid) != kernel->primary_index.end())) {
+        if (spilled == kernel->spill_map.end() || spilled->second.first.pid != src) {
+            // we took the file over from a replica, the holder's copy isn't needed
+            FileMessage release(SPILL_RELEASE, fid);
+            if (QueueMessage(GetPid(), src, &release, sizeof(FileMessage)) < 0) {
+                std::cerr << "Fail to send spill release message from "
+                          << GetPid() << " to " << src << std::endl;
+            }
+        }
+    } else {
+        TracePrintf(10, "Take over pointer to file %d spilled to %d from %d\n", fid, message->holder.pid, src);
+        kernel->spill_map[fid] = std::make_pair(message->holder, message->len);
+        kernel->primary_index.insert(fid);
+    }
+    if (!from_holder) {
+        FileMessage reply(HANDOFF_CONFIRM, fid);
+        if (QueueMessage(GetPid(), src, &reply, sizeof(FileMessage)) < 0) {
+            std::cerr << "Fail to send handoff reply from "
+                      << GetPid() << " to " << src << std::endl;
+        }
+    }
+}
+
+void HandleLookupLocalMessage(int src, int dest, const void *msg, int len) {
+    TracePrintf(10, "%04x received local lookup message from %d\n", kernel->node_id, src);
+    LookupMessage* message = (LookupMessage*) msg;
+    auto hot = kernel->hot_copies.find(message->fid);
+    bool stale = hot != kernel->hot_copies.end() && hot->second != message->version;
+    if ((kernel->file_map.find(message->fid) == kernel->file_map.end() || stale) && message->root_pid != 0) {
+        // we skipped or dropped our replica, or the HOT_RELEASE of an older copy got
+        // lost, let the root answer
+        LookupMessage redirect = *message;
+        redirect.root_pid = 0;
+        if (QueueMessage(src, message->root_pid, &redirect, sizeof(LookupMessage)) < 0) {
+            std::cerr << "Fail to return look up message from "
+                      << GetPid() << " to " << message->root_pid << std::endl;
+        }
+        return;
+    }
+    ServeLookup(src, message->fid, message->offset, message->len, message->hedge,
+                message->lease && !message->hedge);
+}
+
+void HandleStatsMessage(int src, int dest, const void *msg, int len) {
+    if (dest != 0) {
+        return;
+    }
+    NodeStats stats;
+    stats.file_count = kernel->file_map.size();
+    stats.storage_used = kernel->storage_used;
+    stats.content_bytes = kernel->content_bytes;
+    std::copy(kernel->leaf_set, kernel->leaf_set + P2P_LEAF_SIZE, stats.leaf_set);
+    stats.exchange_round = kernel->exchange_round;
+    stats.leaf_set_round = kernel->leaf_set_round;
+    stats.maintenance_bytes = kernel->maintenance_bytes;
+    stats.replication_bytes = kernel->replication_bytes;
+    stats.repaired_file_count = kernel->repaired_file_count;
+    stats.repair_bytes = kernel->repair_bytes;
+    std::copy(kernel->repair_delays, kernel->repair_delays + repair_delay_buckets, stats.repair_delays);
+    stats.storage_capacity = storage_capacity;
+    stats.virtual_node_count = virtual_node_count;
+    stats.lookup_count = kernel->lookup_count;
+    stats.hedge_count = kernel->hedge_count;
+    stats.hedge_win_count = kernel->hedge_win_count;
+    stats.hedge_detour_count = kernel->hedge_detour_count;
+    stats.hedge_delay = HedgeDelay();
+    stats.batched_join_count = kernel->batched_join_count;
+    stats.leaf_set_change_count = kernel->leaf_set_change_count;
+    stats.leaf_set_age = (int) std::min<long>(NowMillis() - kernel->leaf_set_changed_at, INT_MAX);
+    stats.served_lookup_count = kernel->total_served_lookups;
+    stats.hot_key_count = kernel->hot_replicas.size();
+    stats.filtered_lookup_count = kernel->filtered_lookup_count;
+    stats.path_cache_hit_count = kernel->path_cache_hit_count;
+    DeliverMessage(GetPid(), GetPid(), &stats, sizeof(NodeStats));
+}
+
+void HandleWriteMessage(int src, int dest, const void *msg, int len) {
+    TracePrintf(10, "%04x received write message from %d\n", kernel->node_id, src);
+    fileID fid = 0;
+    int offset = 0;
+    ParseWriteMessageHeader(msg, len, &fid, &offset);
+    if (dest == 0) {
+        if (IsChunkFileID(fid)) {
+            TracePrintf(10, "Refuse write of file %d in the chunk range\n", fid);
+            int status = -1;
+            DeliverMessage(GetPid(), GetPid(), &status, sizeof(int));
+            return;
+        }
+        kernel->client_leases.erase(fid);
+        kernel->recent_writes[fid] = NowMillis() + path_cache_ttl;
+        TrackRequest(fid, msg, len);
+        RouteRequest(fid, msg, len, 0);
+        return;
+    }
+    Route(src, PlacementKey(fid), msg, len, WRITE);
+}
+
+void HandleWriteReplicateMessage(int src, int dest, const void *msg, int len) {
+    TracePrintf(10, "Received write replicate message from %d\n", src);
+    fileID fid = 0;
+    int offset = 0;
+    int header_len = ParseWriteMessageHeader(msg, len, &fid, &offset);
+    int patch_len = len - header_len;
+    if (kernel->file_map.find(fid) != kernel->file_map.end()) {
+        if (offset <= kernel->file_map[fid].second
+                && FitsInStorage(fid, std::max(kernel->file_map[fid].second, offset + patch_len))) {
+            PatchFile(fid, offset, (const char*) msg + header_len, patch_len);
+        } else {
+            // our copy can't take the patch, drop it rather than serving stale content
+            RemoveFile(fid);
+        }
+    }
+    ReplicateConfirmMessage reply(fid);
+    if (QueueMessage(GetPid(), src, &reply, sizeof(ReplicateConfirmMessage)) < 0) {
+        std::cerr << "Fail to send write replicate confirmation from "
+                  << GetPid() << " to " << src << std::endl;
+    }
+}
+
+void HandleScanMessage(int src, int dest, const void *msg, int len) {
+    ScanMessage* message = (ScanMessage*) msg;
+    if (dest != 0) {
+        // continuation of a scan started by another node
+        Route(src, message->cursor, msg, len, SCAN);
+        return;
+    }
+    TracePrintf(10, "Start scan of files %hu to %hu\n", message->lo, message->hi);
+    kernel->scan_batches.clear();
+    kernel->scan_next_sequence = 0;
+    kernel->scan_waiting = false;
+    ScanMessage scan(message->lo, message->hi);
+    if (hash_file_ids || (message->lo < chunk_fid_base + chunk_fid_count && message->hi >= chunk_fid_base)) {
+        // hashed fileIDs and chunks are not ordered on the ring, visit every node
+        scan.cursor = 0;
+        scan.remaining = RING_SIZE;
+    } else {
+        scan.cursor = message->lo;
+        scan.remaining = message->lo <= message->hi ? message->hi - message->lo + 1 : 0;
+    }
+    if (scan.remaining == 0) {
+        char batch[scan_batch_header_size];
+        MakeScanBatchHeader(batch, 0, 0, 1);
+        SendScanBatch(GetPid(), batch, scan_batch_header_size);
+        return;
+    }
+    Route(GetPid(), scan.cursor, &scan, sizeof(ScanMessage), SCAN);
+}
+
+void HandleScanBatchMessage(int src, int dest, const void *msg, int len) {
+    int sequence, count, last;
+    ParseScanBatchHeader(msg, &sequence, &count, &last);
+    TracePrintf(10, "Received scan batch %d of %d files from %d\n", sequence, count, src);
+    const char* batch = (const char*) msg;
+    kernel->scan_batches[sequence] = std::vector<char>(batch, batch + len);
+    DeliverScanBatch();
+}
+
+void HandleScanNextMessage(int src, int dest, const void *msg, int len) {
+    if (dest != 0) {
+        return;
+    }
+    kernel->scan_waiting = true;
+    DeliverScanBatch();
+}
+
+void HandleEnvelopeMessage(int src, int dest, const void *msg, int len) {
+    int count = ParseEnvelopeHeader(msg);
+    TracePrintf(10, "Received envelope of %d messages from %d\n", count, src);
+    int offset = envelope_header_size;
+    // entries are packed without padding, so each one is copied to an aligned buffer
+    // before its handler casts it to a message struct
+    std::vector<std::max_align_t> entry((len + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t));
+    for (int i = 0; i < count && offset < len; i++) {
+        int entry_src = 0;
+        int entry_len = 0;
+        offset = ParseEnvelopeEntry(msg, len, offset, &entry_src, &entry_len);
+        if (offset < 0) {
+            std::cerr << "Drop envelope from " << src << " with a truncated entry" << std::endl;
+            return;
+        }
+        std::memcpy(entry.data(), (const char*) msg + offset, entry_len);
+        HandleReceivedMessage(entry_src, dest, entry.data(), entry_len);
+        offset += entry_len;
+    }
+}
+
+int Route(int src, nodeID dest, const void *msg, int len, int type, int avoid) {
+    int next_hop = GetPid();
+    bool avoided = false;
+    nodeID next_hop_id = 0;
+    // first treat dest as smaller than current node
+    VirtualNode* root = &ClosestVirtualNode(dest);
+    unsigned short min_distance = AbsoluteDistance(dest, root->id);
+    if (kernel->route_candidates_dirty) {
+        RebuildRouteCandidates();
+    }
+    const CandidateSet* candidates = &kernel->route_candidates;
+    CandidateSet filtered;
+    if (avoid != 0) {
+        for (int i = 0; i < kernel->route_candidates.Size(); i++) {
+            if (kernel->route_candidates.pids[i] != avoid) {
+                filtered.Add(kernel->route_candidates.ids[i], kernel->route_candidates.pids[i]);
+            } else if (AbsoluteDistance(kernel->route_candidates.ids[i], dest) < min_distance) {
+                avoided = true;
+            }
+        }
+        candidates = &filtered;
+    }
+    int nearest = NearestCandidate(candidates->ids.data(), candidates->Size(), dest);
+    if (nearest >= 0 && AbsoluteDistance(candidates->ids[nearest], dest) < min_distance) {
+        next_hop = candidates->pids[nearest];
+        next_hop_id = candidates->ids[nearest];
+        min_distance = AbsoluteDistance(next_hop_id, dest);
+    }
+
+    if (avoided && next_hop == GetPid()) {
+        // the avoided node is our only way towards dest
+        return Route(src, dest, msg, len, type);
+    }
+
+    if (type == LOOK_UP && next_hop != GetPid()) {
+        LookupMessage* message = (LookupMessage*) msg;
+        if (kernel->file_map.find(message->fid) != kernel->file_map.end() && IsCurrentReplica(message->fid)) {
+            // we are an immediate replica of the root. We answer a hedge, other
+            // look ups only if we are less loaded than the next hop.
+            int next_hop_load = NeighborLoad(next_hop_id);
+            if (message->hedge || (balance_lookups && !message->lease
+                    && next_hop_load >= 0 && LookupLoad() < next_hop_load)) {
+                ServeLookup(src, message->fid, message->offset, message->len, message->hedge);
+                return GetPid();
+            }
+        }
+    }
+
+    if (type == LOOK_UP && next_hop != GetPid() && filter_lookups) {
+        LookupMessage* message = (LookupMessage*) msg;
+        if (!message->hedge && kernel->file_map.find(message->fid) == kernel->file_map.end()
+                && KnownMissing(next_hop_id, message->fid)) {
+            TracePrintf(10, "File %d is missing at the root, fail look up early\n", message->fid);
+            kernel->filtered_lookup_count++;
+            FileMessage reply(LOOK_UP_FAIL, message->fid);
+            if (QueueMessage(GetPid(), src, &reply, sizeof(FileMessage)) < 0) {
+                std::cerr << "Fail to reply to look up message from " << src << std::endl;
+            }
+            return GetPid();
+        }
+    }
+
+    LookupMessage relay(0, 0, 0);
+    if (type == LOOK_UP && next_hop != GetPid()) {
+        LookupMessage* message = (LookupMessage*) msg;
+        int cached_version = 0;
+        if (path_caching && ServePathCopy(src, message, &cached_version)) {
+            return GetPid();
+        }
+        // let the node answering the look up know where to push or renew a copy
+        relay = *message;
+        relay.via = GetPid();
+        relay.version = cached_version;
+        msg = &relay;
+        len = sizeof(LookupMessage);
+    }
+
+    if (next_hop == GetPid()) {
+        // current node is the closest node
+        // handle this message
+        switch (type) {
+        case JOIN: {
+            if (batch_joins) {
+                QueueJoin(dest, src);
+                break;
+            }
+            // reply to new node's join request
+            JoinResponseMessage reply(root->id, root->leaf_set);
+            if (TransmitCounted(GetPid(), src, &reply, sizeof(JoinResponseMessage)) < 0) {
+                std::cerr << "Fail to send join response message from "
+                          << GetPid() << " to " << src << std::endl;
+            }
+
+            // then update my leaf set since I see a new node
+            // this has to be done after sending the reply because otherwise
+            // the new node might see itself in the leaf set
+            UpdateLeafSet(dest, src);
+            break;
+        }
+        case INSERT: {
+            fileID fid = 0;
+            ParseDataMessageHeader(msg, len, &fid);
+            int file_len = len - data_message_header_size;
+            const char* content = (const char*) msg + data_message_header_size;
+            if (IsChunkFileID(fid) && kernel->file_map.find(fid) != kernel->file_map.end()
+                    && (file_len < chunk_header_size || kernel->file_map[fid].second < chunk_header_size
+                        || std::memcmp(kernel->file_map[fid].first, content, chunk_header_size) != 0)) {
+                // the slot holds a chunk of another stream, don't overwrite it
+                TracePrintf(10, "Chunk file %hu is taken by another stream\n", fid);
+                ReplyToOrigin(src, INSERT_FAIL, fid, -1);
+                break;
+            }
+            if (offer_transfers && kernel->file_map.find(fid) != kernel->file_map.end()
+                    && kernel->file_map[fid].second == file_len
+                    && std::memcmp(kernel->file_map[fid].first, content, file_len) == 0) {
+                // the same content again, for example a retry. Keep our copy with its
+                // leases and version, and only make sure the replicas have it.
+                kernel->primary_index.insert(fid);
+                OfferReplicas(src, *root, fid);
+                break;
+            }
+            ReleaseHotReplicas(fid);
+            InvalidateLeases(fid);
+            char* data = new char[file_len];
+            ParseDataMessageContent(msg, len, data, file_len);
+
+            if (FitsInStorage(fid, file_len)) {
+                TracePrintf(10, "Store file %d of size %d at pid: %d nodeID: %04x content: %s\n",
+                            fid, file_len, GetPid(), root->id, data);
+                kernel->pending_spills.erase(fid);
+                DropOldVersion(fid, 0);
+                // the stored content, data is freed if the same content is stored already
+                data = StoreFile(fid, data, file_len);
+                kernel->primary_index.insert(fid);
+                ReplicateInsert(src, fid, data, file_len, 0);
+                break;
+            }
+            int spill_target = FindSpillTarget(*root, file_len);
+            if (spill_target < 0) {
+                // nobody around us has space for the file
+                std::cerr << GetPid() << " has no space for file " << fid
+                          << " of size " << file_len << std::endl;
+                delete[] data;
+                ReplyToOrigin(src, INSERT_FAIL, fid, -1);
+                break;
+            }
+            // we are over budget, let a less loaded leaf set member hold the file and
+            // keep only a pointer to it. The old version stays in place, and the
+            // replicas aren't touched, until the holder confirms.
+            Entry holder = root->leaf_set[spill_target];
+            TracePrintf(10, "Spill file %d of size %d from nodeID: %04x to nodeID: %04x\n",
+                        fid, file_len, root->id, holder.id);
+            char* spill = MakeDataMessage(fid, data, file_len, SPILL);
+            if (TransmitCounted(GetPid(), holder.pid, spill, len) < 0) {
+                std::cerr << "Fail to send spill message from "
+                          << GetPid() << " to " << holder.pid << std::endl;
+            }
+            delete[] spill;
+            kernel->pending_spills[fid] = {holder, src, std::vector<char>(data, data + file_len),
+                                           NowMillis() + confirmation_timeout};
+            delete[] data;
+            break;
+        }
+        case LOOK_UP: {
+            LookupMessage* message = (LookupMessage*) msg;
+            fileID fid = message->fid;
+            if (kernel->spill_map.find(fid) != kernel->spill_map.end()) {
+                // the file lives at the node we spilled it to, let it answer
+                int holder = kernel->spill_map[fid].first.pid;
+                TracePrintf(10, "Redirect look up of spilled file %d to %d\n", fid, holder);
+                if (message->lease) {
+                    GrantLease(fid, src);
+                }
+                LookupMessage redirect = *message;
+                redirect.type = LOOK_UP_LOCAL;
+                if (QueueMessage(src, holder, &redirect, sizeof(LookupMessage)) < 0) {
+                    std::cerr << "Fail to redirect look up message from "
+                              << src << " to " << holder << std::endl;
+                }
+                break;
+            }
+            int holder = 0;
+            if (filter_lookups && kernel->file_map.find(fid) == kernel->file_map.end()
+                    && (holder = SummaryHolder(*root, fid)) != 0) {
+                // a leaf set member may still have the file, let it answer
+                TracePrintf(10, "Pass look up of file %d to %d by its key summary\n", fid, holder);
+                kernel->filtered_lookup_count++;
+                LookupMessage redirect = *message;
+                redirect.type = LOOK_UP_LOCAL;
+                redirect.root_pid = 0;
+                // we don't know when its copy changes
+                redirect.lease = 0;
+                if (QueueMessage(src, holder, &redirect, sizeof(LookupMessage)) < 0) {
+                    std::cerr << "Fail to pass look up message from "
+                              << src << " to " << holder << std::endl;
+                }
+                break;
+            }
+            int replica = -1;
+            if (kernel->file_map.find(fid) != kernel->file_map.end()) {
+                CountLookup(*root, fid);
+                if (path_caching) {
+                    PushPathCopy(message->via, fid, kernel->file_map[fid].first, kernel->file_map[fid].second,
+                                 FileVersion(fid), path_cache_ttl, message->version);
+                }
+                if (!message->lease) {
+                    replica = SelectReplica(*root, fid);
+                }
+                if (message->hedge && replica < 0) {
+                    // the hedge didn't pass a replica, the root may be the slow one
+                    replica = RemotePid(root->leaf_set[P2P_LEAF_SIZE / 2 - 1]) != 0
+                        ? P2P_LEAF_SIZE / 2 - 1 : P2P_LEAF_SIZE / 2;
+                    if (RemotePid(root->leaf_set[replica]) == 0) {
+                        replica = -1;
+                    }
+                }
+            }
+            if (replica >= 0) {
+                Entry holder = root->leaf_set[replica];
+                TracePrintf(10, "Pass look up of file %d to replica %d\n", fid, holder.pid);
+                LookupMessage redirect = *message;
+                redirect.type = LOOK_UP_LOCAL;
+                redirect.root_pid = GetPid();
+                redirect.version = FileVersion(fid);
+                if (QueueMessage(src, holder.pid, &redirect, sizeof(LookupMessage)) < 0) {
+                    std::cerr << "Fail to pass look up message from "
+                              << src << " to " << holder.pid << std::endl;
+                }
+                if (kernel->neighbor_load.find(holder.id) != kernel->neighbor_load.end()) {
+                    kernel->neighbor_load[holder.id]++;
+                }
+                break;
+            }
+            bool lease = message->lease && !message->hedge
+                && kernel->file_map.find(fid) != kernel->file_map.end();
+            if (lease) {
+                GrantLease(fid, src);
+            }
+            ServeLookup(src, fid, message->offset, message->len, message->hedge, lease);
+            break;
+        }
+        case RECLAIM: {
+            FileMessage* message = (FileMessage*) msg;
+            fileID fid = message->fid;
+            bool spilled = kernel->spill_map.find(fid) != kernel->spill_map.end();
+            ReleaseHotReplicas(fid);
+            InvalidateLeases(fid);
+            kernel->file_versions.erase(fid);
+            kernel->primary_index.erase(fid);
+            if (RemoveFile(fid) || spilled) {
+                TracePrintf(10 , "Find file %hu to reclaim at pid: %d nodID: %04x\n", fid, GetPid(), root->id);
+
+                // send reclaim replicate to neighbor
+                FileMessage reclaim_replicate_message(RECLAIM_REPLICATE, fid);
+                int left_neighbor = RemotePid(root->leaf_set[P2P_LEAF_SIZE / 2 - 1]);
+                int right_neighbor = RemotePid(root->leaf_set[P2P_LEAF_SIZE / 2]);
+                int num_replicate = 0;
+                if (spilled) {
+                    int holder = kernel->spill_map[fid].first.pid;
+                    kernel->spill_map.erase(fid);
+                    if (holder != left_neighbor && holder != right_neighbor) {
+                        num_replicate++;
+                        if (QueueMessage(GetPid(), holder, &reclaim_replicate_message, sizeof(FileMessage)) < 0) {
+                            std::cerr << "Fail to forward reclaim replicate message from "
+                                      << src << " to " << holder << std::endl;
+                        }
+                    }
+                }
+                if (left_neighbor != 0) {
+                    num_replicate++;
+                    if (QueueMessage(GetPid(), left_neighbor, &reclaim_replicate_message, sizeof(FileMessage)) < 0) {
+                        std::cerr << "Fail to forward reclaim replicate message from "
+                                  << src << " to " << left_neighbor << std::endl;
+                    }
+                }
+                if (right_neighbor != 0) {
+                    num_replicate++;
+                    if (QueueMessage(GetPid(), right_neighbor, &reclaim_replicate_message, sizeof(FileMessage)) < 0) {
+                        std::cerr << "Fail to forward reclaim replicate message from "
+                                  << src << " to " << right_neighbor << std::endl;
+                    }
+                }
+                // TODO: Using the same map might result in some problem when one
+                // node is inserting a file and another node is reclaiming the same
+                // file.
+                AwaitConfirmations(src, fid, num_replicate, RECLAIM_CONFIRM);
+            } else {
+                // we couldn't find the file to reclaim
+                ReplyToOrigin(src, RECLAIM_FAIL, fid, -1);
+            }
+            break;
+        }
+        case WRITE: {
+            fileID fid = 0;
+            int offset = 0;
+            int header_len = ParseWriteMessageHeader(msg, len, &fid, &offset);
+            int patch_len = len - header_len;
+            const char* patch = (const char*) msg + header_len;
+            // the patch isn't sent to the extra replicas, drop them instead
+            ReleaseHotReplicas(fid);
+            InvalidateLeases(fid);
+            kernel->file_versions.erase(fid);
+            bool spilled = kernel->spill_map.find(fid) != kernel->spill_map.end();
+            int file_len = -1;
+            if (kernel->file_map.find(fid) != kernel->file_map.end()) {
+                file_len = kernel->file_map[fid].second;
+            } else if (spilled) {
+                file_len = kernel->spill_map[fid].second;
+            }
+            if (offset == APPEND_OFFSET) {
+                offset = file_len;
+            }
+            int new_len = std::max(file_len, offset + patch_len);
+            bool fits = spilled
+                ? new_len - file_len <= kernel->neighbor_capacity[kernel->spill_map[fid].first.id]
+                : FitsInStorage(fid, new_len);
+            if (file_len < 0 || offset < 0 || offset > file_len || new_len > P2P_FILE_MAXSIZE || !fits) {
+                // the file doesn't exist, the patch would leave a hole in it or it doesn't fit
+                TracePrintf(10, "Cannot write %d bytes at %d to file %d of size %d\n",
+                            patch_len, offset, fid, file_len);
+                ReplyToOrigin(src, INSERT_FAIL, fid, -1);
+                break;
+            }
+            TracePrintf(10, "Write %d bytes at %d to file %d at pid: %d nodeID: %04x\n",
+                        patch_len, offset, fid, GetPid(), root->id);
+
+            // only the patch is sent to the copies
+            char* message = MakeWriteMessage(fid, offset, patch, patch_len, WRITE_REPLICATE);
+            int message_len = write_message_header_size + patch_len;
+            std::vector<int> targets;
+            targets.push_back(RemotePid(root->leaf_set[P2P_LEAF_SIZE / 2 - 1]));
+            targets.push_back(RemotePid(root->leaf_set[P2P_LEAF_SIZE / 2]));
+            if (spilled) {
+                kernel->spill_map[fid].second = new_len;
+                targets.push_back(kernel->spill_map[fid].first.pid);
+            } else {
+                PatchFile(fid, offset, patch, patch_len);
+            }
+            std::sort(targets.begin(), targets.end());
+            targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+            int num_replicate = 0;
+            for (int target : targets) {
+                if (target == 0) {
+                    continue;
+                }
+                num_replicate++;
+                if (QueueMessage(GetPid(), target, message, message_len) < 0) {
+                    std::cerr << "Fail to send write replicate message from "
+                              << GetPid() << " to " << target << std::endl;
+                }
+            }
+            delete[] message;
+            AwaitConfirmations(src, fid, num_replicate, INSERT_CONFIRM);
+            break;
+        }
+        case SCAN: {
+            ScanVirtualNode(src, *root, (const ScanMessage*) msg);
+            break;
+        }
+        case LOCATE: {
+            const OfferMessage* message = (const OfferMessage*) msg;
+            fileID fid = message->fid;
+            if (src == GetPid()) {
+                // we are the root of our own request, handle it right here
+                auto it = kernel->pending_requests.find(fid);
+                if (it != kernel->pending_requests.end()) {
+                    std::vector<char> request = it->second.message;
+                    Route(src, dest, request.data(), request.size(), ((const Message*) request.data())->type);
+                }
+                break;
+            }
+            if (offer_transfers && HasContent(fid, message->len, message->hash)) {
+                // we have the content already, insert our own copy
+                TracePrintf(10, "Insert of file %d from %d has the content we store\n", fid, src);
+                char* insert = MakeDataMessage(fid, kernel->file_map[fid].first, message->len, INSERT);
+                Route(src, dest, insert, data_message_header_size + message->len, INSERT);
+                delete[] insert;
+                break;
+            }
+            FileMessage reply(LOCATE_RES, fid);
+            if (QueueMessage(GetPid(), src, &reply, sizeof(FileMessage)) < 0) {
+                std::cerr << "Fail to reply to locate message from " << src << std::endl;
+            }
+            break;
+        }
+        default: {
+            std::cerr << "Unknown message type to route: " << type << std::endl;
+        }
+        }
+    } else {
+        // forward message to next node
+        if (QueueMessage(src, next_hop, msg, len) < 0) {
+            std::cerr << "Fail to forward join message from "
+                      << src << " to " << next_hop << std::endl;
+        }
+    }
+    return next_hop;
+}
+
+unsigned short Distance(nodeID x, nodeID y) {
+    if (x <= y) {
+        return y - x;
+    } else {
+        return RING_SIZE - x + y;
+    }
+}
+
+unsigned short AbsoluteDistance(nodeID x, nodeID y) {
+    return RingDistance(x, y);
+}
+
+void RebuildRouteCandidates() {
+    kernel->route_candidates.Clear();
+    for (const auto &vnode : kernel->virtual_nodes) {
+        for (const auto &e : vnode.leaf_set) {
+            if (RemotePid(e) > 0) {
+                kernel->route_candidates.Add(e.id, e.pid);
+            }
+        }
+    }
+    kernel->route_candidates_dirty = false;
+}
+
+void UpdateLeafSet(nodeID id, int src) {
+    TracePrintf(10, "Update leaf set (%d,%d)\n", id, src);
+    kernel->route_candidates_dirty = true;
+    bool changed = false;
+    for (auto &vnode : kernel->virtual_nodes) {
+        Entry before[P2P_LEAF_SIZE];
+        std::copy(vnode.leaf_set, vnode.leaf_set + P2P_LEAF_SIZE, before);
+        UpdateLeafSet(vnode, id, src);
+        for (int i = 0; i < P2P_LEAF_SIZE; i++) {
+            if (before[i].id != vnode.leaf_set[i].id || before[i].pid != vnode.leaf_set[i].pid) {
+                changed = true;
+            }
+        }
+    }
+    if (changed) {
+        NoteLeafSetChange();
+    }
+}
+
+void UpdateLeafSet(VirtualNode &vnode, nodeID id, int src) {
+    int distance;
+    int max_distance;
+    int index;
+    nodeID node_id = vnode.id;
+    Entry* leaf_set = vnode.leaf_set;
+
+    if (node_id == id || src == 0) {
+        return;
+    }
+
+    // if id is already in leaf set, do nothing
+    // this is slow for large leaf set
+    for (int i = 0; i < P2P_LEAF_SIZE; i++) {
+        const Entry &e = leaf_set[i];
+        if (e.id == id) {
+            return;
+        }
+    }
+
+    // Greedy algorithm
+    // 1. try to treat the given nodeID as smaller than the current node_id
+    // 1.a if there is an empty spot in the lower half, just fill it
+    // 2. if the smaller half of the leaf set is already filled,
+    // see if we are closer to any of those nodes
+    // 2.a if we are closer, pick the node in the smaller half that is most distant
+    // from current node and replace it. Then try to fit the replaced node into larger half
+    // 2.b if not, treat the given nodeID as larger than the current node_id and
+    // try to fit it into the larger half
+    distance = Distance(id, node_id);
+    max_distance = distance;
+    for (int i = 0; i < P2P_LEAF_SIZE / 2; i++) {
+        Entry* e = &leaf_set[i];
+        if (e->pid == 0) {
+            // 1.a
+            e->id = id;
+            e->pid = src;
+            return;
+        } else if (Distance(e->id, node_id) > max_distance) {
+            max_distance = Distance(e->id, node_id);
+            index = i;
+        }
+    }
+    if (max_distance > distance) {
+        // 2.a
+        UpdateUpperLeafSet(vnode, leaf_set[index].id, leaf_set[index].pid);
+        leaf_set[index].id = id;
+        leaf_set[index].pid = src;
+    } else {
+        UpdateUpperLeafSet(vnode, id, src);
+    }
+}
+
+void UpdateUpperLeafSet(VirtualNode &vnode, nodeID id, int src) {
+    int distance;
+    int max_distance;
+    int index;
+    nodeID node_id = vnode.id;
+    Entry* leaf_set = vnode.leaf_set;
+
+    distance = Distance(node_id, id);
+    max_distance = distance;
+    for (int i = P2P_LEAF_SIZE / 2; i < P2P_LEAF_SIZE; i++) {
+        Entry* e = &leaf_set[i];
+        if (e->pid == 0) {
+            e->id = id;
+            e->pid = src;
+            return;
+        } else if (Distance(node_id, e->id) > max_distance) {
+            max_distance = Distance(node_id, e->id);
+            index = i;
+        }
+    }
+    if (max_distance > distance) {
+        leaf_set[index].id = id;
+        leaf_set[index].pid = src;
+    }
+}
+
+void RemoveNodeFromLeafSet(nodeID id) {
+    TracePrintf(10, "Remove dead node %04x from leaf set\n", id);
+    kernel->route_candidates_dirty = true;
+    kernel->neighbor_summaries.erase(id);
+    for (auto &vnode : kernel->virtual_nodes) {
+        for (auto &e : vnode.leaf_set) {
+            if (e.id == id && e.pid != 0) {
+                e.id = 0;
+                e.pid = 0;
+                NoteLeafSetChange();
+            }
+        }
+    }
+}
+
+void MarkAlive(int pid) {
+    for (const auto &vnode : kernel->virtual_nodes) {
+        for (const auto &e : vnode.leaf_set) {
+            if (e.pid == pid) {
+                kernel->dead_node.erase(e.id);
+            }
+        }
+    }
+}
+
+void PrintLeafSet() {
+    for (const auto &vnode : kernel->virtual_nodes) {
+        TracePrintf(10, "node_id: %04x, leaf_set: (%d), (%d), (%d), (%d)\n",
+                    vnode.id, vnode.leaf_set[0].id, vnode.leaf_set[1].id,
+                    vnode.leaf_set[2].id, vnode.leaf_set[3].id);
+    }
+}
+
+VirtualNode& ClosestVirtualNode(nodeID id) {
+    VirtualNode* closest = &kernel->virtual_nodes[0];
+    for (auto &vnode : kernel->virtual_nodes) {
+        if (AbsoluteDistance(vnode.id, id) < AbsoluteDistance(closest->id, id)) {
+            closest = &vnode;
+        }
+    }
+    return *closest;
+}
+
+nodeID VirtualNodeID(nodeID id, int index) {
+    return Mix16(id + index * 0x9e37);
+}
+
+void JoinVirtualNodes(int contact) {
+    if (contact == 0) {
+        // we are the first node, other nodes will find our virtual nodes
+        // through join and exchange messages
+        return;
+    }
+    for (int i = 1; i < virtual_node_count; i++) {
+        JoinMessage message(kernel->virtual_nodes[i].id);
+        if (TransmitCounted(GetPid(), contact, &message, sizeof(JoinMessage)) < 0) {
+            std::cerr << "Fail to send virtual node join message from "
+                      << GetPid() << " to " << contact << std::endl;
+        }
+    }
+}
+
+nodeID PlacementKey(fileID fid) {
+    return hash_file_ids || IsChunkFileID(fid) ? Mix16(fid) : fid;
+}
+
+int RemotePid(const Entry &e) {
+    return e.pid == GetPid() ? 0 : e.pid;
+}
+
+void PatchFile(fileID fid, int offset, const char* patch, int patch_len) {
+    int file_len = kernel->file_map[fid].second;
+    // other fileIDs may share the content, patch a copy
+    int new_len = std::max(file_len, offset + patch_len);
+    char* data = new char[new_len];
+    std::memcpy(data, kernel->file_map[fid].first, file_len);
+    std::memcpy(data + offset, patch, patch_len);
+    auto root = kernel->replica_roots.find(fid);
+    int replica_root = root != kernel->replica_roots.end() ? root->second : 0;
+    auto spilled = kernel->spill_roots.find(fid);
+    int spill_root = spilled != kernel->spill_roots.end() ? spilled->second : 0;
+    StoreFile(fid, data, new_len);
+    // a patch from the root keeps the copy current
+    if (replica_root != 0) {
+        kernel->replica_roots[fid] = replica_root;
+    }
+    if (spill_root != 0) {
+        kernel->spill_roots[fid] = spill_root;
+    }
+}
+
+void ScanVirtualNode(int origin, const VirtualNode &vnode, const ScanMessage* message) {
+    ScanMessage next = *message;
+    // ring keys up to half way to our successor are ours
+    Entry successor = vnode.leaf_set[P2P_LEAF_SIZE / 2];
+    int covered = next.remaining;
+    if (successor.pid != 0) {
+        nodeID upper = vnode.id + Distance(vnode.id, successor.id) / 2;
+        covered = std::min(covered, Distance(next.cursor, upper) + 1);
+    }
+    bool last = covered >= next.remaining;
+    TracePrintf(10, "Scan %d ring keys from %04x at nodeID: %04x\n", covered, next.cursor, vnode.id);
+
+    // report the files this virtual node is the root of, in fileID order
+    char batch[scan_batch_max_size];
+    int offset = scan_batch_header_size;
+    int count = 0;
+    for (auto it = kernel->primary_index.lower_bound(next.lo);
+            it != kernel->primary_index.end() && *it <= next.hi; ++it) {
+        fileID fid = *it;
+        if (ClosestVirtualNode(PlacementKey(fid)).id != vnode.id) {
+            // reported when the scan visits our other virtual node
+            continue;
+        }
+        const char* contents = NULL;
+        int file_len = -1;
+        if (kernel->file_map.find(fid) != kernel->file_map.end()) {
+            contents = kernel->file_map[fid].first;
+            file_len = kernel->file_map[fid].second;
+        } else if (kernel->spill_map.find(fid) == kernel->spill_map.end()) {
+            continue;
+        }
+        int entry_len = scan_entry_header_size + std::max(file_len, 0);
+        if (offset + entry_len > scan_batch_max_size) {
+            MakeScanBatchHeader(batch, next.sequence++, count, 0);
+            SendScanBatch(origin, batch, offset);
+            offset = scan_batch_header_size;
+            count = 0;
+        }
+        offset = AppendScanEntry(batch, offset, fid, contents, file_len);
+        count++;
+    }
+    if (count > 0 || last) {
+        MakeScanBatchHeader(batch, next.sequence++, count, last);
+        SendScanBatch(origin, batch, offset);
+    }
+
+    if (!last) {
+        next.cursor += covered;
+        next.remaining -= covered;
+        Route(origin, next.cursor, &next, sizeof(ScanMessage), SCAN);
+    }
+}
+
+void SendScanBatch(int origin, const char* batch, int len) {
+    if (origin == GetPid()) {
+        HandleScanBatchMessage(GetPid(), GetPid(), batch, len);
+        return;
+    }
+    if (TransmitCounted(GetPid(), origin, batch, len) < 0) {
+        std::cerr << "Fail to send scan batch from " << GetPid()
+                  << " to " << origin << std::endl;
+    }
+}
+
+void DeliverScanBatch() {
+    if (!kernel->scan_waiting
+            || kernel->scan_batches.find(kernel->scan_next_sequence) == kernel->scan_batches.end()) {
+        return;
+    }
+    std::vector<char> &batch = kernel->scan_batches[kernel->scan_next_sequence];
+    DeliverMessage(GetPid(), GetPid(), batch.data(), batch.size());
+    kernel->scan_batches.erase(kernel->scan_next_sequence++);
+    kernel->scan_waiting = false;
+}
+
+void ReplyToOrigin(int origin, int type, fileID fid, int status) {
+    if (origin == GetPid()) {
+        // current node is the destination
+        if (FinishRequest(fid, false, status >= 0)) {
+            DeliverMessage(GetPid(), GetPid(), &status, sizeof(int));
+        }
+        return;
+    }
+    FileMessage reply(type, fid);
+    if (QueueMessage(GetPid(), origin, &reply, sizeof(FileMessage)) < 0) {
+        std::cerr << "Fail to send message of type " << type << " from "
+                  << GetPid() << " to " << origin << std::endl;
+    }
+}
+
+char* StoreFile(fileID fid, char* data, int file_len) {
+    // acquire first, so that storing the same content again doesn't free it
+    data = AcquireContent(data, file_len);
+    RemoveFile(fid);
+    kernel->file_map[fid] = std::make_pair(data, file_len);
+    kernel->storage_used += file_len;
+    if (filter_lookups && !kernel->local_keys.MayContain(fid)) {
+        // don't let a leaf set member fail look ups of the file until the next exchange
+        kernel->local_keys.Add(fid);
+        FileMessage added(KEY_ADDED, fid);
+        std::set<int> told;
+        for (const auto &vnode : kernel->virtual_nodes) {
+            for (const auto &e : vnode.leaf_set) {
+                if (RemotePid(e) == 0 || !told.insert(e.pid).second) {
+                    continue;
+                }
+                if (QueueMessage(GetPid(), e.pid, &added, sizeof(FileMessage)) < 0) {
+                    std::cerr << "Fail to send key added message from "
+                              << GetPid() << " to " << e.pid << std::endl;
+                }
+            }
+        }
+    }
+    return data;
+}
+
+void ReplicateInsert(int origin, fileID fid, const char* data, int len, int holder) {
+    const VirtualNode &root = ClosestVirtualNode(PlacementKey(fid));
+    int left_neighbor = RemotePid(root.leaf_set[P2P_LEAF_SIZE / 2 - 1]);
+    int right_neighbor = RemotePid(root.leaf_set[P2P_LEAF_SIZE / 2]);
+    // the holder already has a copy, don't replicate to it again
+    if (left_neighbor == holder) {
+        left_neighbor = 0;
+    }
+    if (right_neighbor == holder) {
+        right_neighbor = 0;
+    }
+    int num_replicate = 0;
+    if (chain_replication && len >= chain_min_size
+            && left_neighbor != 0 && right_neighbor != 0 && left_neighbor != right_neighbor) {
+        // send a single copy that travels left neighbor -> right neighbor,
+        // the right neighbor confirms for both
+        int chain[] = {left_neighbor, right_neighbor};
+        char* message = MakeChainMessage(fid, GetPid(), chain, 2, data, len);
+        if (QueueMessage(GetPid(), left_neighbor, message, chain_message_header_size + len) < 0) {
+            std::cerr << "Fail to send chain replicate message from "
+                      << GetPid() << " to " << left_neighbor << std::endl;
+        }
+        delete[] message;
+        TracePrintf(10, "Send chain replicate through %d and %d\n", left_neighbor, right_neighbor);
+        AwaitConfirmations(origin, fid, 1, INSERT_CONFIRM);
+        return;
+    }
+
+    // send copy to 2 other node
+    char* message = MakeDataMessage(fid, (char*) data, len, REPLICATE);
+    if (left_neighbor != 0) {
+        num_replicate++;
+        if (QueueMessage(GetPid(), left_neighbor, message, data_message_header_size + len) < 0) {
+            std::cerr << "Fail to forward insert message from "
+                      << origin << " to " << left_neighbor << std::endl;
+        }
+    }
+    if (right_neighbor != 0) {
+        num_replicate++;
+        if (QueueMessage(GetPid(), right_neighbor, message, data_message_header_size + len) < 0) {
+            std::cerr << "Fail to forward insert message from "
+                      << origin << " to " << right_neighbor << std::endl;
+        }
+    }
+    TracePrintf(10, "Send %d replicates to neighbor\n", num_replicate);
+    delete[] message;
+    AwaitConfirmations(origin, fid, num_replicate, INSERT_CONFIRM);
+}
+
+void DropOldVersion(fileID fid, int holder) {
+    kernel->file_versions.erase(fid);
+    RemoveFile(fid);
+    auto spilled = kernel->spill_map.find(fid);
+    if (spilled == kernel->spill_map.end()) {
         return;
     }
-    sequence_number_map[src] = fmessage->sequence_number;
-    // process the message
-    if (joined_overlay_network) {
-        TracePrintf(10, "Response to flood message from %d\n", src);
-        // we are part of the overlay, reply to the src
-        Message* reply = new Message(FLOOD_RES);
-        if (TransmitMessage(pid, src, reply, sizeof(Message)) < 0) {
-            std::cerr << "Failed to send reply to flood message from "
-                      << pid << " to " << src << std::endl;
+    const VirtualNode &root = ClosestVirtualNode(PlacementKey(fid));
+    int old_holder = spilled->second.first.pid;
+    if (old_holder != holder && old_holder != RemotePid(root.leaf_set[P2P_LEAF_SIZE / 2 - 1])
+            && old_holder != RemotePid(root.leaf_set[P2P_LEAF_SIZE / 2])) {
+        // the replicas get the new version anyway, any other old holder lets its copy go
+        FileMessage release(SPILL_RELEASE, fid);
+        if (QueueMessage(GetPid(), old_holder, &release, sizeof(FileMessage)) < 0) {
+            std::cerr << "Fail to send spill release message from "
+                      << GetPid() << " to " << old_holder << std::endl;
+        }
+    }
+    kernel->spill_map.erase(spilled);
+}
+
+void CommitSpill(fileID fid) {
+    PendingSpill spill = std::move(kernel->pending_spills[fid]);
+    kernel->pending_spills.erase(fid);
+    TracePrintf(10, "Spill of file %hu to %d confirmed\n", fid, spill.holder.pid);
+    DropOldVersion(fid, spill.holder.pid);
+    kernel->spill_map[fid] = std::make_pair(spill.holder, (int) spill.data.size());
+    kernel->primary_index.insert(fid);
+    ReplicateInsert(spill.origin, fid, spill.data.data(), spill.data.size(), spill.holder.pid);
+}
+
+bool RemoveFile(fileID fid) {
+    if (kernel->file_map.find(fid) == kernel->file_map.end()) {
+        return false;
+    }
+    kernel->storage_used -= kernel->file_map[fid].second;
+    ReleaseContent(kernel->file_map[fid].first, kernel->file_map[fid].second);
+    kernel->file_map.erase(fid);
+    kernel->replica_roots.erase(fid);
+    kernel->hot_copies.erase(fid);
+    kernel->spill_roots.erase(fid);
+    return true;
+}
+
+char* AcquireContent(char* data, int len) {
+    std::vector<Content> &bucket = kernel->content_store[ContentHash(data, len)];
+    if (dedup_contents) {
+        for (auto &content : bucket) {
+            if (content.len == len && std::memcmp(content.data, data, len) == 0) {
+                content.refs++;
+                delete[] data;
+                return content.data;
+            }
+        }
+    }
+    bucket.push_back({data, len, 1});
+    kernel->content_bytes += len;
+    return data;
+}
+
+bool HasContent(fileID fid, int len, unsigned long long hash) {
+    auto it = kernel->file_map.find(fid);
+    return len >= 0 && it != kernel->file_map.end() && it->second.second == len
+        && ContentHash(it->second.first, len) == hash;
+}
+
+void OfferReplicas(int origin, const VirtualNode &root, fileID fid) {
+    std::vector<int> targets;
+    targets.push_back(RemotePid(root.leaf_set[P2P_LEAF_SIZE / 2 - 1]));
+    targets.push_back(RemotePid(root.leaf_set[P2P_LEAF_SIZE / 2]));
+    std::sort(targets.begin(), targets.end());
+    targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+    int file_len = kernel->file_map[fid].second;
+    OfferMessage offer(REPLICATE_OFFER, fid, file_len, ContentHash(kernel->file_map[fid].first, file_len));
+    int num_replicate = 0;
+    for (int target : targets) {
+        if (target == 0) {
+            continue;
+        }
+        num_replicate++;
+        if (QueueMessage(GetPid(), target, &offer, sizeof(OfferMessage)) < 0) {
+            std::cerr << "Fail to send replicate offer from "
+                      << GetPid() << " to " << target << std::endl;
+        }
+    }
+    TracePrintf(10, "Offer unchanged file %d to %d replicas\n", fid, num_replicate);
+    AwaitConfirmations(origin, fid, num_replicate, INSERT_CONFIRM);
+}
+
+void ReleaseContent(char* data, int len) {
+    auto it = kernel->content_store.find(ContentHash(data, len));
+    if (it == kernel->content_store.end()) {
+        return;
+    }
+    std::vector<Content> &bucket = it->second;
+    for (auto content = bucket.begin(); content != bucket.end(); ++content) {
+        if (content->data != data) {
+            continue;
+        }
+        if (--content->refs == 0) {
+            kernel->content_bytes -= len;
+            delete[] data;
+            bucket.erase(content);
+            if (bucket.empty()) {
+                kernel->content_store.erase(it);
+            }
         }
-        delete reply;
+        return;
+    }
+}
+
+bool FitsInStorage(fileID fid, int file_len) {
+    int existing_len = 0;
+    if (kernel->file_map.find(fid) != kernel->file_map.end()) {
+        existing_len = kernel->file_map[fid].second;
+    }
+    return kernel->storage_used - existing_len + file_len <= storage_capacity;
+}
+
+int FreeCapacity() {
+    return storage_capacity - kernel->storage_used;
+}
+
+int FindSpillTarget(const VirtualNode &vnode, int file_len) {
+    int index = -1;
+    int max_capacity = file_len - 1;
+    for (int i = 0; i < P2P_LEAF_SIZE; i++) {
+        const Entry &e = vnode.leaf_set[i];
+        if (RemotePid(e) == 0 || kernel->neighbor_capacity.find(e.id) == kernel->neighbor_capacity.end()) {
+            continue;
+        }
+        if (kernel->neighbor_capacity[e.id] > max_capacity) {
+            max_capacity = kernel->neighbor_capacity[e.id];
+            index = i;
+        }
+    }
+    return index;
+}
+
+void ServeLookup(int src, fileID fid, int offset, int buf_len, bool hedge, bool lease) {
+    kernel->served_lookups++;
+    kernel->total_served_lookups++;
+    if (kernel->file_map.find(fid) != kernel->file_map.end() && offset >= 0) {
+        // send back the requested part of the found file
+        TracePrintf(10, "Find file %d of size %d at pid: %d nodeID: %04x content %s\n",
+                    fid, kernel->file_map[fid].second, GetPid(), kernel->node_id,
+                    kernel->file_map[fid].first);
+        int type = hedge ? LOOK_UP_HEDGE_CONFIRM : (lease ? LOOK_UP_LEASE_CONFIRM : LOOK_UP_CONFIRM);
+        SendFilePart(src, fid, kernel->file_map[fid].first, kernel->file_map[fid].second, offset, buf_len,
+                     type);
     } else {
-        if (--(fmessage->hop_count) == 0) {
+        // we don't have the file, send back response message without content
+        TracePrintf(10, "Cannot find file %d\n", fid);
+        FileMessage reply(LOOK_UP_FAIL, fid);
+        if (QueueMessage(GetPid(), src, &reply, sizeof(FileMessage)) < 0) {
+            std::cerr << "Fail to reply to look up message from " << src << std::endl;
+        }
+    }
+}
+
+void SendFilePart(int src, fileID fid, char* data, int file_len, int offset, int buf_len, int type) {
+    offset = std::min(offset, file_len);
+    int part_len = std::min(buf_len, file_len - offset);
+    char* reply = MakeDataMessage(fid, data + offset, part_len, type);
+    if (QueueMessage(GetPid(), src, reply, data_message_header_size + part_len) < 0) {
+        std::cerr << "Fail to reply to look up message from " << src << std::endl;
+    }
+    delete[] reply;
+}
+
+void QueueJoin(nodeID id, int pid) {
+    long now = NowMillis();
+    for (const auto &j : kernel->pending_joins) {
+        if (j.pid == pid && j.id == id) {
+            // retried join, it is answered with the batch
             return;
         }
-        TracePrintf(10, "Forward flood message from %d\n", src);
-        if (TransmitMessage(src, -1, fmessage, len) < 0) {
-            std::cerr << "Failed to forward flood message from " << src << std::endl;
+    }
+    if (kernel->pending_joins.empty()) {
+        kernel->join_batch_opened_at = now;
+    }
+    kernel->pending_joins.push_back({id, pid, now});
+    bool storm = now - kernel->last_join_at < join_batch_delay;
+    kernel->last_join_at = now;
+    if (!storm) {
+        // no other join lately, don't hold this one back
+        FlushJoins(true);
+    }
+}
+
+void FlushJoins(bool all) {
+    long now = NowMillis();
+    if (kernel->pending_joins.empty() || (!all && now - kernel->join_batch_opened_at < join_batch_delay)) {
+        return;
+    }
+    std::vector<Joiner> recent;
+    for (const auto &j : kernel->recent_joins) {
+        if (now - j.joined_at < join_recent_window) {
+            recent.push_back(j);
+        }
+    }
+    kernel->recent_joins.swap(recent);
+
+    // every node the joiners could have in their leaf sets
+    std::vector<Entry> pool;
+    for (const auto &vnode : kernel->virtual_nodes) {
+        pool.push_back(Entry(vnode.id, GetPid()));
+        for (const auto &e : vnode.leaf_set) {
+            if (e.pid != 0) {
+                pool.push_back(e);
+            }
+        }
+    }
+    for (const auto &j : kernel->recent_joins) {
+        pool.push_back(Entry(j.id, j.pid));
+    }
+    for (const auto &j : kernel->pending_joins) {
+        pool.push_back(Entry(j.id, j.pid));
+    }
+
+    TracePrintf(10, "Answer batch of %d joins\n", (int) kernel->pending_joins.size());
+    if (kernel->pending_joins.size() > 1) {
+        kernel->batched_join_count += kernel->pending_joins.size();
+    }
+    for (const auto &j : kernel->pending_joins) {
+        SendJoinLeafSet(j, pool, NULL);
+    }
+    for (const auto &r : kernel->recent_joins) {
+        SendJoinLeafSet(r, pool, &kernel->pending_joins);
+    }
+    // update my leaf set only after the replies, so that no joiner
+    // is sent a leaf set built for somebody else
+    for (const auto &j : kernel->pending_joins) {
+        UpdateLeafSet(j.id, j.pid);
+        kernel->recent_joins.push_back(j);
+    }
+    kernel->pending_joins.clear();
+}
+
+void SendJoinLeafSet(const Joiner &joiner, const std::vector<Entry> &pool,
+                     const std::vector<Joiner> *news) {
+    // the leaf set the joiner would end up with
+    VirtualNode view;
+    view.id = joiner.id;
+    for (const auto &e : pool) {
+        if (e.pid != joiner.pid) {
+            UpdateLeafSet(view, e.id, e.pid);
+        }
+    }
+    if (news != NULL) {
+        bool found = false;
+        for (const auto &e : view.leaf_set) {
+            for (const auto &j : *news) {
+                found = found || (e.pid == j.pid && e.id == j.id);
+            }
+        }
+        if (!found) {
+            return;
+        }
+    }
+    JoinResponseMessage reply(ClosestVirtualNode(joiner.id).id, view.leaf_set);
+    if (TransmitCounted(GetPid(), joiner.pid, &reply, sizeof(JoinResponseMessage)) < 0) {
+        std::cerr << "Fail to send join response message from "
+                  << GetPid() << " to " << joiner.pid << std::endl;
+    }
+}
+
+void NoteLeafSetChange() {
+    kernel->leaf_set_changed_at = NowMillis();
+    kernel->leaf_set_change_count++;
+    kernel->leaf_set_round = kernel->exchange_round;
+}
+
+bool IsRootOf(fileID fid) {
+    if (kernel->route_candidates_dirty) {
+        RebuildRouteCandidates();
+    }
+    nodeID key = PlacementKey(fid);
+    int nearest = NearestCandidate(kernel->route_candidates.ids.data(), kernel->route_candidates.Size(), key);
+    return nearest < 0
+        || AbsoluteDistance(kernel->route_candidates.ids[nearest], key)
+            >= AbsoluteDistance(ClosestVirtualNode(key).id, key);
+}
+
+void RepairReplicas() {
+    kernel->repaired_change_count = kernel->leaf_set_change_count;
+    kernel->repair_started_at = kernel->leaf_set_changed_at;
+    kernel->repair_offers.clear();
+    std::vector<fileID> moved;
+    for (fileID fid : kernel->primary_index) {
+        if (!IsRootOf(fid) && (kernel->file_map.find(fid) != kernel->file_map.end()
+                               || kernel->spill_map.find(fid) != kernel->spill_map.end())
+                && kernel->handoffs.find(fid) == kernel->handoffs.end()
+                && kernel->confirmation_waiting_map.find(fid) == kernel->confirmation_waiting_map.end()) {
+            moved.push_back(fid);
+        }
+    }
+    for (fileID fid : moved) {
+        // a node joined closer to the file, hand it over together with its leases
+        TracePrintf(10, "Hand file %d over to a node that joined closer to it\n", fid);
+        SendHandoff(fid, 0);
+    }
+    for (auto it = kernel->spill_roots.begin(); it != kernel->spill_roots.end();) {
+        fileID fid = it->first;
+        if (IsRootOf(fid)) {
+            // taken over below like any other file we hold
+            it = kernel->spill_roots.erase(it);
+            continue;
+        }
+        int nearest = NearestCandidate(kernel->route_candidates.ids.data(), kernel->route_candidates.Size(),
+                                       PlacementKey(fid));
+        if (nearest >= 0 && kernel->route_candidates.pids[nearest] != it->second) {
+            // the root that spilled the file to us failed or a node joined closer to
+            // it, tell the new root where the file is
+            it->second = kernel->route_candidates.pids[nearest];
+            Entry holder(ClosestVirtualNode(PlacementKey(fid)).id, GetPid());
+            SpillHandoffMessage handoff(fid, holder, kernel->file_map[fid].second);
+            if (QueueMessage(GetPid(), it->second, &handoff, sizeof(SpillHandoffMessage)) < 0) {
+                std::cerr << "Fail to send spill handoff message from "
+                          << GetPid() << " to " << it->second << std::endl;
+            }
+        }
+        ++it;
+    }
+    for (const auto &it : kernel->file_map) {
+        fileID fid = it.first;
+        if (kernel->confirmation_waiting_map.find(fid) != kernel->confirmation_waiting_map.end()
+                || !IsRootOf(fid)) {
+            // an insert or write is replicating the file already, or another node is its root
+            continue;
+        }
+        if (kernel->primary_index.insert(fid).second) {
+            TracePrintf(10, "Take over file %d at nodeID: %04x\n", fid, kernel->node_id);
+            // the old root may have granted leases we don't know of
+            kernel->lease_fences[fid] = NowMillis() + lease_duration;
+        }
+        const VirtualNode &root = ClosestVirtualNode(PlacementKey(fid));
+        int left_neighbor = RemotePid(root.leaf_set[P2P_LEAF_SIZE / 2 - 1]);
+        int right_neighbor = RemotePid(root.leaf_set[P2P_LEAF_SIZE / 2]);
+        OfferMessage offer(REPLICATE_OFFER, fid, it.second.second, ContentHash(it.second.first, it.second.second));
+        if (right_neighbor == left_neighbor) {
+            right_neighbor = 0;
+        }
+        for (int target : {left_neighbor, right_neighbor}) {
+            if (target == 0) {
+                continue;
+            }
+            kernel->repair_offers.insert(fid);
+            if (QueueMessage(GetPid(), target, &offer, sizeof(OfferMessage)) < 0) {
+                std::cerr << "Fail to send repair offer from "
+                          << GetPid() << " to " << target << std::endl;
+            }
+        }
+    }
+}
+
+void CountLookup(const VirtualNode &root, fileID fid) {
+    kernel->lookup_sketch.Add(fid);
+    if (!replicate_hot_keys) {
+        return;
+    }
+    if (kernel->hot_replicas.find(fid) != kernel->hot_replicas.end()
+            || kernel->lookup_sketch.Estimate(fid) < hot_key_threshold) {
+        return;
+    }
+    // the inner members hold the regular replicas, use the ones further out
+    std::vector<Entry> holders;
+    int file_len = kernel->file_map[fid].second;
+    // stamped with the version, so that a holder that missed a HOT_RELEASE can tell its copy is old
+    char* message = MakeWriteMessage(fid, FileVersion(fid), kernel->file_map[fid].first, file_len,
+                                     HOT_REPLICATE);
+    for (int i = 0; i < P2P_LEAF_SIZE; i++) {
+        const Entry &e = root.leaf_set[i];
+        if (i == P2P_LEAF_SIZE / 2 - 1 || i == P2P_LEAF_SIZE / 2 || RemotePid(e) == 0) {
+            continue;
+        }
+        if (TransmitCounted(GetPid(), e.pid, message, write_message_header_size + file_len) < 0) {
+            std::cerr << "Fail to send hot replicate message from "
+                      << GetPid() << " to " << e.pid << std::endl;
+            continue;
+        }
+        holders.push_back(e);
+    }
+    delete[] message;
+    TracePrintf(10, "File %d is hot, %d extra replicas\n", fid, (int) holders.size());
+    kernel->hot_replicas[fid] = holders;
+}
+
+void ReleaseHotReplicas(fileID fid) {
+    auto it = kernel->hot_replicas.find(fid);
+    if (it == kernel->hot_replicas.end()) {
+        return;
+    }
+    FileMessage release(HOT_RELEASE, fid);
+    for (const auto &e : it->second) {
+        if (QueueMessage(GetPid(), e.pid, &release, sizeof(FileMessage)) < 0) {
+            std::cerr << "Fail to send hot release message from "
+                      << GetPid() << " to " << e.pid << std::endl;
+        }
+    }
+    kernel->hot_replicas.erase(it);
+}
+
+void CoolHotKeys() {
+    std::vector<fileID> cooled;
+    for (const auto &it : kernel->hot_replicas) {
+        if (kernel->lookup_sketch.Estimate(it.first) < hot_key_cool_threshold) {
+            cooled.push_back(it.first);
+        }
+    }
+    for (fileID fid : cooled) {
+        TracePrintf(10, "File %d cooled down\n", fid);
+        ReleaseHotReplicas(fid);
+    }
+}
+
+void RebuildKeyFilter() {
+    kernel->local_keys.Clear();
+    for (const auto &it : kernel->file_map) {
+        kernel->local_keys.Add(it.first);
+    }
+    for (fileID fid : kernel->primary_index) {
+        kernel->local_keys.Add(fid);
+    }
+}
+
+void UpdateSummary(nodeID id, int pid, const KeyFilter &keys, const Entry* leaf_set) {
+    auto found = kernel->neighbor_summaries.find(id);
+    bool changed = found == kernel->neighbor_summaries.end();
+    for (int i = 0; !changed && i < P2P_LEAF_SIZE; i++) {
+        const Entry &e = found->second.leaf_set[i];
+        changed = e.id != leaf_set[i].id || e.pid != leaf_set[i].pid;
+    }
+    NeighborSummary &summary = kernel->neighbor_summaries[id];
+    summary.pid = pid;
+    summary.keys = keys;
+    std::copy(leaf_set, leaf_set + P2P_LEAF_SIZE, summary.leaf_set);
+    summary.updated_round = kernel->exchange_round;
+    if (changed) {
+        summary.leaf_set_round = kernel->exchange_round;
+    }
+    if (leaf_set[P2P_LEAF_SIZE / 2 - 1].pid == GetPid() || leaf_set[P2P_LEAF_SIZE / 2].pid == GetPid()) {
+        return;
+    }
+    // the node stopped replicating to us, our copies of its files may miss changes from now on
+    for (auto it = kernel->replica_roots.begin(); it != kernel->replica_roots.end();) {
+        if (it->second == pid) {
+            it = kernel->replica_roots.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+bool SettledSummary(const NeighborSummary &summary) {
+    return kernel->exchange_round - summary.updated_round < summary_settle_rounds
+        && kernel->exchange_round - summary.leaf_set_round >= summary_settle_rounds;
+}
+
+bool KnownMissing(nodeID id, fileID fid) {
+    auto it = kernel->neighbor_summaries.find(id);
+    if (it == kernel->neighbor_summaries.end()) {
+        return false;
+    }
+    const NeighborSummary &root = it->second;
+    if (!SettledSummary(root)) {
+        // files may still sit where a stale leaf set put them, let the root decide
+        return false;
+    }
+    nodeID key = PlacementKey(fid);
+    bool listed = false;
+    for (const auto &e : root.leaf_set) {
+        if (e.pid == 0) {
+            continue;
+        }
+        if (AbsoluteDistance(e.id, key) < AbsoluteDistance(id, key)) {
+            // the next hop isn't the root, somebody further on decides
+            return false;
+        }
+        listed = listed || e.pid == GetPid();
+    }
+    if (!listed || root.keys.MayContain(fid)) {
+        return false;
+    }
+    for (const auto &e : root.leaf_set) {
+        if (e.pid == 0 || e.pid == GetPid() || e.pid == root.pid) {
+            continue;
+        }
+        auto member = kernel->neighbor_summaries.find(e.id);
+        if (member == kernel->neighbor_summaries.end() || member->second.keys.MayContain(fid)
+                || !SettledSummary(member->second)) {
+            return false;
+        }
+        bool told = false;
+        for (const auto &m : member->second.leaf_set) {
+            told = told || m.pid == GetPid();
+        }
+        if (!told) {
+            // we wouldn't hear of its new files
+            return false;
+        }
+    }
+    return true;
+}
+
+int SummaryHolder(const VirtualNode &root, fileID fid) {
+    for (const auto &e : root.leaf_set) {
+        if (RemotePid(e) == 0) {
+            continue;
+        }
+        auto it = kernel->neighbor_summaries.find(e.id);
+        if (it != kernel->neighbor_summaries.end() && it->second.keys.MayContain(fid)) {
+            return e.pid;
+        }
+    }
+    return 0;
+}
+
+void GrantLease(fileID fid, int pid) {
+    kernel->leases[fid][pid] = NowMillis() + lease_duration;
+}
+
+void InvalidateLeases(fileID fid) {
+    long now = NowMillis();
+    auto it = kernel->leases.find(fid);
+    if (it != kernel->leases.end()) {
+        for (const auto &holder : it->second) {
+            if (now >= holder.second) {
+                continue;
+            }
+            if (holder.first == GetPid()) {
+                kernel->client_leases.erase(fid);
+                continue;
+            }
+            long &revoked = kernel->revoked_leases[fid][holder.first];
+            revoked = std::max(revoked, holder.second);
+        }
+        kernel->leases.erase(it);
+    }
+    auto revoked = kernel->revoked_leases.find(fid);
+    if (revoked == kernel->revoked_leases.end()) {
+        return;
+    }
+    FileMessage invalidate(LEASE_INVALIDATE, fid);
+    for (const auto &holder : revoked->second) {
+        // not queued, so that it goes out before the confirmation of the change
+        if (TransmitCounted(GetPid(), holder.first, &invalidate, sizeof(FileMessage)) < 0) {
+            std::cerr << "Fail to send lease invalidation from "
+                      << GetPid() << " to " << holder.first << std::endl;
+        }
+    }
+}
+
+bool LeasesRevoked(fileID fid) {
+    long now = NowMillis();
+    auto fence = kernel->lease_fences.find(fid);
+    if (fence != kernel->lease_fences.end() && now < fence->second) {
+        return false;
+    }
+    auto it = kernel->revoked_leases.find(fid);
+    if (it == kernel->revoked_leases.end()) {
+        return true;
+    }
+    for (const auto &holder : it->second) {
+        if (now < holder.second) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void TransferLeases(fileID fid, int owner) {
+    auto it = kernel->leases.find(fid);
+    if (it == kernel->leases.end()) {
+        return;
+    }
+    long now = NowMillis();
+    for (const auto &holder : it->second) {
+        if (now >= holder.second) {
+            continue;
+        }
+        LeaseTransferMessage transfer(fid, holder.first, (int) (holder.second - now));
+        // not queued, so that it arrives before the file
+        if (TransmitCounted(GetPid(), owner, &transfer, sizeof(LeaseTransferMessage)) < 0) {
+            std::cerr << "Fail to send lease transfer from "
+                      << GetPid() << " to " << owner << std::endl;
+        }
+    }
+    kernel->leases.erase(it);
+}
+
+void ExpireLeases() {
+    long now = NowMillis();
+    for (auto it = kernel->leases.begin(); it != kernel->leases.end();) {
+        for (auto holder = it->second.begin(); holder != it->second.end();) {
+            if (now >= holder->second) {
+                holder = it->second.erase(holder);
+            } else {
+                ++holder;
+            }
+        }
+        if (it->second.empty()) {
+            it = kernel->leases.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (auto it = kernel->revoked_leases.begin(); it != kernel->revoked_leases.end();) {
+        for (auto holder = it->second.begin(); holder != it->second.end();) {
+            if (now >= holder->second) {
+                holder = it->second.erase(holder);
+            } else {
+                ++holder;
+            }
+        }
+        if (it->second.empty()) {
+            it = kernel->revoked_leases.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    for (auto it = kernel->lease_fences.begin(); it != kernel->lease_fences.end();) {
+        if (now >= it->second) {
+            it = kernel->lease_fences.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    std::vector<fileID> waiting;
+    for (const auto &it : kernel->confirmation_waiting_map) {
+        if (it.second.wait_count <= 0) {
+            waiting.push_back(it.first);
+        }
+    }
+    for (fileID fid : waiting) {
+        FinishConfirmation(fid);
+    }
+    for (auto it = kernel->client_leases.begin(); it != kernel->client_leases.end();) {
+        if (now >= it->second) {
+            it = kernel->client_leases.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+int FileVersion(fileID fid) {
+    auto it = kernel->file_versions.find(fid);
+    if (it != kernel->file_versions.end()) {
+        return it->second;
+    }
+    // the pid keeps the stamps of different roots apart, the count is never 0
+    kernel->file_version_count = kernel->file_version_count % 0xfffff + 1;
+    int version = ((GetPid() & 0x7ff) << 20) | kernel->file_version_count;
+    kernel->file_versions[fid] = version;
+    return version;
+}
+
+bool ServePathCopy(int src, const LookupMessage* message, int* version) {
+    auto it = kernel->path_cache.find(message->fid);
+    if (it == kernel->path_cache.end() || message->lease || message->nocache) {
+        return false;
+    }
+    PathCacheEntry &entry = it->second;
+    long now = NowMillis();
+    if (now >= entry.expires_at + path_cache_ttl) {
+        // nobody renewed it for a while, the file most likely changed
+        DropPathCopy(message->fid);
+        return false;
+    }
+    if (now >= entry.expires_at) {
+        // ask the node answering the look up whether our copy is still current
+        *version = entry.version;
+        return false;
+    }
+    TracePrintf(10, "Answer look up of file %d from the path cache of %d\n", message->fid, GetPid());
+    std::list<fileID> &order = kernel->path_cache_order;
+    order.splice(order.begin(), order, entry.position);
+    kernel->path_cache_hit_count++;
+    kernel->served_lookups++;
+    kernel->total_served_lookups++;
+    kernel->lookup_sketch.Add(message->fid);
+    int type = message->hedge ? LOOK_UP_HEDGE_CONFIRM : LOOK_UP_CONFIRM;
+    SendFilePart(src, message->fid, entry.data.data(), entry.data.size(),
+                 std::max(message->offset, 0), message->len, type);
+    PushPathCopy(message->via, message->fid, entry.data.data(), entry.data.size(),
+                 entry.version, entry.expires_at - now, message->version);
+    return true;
+}
+
+void PushPathCopy(int via, fileID fid, char* data, int file_len, int version, int ttl, int cached) {
+    if (via == 0 || via == GetPid()) {
+        return;
+    }
+    if (cached == version) {
+        PathRenewMessage renew(fid, version, ttl);
+        if (QueueMessage(GetPid(), via, &renew, sizeof(PathRenewMessage)) < 0) {
+            std::cerr << "Fail to send path renew message from "
+                      << GetPid() << " to " << via << std::endl;
+        }
+        return;
+    }
+    if (kernel->lookup_sketch.Estimate(fid) < path_cache_threshold) {
+        return;
+    }
+    char* message = MakePathCacheMessage(fid, version, ttl, data, file_len);
+    if (QueueMessage(GetPid(), via, message, path_cache_header_size + file_len) < 0) {
+        std::cerr << "Fail to send path cache message from "
+                  << GetPid() << " to " << via << std::endl;
+    }
+    delete[] message;
+}
+
+void DropPathCopy(fileID fid) {
+    auto it = kernel->path_cache.find(fid);
+    if (it == kernel->path_cache.end()) {
+        return;
+    }
+    kernel->path_cache_used -= it->second.data.size();
+    kernel->path_cache_order.erase(it->second.position);
+    kernel->path_cache.erase(it);
+}
+
+bool RecentlyWritten(fileID fid) {
+    auto it = kernel->recent_writes.find(fid);
+    if (it == kernel->recent_writes.end()) {
+        return false;
+    }
+    if (NowMillis() >= it->second) {
+        kernel->recent_writes.erase(it);
+        return false;
+    }
+    return true;
+}
+
+void HandOffFiles() {
+    // files inserted while we were handing off the others are handed off too
+    for (fileID fid : kernel->primary_index) {
+        if (kernel->handed_off.find(fid) != kernel->handed_off.end()) {
+            continue;
+        }
+        kernel->handed_off.insert(fid);
+        if (kernel->file_map.find(fid) == kernel->file_map.end()
+                && kernel->spill_map.find(fid) == kernel->spill_map.end()) {
+            continue;
+        }
+        if (!SendHandoff(fid, 0)) {
+            std::cerr << "No node to hand file " << fid << " off to" << std::endl;
+        }
+    }
+    if (kernel->handoffs.empty()) {
+        FinishLeave();
+    }
+}
+
+bool SendHandoff(fileID fid, int attempts) {
+    if (kernel->route_candidates_dirty) {
+        RebuildRouteCandidates();
+    }
+    int nearest = NearestCandidate(kernel->route_candidates.ids.data(), kernel->route_candidates.Size(),
+                                   PlacementKey(fid));
+    if (nearest < 0) {
+        return false;
+    }
+    int owner = kernel->route_candidates.pids[nearest];
+    TransferLeases(fid, owner);
+    if (kernel->file_map.find(fid) == kernel->file_map.end()) {
+        // spilled files stay with their holder, only the pointer moves
+        SpillHandoffMessage handoff(fid, kernel->spill_map[fid].first, kernel->spill_map[fid].second);
+        if (TransmitCounted(GetPid(), owner, &handoff, sizeof(SpillHandoffMessage)) < 0) {
+            std::cerr << "Fail to send spill handoff message from "
+                      << GetPid() << " to " << owner << std::endl;
+        }
+        kernel->handoffs[fid] = {owner, attempts, NowMillis() + (request_timeout << attempts)};
+        return true;
+    }
+    int file_len = kernel->file_map[fid].second;
+    if (offer_transfers) {
+        // the new root is most likely a replica of the file already
+        OfferMessage offer(HANDOFF_OFFER, fid, file_len, ContentHash(kernel->file_map[fid].first, file_len));
+        if (TransmitCounted(GetPid(), owner, &offer, sizeof(OfferMessage)) < 0) {
+            std::cerr << "Fail to send handoff offer from "
+                      << GetPid() << " to " << owner << std::endl;
+        }
+    } else {
+        char* message = MakeDataMessage(fid, kernel->file_map[fid].first, file_len, HANDOFF);
+        if (TransmitCounted(GetPid(), owner, message, data_message_header_size + file_len) < 0) {
+            std::cerr << "Fail to send handoff message from "
+                      << GetPid() << " to " << owner << std::endl;
+        }
+        delete[] message;
+    }
+    kernel->handoffs[fid] = {owner, attempts, NowMillis() + (request_timeout << attempts)};
+    return true;
+}
+
+void ExpireHandoffs() {
+    long now = NowMillis();
+    std::vector<std::pair<fileID, int>> expired;
+    for (const auto &it : kernel->handoffs) {
+        if (now >= it.second.expires_at) {
+            expired.push_back(std::make_pair(it.first, it.second.attempts));
+        }
+    }
+    if (expired.empty()) {
+        return;
+    }
+    for (const auto &e : expired) {
+        kernel->handoffs.erase(e.first);
+        if (e.second < request_retry_limit) {
+            SendHandoff(e.first, e.second + 1);
+        } else {
+            std::cerr << "Handoff of file " << e.first << " timed out" << std::endl;
+            kernel->handoff_failed = true;
         }
     }
+    if (kernel->mode == LEAVING && kernel->handoffs.empty()) {
+        HandOffFiles();
+    }
 }
 
-void HandleFloodResponseMessage(int src, int dest, const void *msg, int len) {
-    if (mode == RINGSEARCH) {
-        TracePrintf(10, "Received flood response message from %d\n", src);
-        mode = JOINING;
-
-        JoinMessage* message = new JoinMessage(node_id);
-        if (TransmitMessage(GetPid(), src, message, sizeof(JoinMessage)) < 0) {
-            std::cerr << "Fail to send join message from "
-                      << GetPid() << " to " << src << std::endl;
+void FinishLeave() {
+    for (auto &vnode : kernel->virtual_nodes) {
+        LeaveMessage notice(vnode.id, vnode.leaf_set);
+        for (const auto &e : vnode.leaf_set) {
+            if (RemotePid(e) == 0) {
+                continue;
+            }
+            if (TransmitCounted(GetPid(), e.pid, &notice, sizeof(LeaveMessage)) < 0) {
+                std::cerr << "Fail to send leave message from "
+                          << GetPid() << " to " << e.pid << std::endl;
+            }
         }
-        delete message;
-    } else {
-        TracePrintf(10, "Discard flood response message from %d. Current mode %d\n", src, mode);
     }
-}
-
-void HandleExchangeMessage(int src, int dest, const void *msg, int len) {
-    TracePrintf(10, "Received exchange message from %d\n", src);
-    ExchangeMessage* message = (ExchangeMessage*) msg;
-    // send back reply before update
-    ExchangeResponseMessage* reply = new ExchangeResponseMessage(node_id, leaf_set);
-    if (TransmitMessage(GetPid(), src, reply, sizeof(ExchangeResponseMessage)) < 0) {
-        std::cerr << "Fail to send exchange reply from " << GetPid()
-                  << " to " << src << std::endl;
+    kernel->mode = LEFT;
+    kernel->joined_overlay_network = false;
+    std::vector<fileID> hot;
+    for (const auto &it : kernel->hot_replicas) {
+        hot.push_back(it.first);
     }
-    delete reply;
-
-    //Update leaf set based on the information
-    UpdateLeafSet(message->id, src);
+    for (fileID fid : hot) {
+        ReleaseHotReplicas(fid);
+    }
+    // leases on files that couldn't be handed off, the new roots don't know them
+    std::vector<fileID> leased;
+    for (const auto &it : kernel->leases) {
+        leased.push_back(it.first);
+    }
+    for (fileID fid : leased) {
+        InvalidateLeases(fid);
+    }
+    std::vector<fileID> stored;
+    for (const auto &it : kernel->file_map) {
+        stored.push_back(it.first);
+    }
+    for (fileID fid : stored) {
+        RemoveFile(fid);
+    }
+    kernel->primary_index.clear();
+    kernel->spill_map.clear();
 
-    // we received an exchange message from a dead node
-    // bring it back to life
-    dead_node.erase(message->id);
+    int status = kernel->handoff_failed ? -1 : 0;
+    DeliverMessage(GetPid(), GetPid(), &status, sizeof(int));
+    std::cerr << GetPid() << " left network after handing off "
+              << kernel->handed_off.size() << " files" << std::endl;
+}
 
-    for (Entry e : message->leaf_set) {
-        // only update node we know that is not dead
-        // to avoid "ghost" effect where a removed node
-        // is added back from dated exchange message
-        // by other nodes
-        if (dead_node.find(e.id) == dead_node.end()) {
-            UpdateLeafSet(e.id, e.pid);
-        }
+long NowMillis() {
+    if (replay_time >= 0) {
+        return replay_time;
     }
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
-void HandleExchangeResponseMessage(int src, int dest, const void *msg, int len) {
-    TracePrintf(10, "Received exchange response message from %d\n", src);
-    ExchangeResponseMessage* message = (ExchangeResponseMessage*) msg;
-    dead_node.erase(message->id);
-    //Update leaf set based on the information
-    UpdateLeafSet(message->id, src);
-    for (Entry e : message->leaf_set) {
-        UpdateLeafSet(e.id, e.pid);
+void RecordMessage(int src, int dest, const void *msg, int len) {
+    if (!kernel->recorder_opened) {
+        kernel->recorder_opened = true;
+        char path[64];
+        std::snprintf(path, sizeof(path), "%s.%d", record_prefix, GetPid());
+        if (!kernel->recorder.Open(path, GetPid(), record_payloads)) {
+            std::cerr << "Fail to create message log " << path << std::endl;
+        }
+    }
+    kernel->recorder.Record(NowMillis(), src, dest, msg, len);
+    if (src == 0 && dest == 0 && len == 0) {
+        kernel->recorder.Flush();
     }
 }
 
-void HandleInsertMessage(int src, int dest, const void *msg, int len) {
-    TracePrintf(10, "%04x received insert message from %d\n", node_id, src);
-    fileID fid = 0;
-    ParseDataMessageHeader(msg, len, &fid);
-    Route(src, fid, msg, len, INSERT);
+int HedgeDelay() {
+    if ((int) kernel->lookup_latencies.size() < hedge_latency_window / 4) {
+        return hedge_min_delay;
+    }
+    std::vector<int> sorted(kernel->lookup_latencies.begin(), kernel->lookup_latencies.end());
+    size_t index = (sorted.size() - 1) * hedge_percentile / 100;
+    std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+    return std::max(hedge_min_delay, sorted[index]);
 }
 
-void HandleReplicateMessage(int src, int dest, const void *msg, int len) {
-    TracePrintf(10, "Received replicate message from %d\n", src);
-    fileID fid = 0;
-    ParseDataMessageHeader(msg, len, &fid);
-    int file_len = len - data_message_header_size;
-    char* data = new char[file_len];
-    ParseDataMessageContent(msg, len, data, file_len);
-    if (file_map.find(fid) != file_map.end()) {
-        // free existing file
-        char* old_file = file_map[fid].first;
-        delete[] old_file;
-        file_map.erase(fid); // this is probably not needed
-    }
-    file_map[fid] = std::make_pair(data, file_len);
-    TracePrintf(10, "Store(replicate) file %d of size %d at pid: %d nodeID: %d content: %s\n",
-                fid, file_len, GetPid(), node_id, data);
-    ReplicateConfirmMessage* message = new ReplicateConfirmMessage(fid);
-    if (TransmitMessage(GetPid(), src, message, sizeof(Message)) < 0) {
-        std::cerr << "Fail to send replicate confirmation from "
-                  << GetPid() << " to " << src << std::endl;
+void SendHedges() {
+    long now = NowMillis();
+    int delay = HedgeDelay();
+    for (auto &it : kernel->pending_requests) {
+        PendingRequest &pending = it.second;
+        const LookupMessage* request = (const LookupMessage*) pending.message.data();
+        if (request->type != LOOK_UP || pending.hedged || now - pending.sent_at < delay) {
+            continue;
+        }
+        TracePrintf(10, "Hedge look up of file %d after %ld ms\n", it.first, now - pending.sent_at);
+        pending.hedged = true;
+        kernel->hedge_count++;
+        LookupMessage hedge = *request;
+        hedge.hedge = 1;
+        // take another way than the first request unless it is the only one
+        int avoid = pending.next_hop != GetPid() ? pending.next_hop : 0;
+        int next_hop = Route(GetPid(), PlacementKey(it.first), &hedge, sizeof(LookupMessage), LOOK_UP, avoid);
+        if (next_hop != pending.next_hop) {
+            kernel->hedge_detour_count++;
+        }
     }
-    delete[] message;
 }
 
-void HandleLookupMessage(int src, int dest, const void *msg, int len) {
-    TracePrintf(10, "%04x received lookup message from %d\n", node_id, src);
-    LookupMessage* message = (LookupMessage*) msg;
-    Route(src, message->fid, msg, len, LOOK_UP);
+void TrackRequest(fileID fid, const void *msg, int len) {
+    const char* request = (const char*) msg;
+    long now = NowMillis();
+    PendingRequest pending = {std::vector<char>(request, request + len), now,
+                              now + request_timeout, 0, 0, false, 0};
+    kernel->pending_requests[fid] = pending;
 }
 
-void HandleReclaimMessage(int src, int dest, const void *msg, int len) {
-    TracePrintf(10, "Received reclaim message from %d\n", src);
-    FileMessage* message = (FileMessage*) msg;
-    Route(src, message->fid, msg, len, RECLAIM);
+void SubmitChunkRequest(const void *msg, int len) {
+    const char* request = (const char*) msg;
+    kernel->held_chunk_requests.push_back(std::vector<char>(request, request + len));
+    ReleaseChunkRequests();
 }
 
-void HandleReclaimReplicateMessage(int src, int dest, const void *msg, int len) {
-    TracePrintf(10, "%04x received reclaim replicate message from %d\n", node_id, src);
-    FileMessage* message = (FileMessage*) msg;
-    fileID fid = message->fid;
-    if (file_map.find(fid) != file_map.end()) {
-        // free existing file
-        TracePrintf(10 , "Find file %hu to reclaim at %d\n", fid, GetPid());
-        char* old_file = file_map[dest].first;
-        delete[] old_file;
-        file_map.erase(dest); // this is probably not needed
+void ReleaseChunkRequests() {
+    if (kernel->releasing_chunk_requests) {
+        // a request we just sent was answered right away, the loop below goes on
+        return;
     }
-    // send back confirmation
-    FileMessage* reply = new FileMessage(RECLAIM_REPLICATE_CONFIRM, fid);
-    if (TransmitMessage(GetPid(), src, reply, sizeof(FileMessage)) < 0) {
-        std::cerr << "Fail to send reclaim replicate confirmation"
-                  << " from " << GetPid() << " to " << src;
+    kernel->releasing_chunk_requests = true;
+    while (!kernel->held_chunk_requests.empty()
+            && (int) kernel->chunk_requests.size() < stream_window) {
+        std::vector<char> request = kernel->held_chunk_requests.front();
+        kernel->held_chunk_requests.pop_front();
+        fileID fid = ((const FileMessage*) request.data())->fid;
+        kernel->chunk_requests.insert(fid);
+        TrackRequest(fid, request.data(), request.size());
+        RouteRequest(fid, request.data(), request.size(), 0);
     }
-    delete reply;
+    kernel->releasing_chunk_requests = false;
 }
 
-void Route(int src, nodeID dest, const void *msg, int len, int type) {
-    int next_hop = GetPid();
-    // first treat dest as smaller than current node
-    unsigned short min_distance = AbsoluteDistance(dest, node_id);
-    for (const auto &e : leaf_set) {
-        if (e.pid > 0 && AbsoluteDistance(e.id, dest) < min_distance) {
-            next_hop = e.pid;
-            min_distance = AbsoluteDistance(e.id, dest);
+void RouteRequest(fileID fid, const void *msg, int len, int avoid) {
+    const Message* request = (const Message*) msg;
+    int next_hop = 0;
+    if (direct_payloads && (request->type == INSERT || request->type == WRITE)
+            && len >= direct_payload_min_size) {
+        // the payload follows once we know the root
+        OfferMessage locate(LOCATE, fid, -1, 0);
+        if (offer_transfers && request->type == INSERT) {
+            locate.len = len - data_message_header_size;
+            locate.hash = ContentHash((const char*) msg + data_message_header_size, locate.len);
         }
+        next_hop = Route(GetPid(), PlacementKey(fid), &locate, sizeof(OfferMessage), LOCATE, avoid);
+    } else {
+        next_hop = Route(GetPid(), PlacementKey(fid), msg, len, request->type, avoid);
     }
+    // the request may have been answered right away
+    auto it = kernel->pending_requests.find(fid);
+    if (it != kernel->pending_requests.end()) {
+        it->second.next_hop = next_hop;
+    }
+}
 
-    if (next_hop == GetPid()) {
-        // current node is the closest node
-        // handle this message
-        switch (type) {
-        case JOIN: {
-            // reply to new node's join request
-            JoinResponseMessage* reply = new JoinResponseMessage(node_id, leaf_set);
-            if (TransmitMessage(GetPid(), src, reply, sizeof(JoinResponseMessage)) < 0) {
-                std::cerr << "Fail to send join response message from "
-                          << GetPid() << " to " << src << std::endl;
-            }
-            delete reply;
-
-            // then update my leaf set since I see a new node
-            // this has to be done after sending the reply because otherwise
-            // the new node might see itself in the leaf set
-            UpdateLeafSet(dest, src);
-            break;
-        }
-        case INSERT: {
-            // store the file
-            fileID fid = (fileID) dest;
-            int file_len = len - data_message_header_size;
-            char* data = new char[file_len];
-            ParseDataMessageContent(msg, len, data, file_len);
-            if (file_map.find(fid) != file_map.end()) {
-                // free existing file
-                char* old_file = file_map[fid].first;
-                delete[] old_file;
-                file_map.erase(fid); // this is probably not needed
-            }
-            TracePrintf(10, "Store file %d of size %d at pid: %d nodeID: %04x content: %s\n",
-                        fid, file_len, GetPid(), node_id, data);
-            file_map[fid] = std::make_pair(data, file_len);
-
-            // send copy to 2 other node
-            char* message = MakeDataMessage(fid, data, file_len, REPLICATE);
-            int left_neighbor = leaf_set[P2P_LEAF_SIZE / 2 - 1].pid;
-            int right_neighbor = leaf_set[P2P_LEAF_SIZE / 2].pid;
-            int num_replicate = 0;
-            if (left_neighbor != 0) {
-                num_replicate++;
-                if (TransmitMessage(GetPid(), left_neighbor, message, len) < 0) {
-                    std::cerr << "Fail to forward insert message from "
-                              << src << " to " << left_neighbor << std::endl;
-                }
-            }
-            if (right_neighbor != 0) {
-                num_replicate++;
-                if (TransmitMessage(GetPid(), right_neighbor, message, len) < 0) {
-                    std::cerr << "Fail to forward insert message from "
-                              << src << " to " << right_neighbor << std::endl;
-                }
-            }
-            TracePrintf(10, "Send %d replicates to neighbor\n", num_replicate);
-            confirmation_waiting_map[fid] = std::make_pair(src, num_replicate);
-            delete[] message;
-            break;
+void ExpireRequests() {
+    long now = NowMillis();
+    std::vector<fileID> expired;
+    for (const auto &it : kernel->pending_requests) {
+        if (now >= it.second.expires_at) {
+            expired.push_back(it.first);
         }
-        case LOOK_UP: {
-            LookupMessage* message = (LookupMessage*) msg;
-            fileID fid = message->fid;
-            int buf_len = message->len;
-            if (file_map.find(fid) != file_map.end()) {
-                // send back the found file
-                int file_len = std::min(buf_len, file_map[fid].second);
-                TracePrintf(10, "Find file %d of size %d at pid: %d nodeID: %04x content %s\n",
-                            fid, file_len, GetPid(), node_id, file_map[fid].first);
-                char* reply = MakeDataMessage(fid, file_map[fid].first, file_len, LOOK_UP_CONFIRM);
-                if (TransmitMessage(GetPid(), src, reply,
-                                    data_message_header_size + file_len) < 0) {
-                    std::cerr << "Fail to reply to look up message from " << src << std::endl;
-                }
-                delete[] reply;
+    }
+    for (fileID fid : expired) {
+        PendingRequest &pending = kernel->pending_requests[fid];
+        const Message* request = (const Message*) pending.message.data();
+        if (pending.attempts >= request_retry_limit) {
+            TracePrintf(10, "Request of type %d for file %d timed out\n", request->type, fid);
+            bool tagged = request->type == LOOK_UP && kernel->tagged_lookups.erase(fid) > 0;
+            kernel->pending_requests.erase(fid);
+            kernel->chunk_requests.erase(fid);
+            if (tagged) {
+                FileMessage reply(TIMEOUT_ERROR, fid);
+                DeliverMessage(GetPid(), GetPid(), &reply, sizeof(FileMessage));
             } else {
-                // we don't have the file, send back response message without content
-                TracePrintf(10, "Cannot find file %d\n", fid);
-                Message* reply = new Message(LOOK_UP_FAIL);
-                if (TransmitMessage(GetPid(), src, reply, sizeof(Message)) < 0) {
-                    std::cerr << "Fail to reply to look up message from " << src << std::endl;
-                }
-                delete[] reply;
+                int status = TIMEOUT_ERROR;
+                DeliverMessage(GetPid(), GetPid(), &status, sizeof(int));
             }
-            break;
+            continue;
         }
-        case RECLAIM: {
-            FileMessage* message = (FileMessage*) msg;
-            fileID fid = message->fid;
-            if (file_map.find(fid) != file_map.end()) {
-                // free existing file
-                TracePrintf(10 , "Find file %hu to reclaim at pid: %d nodID: %04x\n", fid, GetPid(), node_id);
-                char* old_file = file_map[fid].first;
-                delete[] old_file;
-                file_map.erase(fid); // this is probably not needed
+        pending.attempts++;
+        pending.failures = 0;
+        pending.expires_at = now + (request_timeout << pending.attempts);
+        TracePrintf(10, "Retry request of type %d for file %d, attempt %d avoiding %d\n",
+                    request->type, fid, pending.attempts, pending.next_hop);
+        // routing may answer the request right away and drop pending
+        std::vector<char> message = pending.message;
+        RouteRequest(fid, message.data(), message.size(), pending.next_hop);
+    }
+    ReleaseChunkRequests();
+}
 
-                // send reclaim replicate to neighbor
-                FileMessage* reclaim_replicate_message = new FileMessage(RECLAIM_REPLICATE, fid);
-                int left_neighbor = leaf_set[P2P_LEAF_SIZE / 2 - 1].pid;
-                int right_neighbor = leaf_set[P2P_LEAF_SIZE / 2].pid;
-                int num_replicate = 0;
-                if (left_neighbor != 0) {
-                    num_replicate++;
-                    if (TransmitMessage(GetPid(), left_neighbor, reclaim_replicate_message, sizeof(FileMessage)) < 0) {
-                        std::cerr << "Fail to forward reclaim replicate message from "
-                                  << src << " to " << left_neighbor << std::endl;
-                    }
-                }
-                if (right_neighbor != 0) {
-                    num_replicate++;
-                    if (TransmitMessage(GetPid(), right_neighbor, reclaim_replicate_message, sizeof(FileMessage)) < 0) {
-                        std::cerr << "Fail to forward reclaim replicate message from "
-                                  << src << " to " << right_neighbor << std::endl;
-                    }
-                }
-                // TODO: Using the same map might result in some problem when one
-                // node is inserting a file and another node is reclaiming the same
-                // file.
-                confirmation_waiting_map[fid] = std::make_pair(src, num_replicate);
-                delete reclaim_replicate_message;
-            } else {
-                // we couldn't find the file to reclaim
-                Message* reply = new Message(RECLAIM_FAIL);
-                if (TransmitMessage(GetPid(), src, reply, sizeof(Message)) < 0) {
-                    std::cerr << "Fail to send reclaim fail message from "
-                              << GetPid() << " to " << src << std::endl;
-                }
-            }
-            break;
-        }
-        default: {
-            std::cerr << "Unknown message type to route: " << type << std::endl;
-        }
+void ExpireConfirmations() {
+    long now = NowMillis();
+    for (auto it = kernel->confirmation_waiting_map.begin(); it != kernel->confirmation_waiting_map.end();) {
+        if (now >= it->second.expires_at && it->second.wait_count > 0) {
+            TracePrintf(10, "Gave up waiting for %d confirmations of file %d\n",
+                        it->second.wait_count, it->first);
+            it = kernel->confirmation_waiting_map.erase(it);
+        } else {
+            ++it;
         }
-    } else {
-        // forward message to next node
-        if (TransmitMessage(src, next_hop, msg, len) < 0) {
-            std::cerr << "Fail to forward join message from "
-                      << src << " to " << next_hop << std::endl;
+    }
+    for (auto it = kernel->pending_spills.begin(); it != kernel->pending_spills.end();) {
+        if (now >= it->second.expires_at) {
+            // the origin retries the insert
+            TracePrintf(10, "Gave up waiting for the spill of file %d\n", it->first);
+            it = kernel->pending_spills.erase(it);
+        } else {
+            ++it;
         }
     }
 }
 
-unsigned short Distance(nodeID x, nodeID y) {
-    if (x <= y) {
-        return y - x;
-    } else {
-        return RING_SIZE - x + y;
+void AwaitConfirmations(int origin, fileID fid, int count, int reply_type) {
+    kernel->confirmation_waiting_map[fid] = {origin, count, NowMillis() + confirmation_timeout, reply_type};
+    FinishConfirmation(fid);
+}
+
+void FinishConfirmation(fileID fid) {
+    auto it = kernel->confirmation_waiting_map.find(fid);
+    if (it == kernel->confirmation_waiting_map.end() || it->second.wait_count > 0 || !LeasesRevoked(fid)) {
+        return;
     }
+    TracePrintf(10, "Send confirm from %d to %d\n", GetPid(), it->second.origin);
+    ReplyToOrigin(it->second.origin, it->second.reply_type, fid, 0);
+    kernel->confirmation_waiting_map.erase(it);
 }
 
-unsigned short AbsoluteDistance(nodeID x, nodeID y) {
-    return std::min(std::abs(x - y), RING_SIZE - std::abs(x - y));
+bool FinishRequest(fileID fid, bool hedge, bool success) {
+    auto it = kernel->pending_requests.find(fid);
+    if (it == kernel->pending_requests.end()) {
+        return false;
+    }
+    PendingRequest &pending = it->second;
+    const Message* request = (const Message*) pending.message.data();
+    if (!success && pending.hedged && pending.failures == 0) {
+        // wait for the other request, it may still find a copy
+        pending.failures++;
+        return false;
+    }
+    if (success && request->type == LOOK_UP) {
+        kernel->lookup_count++;
+        kernel->lookup_latencies.push_back(NowMillis() - pending.sent_at);
+        if ((int) kernel->lookup_latencies.size() > hedge_latency_window) {
+            kernel->lookup_latencies.pop_front();
+        }
+        if (hedge) {
+            kernel->hedge_win_count++;
+        }
+    }
+    kernel->pending_requests.erase(it);
+    if (kernel->chunk_requests.erase(fid) > 0) {
+        ReleaseChunkRequests();
+    }
+    return true;
 }
 
-void UpdateLeafSet(nodeID id, int src) {
-    TracePrintf(10, "Update leaf set (%d,%d)\n", id, src);
-    int distance;
-    int max_distance;
-    int index;
+int LookupLoad() {
+    return kernel->lookup_load + kernel->served_lookups;
+}
+
+int NeighborLoad(nodeID id) {
+    if (kernel->neighbor_load.find(id) == kernel->neighbor_load.end()) {
+        return -1;
+    }
+    return kernel->neighbor_load[id];
+}
 
-    if (node_id == id) {
+void NoteReplicaRoot(fileID fid, int root) {
+    if (kernel->file_map.find(fid) == kernel->file_map.end()) {
         return;
     }
+    if (kernel->route_candidates_dirty) {
+        RebuildRouteCandidates();
+    }
+    int nearest = NearestCandidate(kernel->route_candidates.ids.data(), kernel->route_candidates.Size(),
+                                   PlacementKey(fid));
+    if (nearest >= 0 && kernel->route_candidates.pids[nearest] == root) {
+        kernel->replica_roots[fid] = root;
+    }
+}
 
-    // if id is already in leaf set, do nothing
-    // this is slow for large leaf set
-    for (const auto &e : leaf_set) {
-        if (e.id == id) {
-            return;
-        }
+bool IsCurrentReplica(fileID fid) {
+    auto it = kernel->replica_roots.find(fid);
+    if (it == kernel->replica_roots.end()) {
+        return false;
+    }
+    if (kernel->route_candidates_dirty) {
+        RebuildRouteCandidates();
     }
+    int nearest = NearestCandidate(kernel->route_candidates.ids.data(), kernel->route_candidates.Size(),
+                                   PlacementKey(fid));
+    if (nearest < 0 || kernel->route_candidates.pids[nearest] != it->second) {
+        // a node closer to the key took the file over, or the root is gone
+        return false;
+    }
+    auto summary = kernel->neighbor_summaries.find(kernel->route_candidates.ids[nearest]);
+    return summary != kernel->neighbor_summaries.end()
+        && (summary->second.leaf_set[P2P_LEAF_SIZE / 2 - 1].pid == GetPid()
+            || summary->second.leaf_set[P2P_LEAF_SIZE / 2].pid == GetPid());
+}
 
-    // Greedy algorithm
-    // 1. try to treat the given nodeID as smaller than the current node_id
-    // 1.a if there is an empty spot in the lower half, just fill it
-    // 2. if the smaller half of the leaf set is already filled,
-    // see if we are closer to any of those nodes
-    // 2.a if we are closer, pick the node in the smaller half that is most distant
-    // from current node and replace it. Then try to fit the replaced node into larger half
-    // 2.b if not, treat the given nodeID as larger than the current node_id and
-    // try to fit it into the larger half
-    distance = Distance(id, node_id);
-    max_distance = distance;
-    for (int i = 0; i < P2P_LEAF_SIZE / 2; i++) {
-        Entry* e = &leaf_set[i];
-        if (e->pid == 0) {
-            // 1.a
-            e->id = id;
-            e->pid = src;
-            return;
-        } else if (Distance(e->id, node_id) > max_distance) {
-            max_distance = Distance(e->id, node_id);
+int SelectReplica(const VirtualNode &root, fileID fid) {
+    if (!balance_lookups) {
+        return -1;
+    }
+    const std::vector<Entry>* hot = NULL;
+    if (kernel->hot_replicas.find(fid) != kernel->hot_replicas.end()) {
+        hot = &kernel->hot_replicas[fid];
+    }
+    int index = -1;
+    int min_load = LookupLoad();
+    for (int i = 0; i < P2P_LEAF_SIZE; i++) {
+        const Entry &e = root.leaf_set[i];
+        bool replica = i == P2P_LEAF_SIZE / 2 - 1 || i == P2P_LEAF_SIZE / 2;
+        for (int j = 0; hot != NULL && j < (int) hot->size(); j++) {
+            replica = replica || ((*hot)[j].id == e.id && (*hot)[j].pid == e.pid);
+        }
+        if (!replica) {
+            continue;
+        }
+        int load = NeighborLoad(e.id);
+        if (RemotePid(e) != 0 && load >= 0 && load < min_load) {
+            min_load = load;
             index = i;
         }
     }
-    if (max_distance > distance) {
-        // 2.a
-        UpdateUpperLeafSet(leaf_set[index].id, leaf_set[index].pid);
-        leaf_set[index].id = id;
-        leaf_set[index].pid = src;
-    } else {
-        UpdateUpperLeafSet(id, src);
+    return index;
+}
+
+int TransmitCounted(int src, int dest, const void *msg, int len) {
+    CountTraffic(msg, len);
+    return TransmitMessage(src, dest, msg, len);
+}
+
+void CountTraffic(const void *msg, int len) {
+    if (len < (int) sizeof(int)) {
+        return;
+    }
+    switch (((const Message*) msg)->type) {
+    case JOIN:
+    case JOIN_RES:
+    case FLOOD:
+    case FLOOD_RES:
+    case EXCHANGE:
+    case EXCHANGE_RES:
+    case LEAVE_NOTICE:
+    case KEY_ADDED:
+        kernel->maintenance_bytes += len;
+        break;
+    case REPLICATE:
+    case REPLICATE_CONFIRM:
+    case CHAIN_REPLICATE:
+    case WRITE_REPLICATE:
+    case RECLAIM_REPLICATE:
+    case RECLAIM_REPLICATE_CONFIRM:
+    case SPILL:
+    case HANDOFF:
+    case HANDOFF_CONFIRM:
+    case HOT_REPLICATE:
+    case REPLICATE_OFFER:
+    case REPLICATE_PULL:
+    case HANDOFF_OFFER:
+    case HANDOFF_PULL:
+    case SPILL_HANDOFF:
+        kernel->replication_bytes += len;
+        break;
     }
 }
 
-void UpdateUpperLeafSet(nodeID id, int src) {
-    int distance;
-    int max_distance;
-    int index;
+bool IsBackgroundMessage(const void *msg, int len) {
+    if (len < (int) sizeof(int)) {
+        return false;
+    }
+    switch (((const Message*) msg)->type) {
+    case SPILL_RELEASE:
+    case HOT_RELEASE:
+    case KEY_ADDED:
+    case PATH_RENEW:
+    case LEASE_TRANSFER:
+    case HANDOFF_OFFER:
+        return true;
+    default:
+        return false;
+    }
+}
 
-    distance = Distance(node_id, id);
-    max_distance = distance;
-    for (int i = P2P_LEAF_SIZE / 2; i < P2P_LEAF_SIZE; i++) {
-        Entry* e = &leaf_set[i];
-        if (e->pid == 0) {
-            e->id = id;
-            e->pid = src;
-            return;
-        } else if (Distance(node_id, e->id) > max_distance) {
-            max_distance = Distance(node_id, e->id);
-            index = i;
-        }
+int QueueMessage(int src, int dest, const void *msg, int len) {
+    CountTraffic(msg, len);
+    if (!coalesce_messages || dest <= 0 || dest == GetPid() || len > coalesce_max_message
+            || !IsBackgroundMessage(msg, len)) {
+        // keep the order of messages to dest
+        FlushOutbox(dest);
+        return TransmitMessage(src, dest, msg, len);
     }
-    if (max_distance > distance) {
-        leaf_set[index].id = id;
-        leaf_set[index].pid = src;
+    long now = NowMillis();
+    Outbox &outbox = kernel->outboxes[dest];
+    if (outbox.count == 0 && now - outbox.last_sent_at >= coalesce_delay) {
+        // nothing went to dest lately, don't hold the message back
+        outbox.last_sent_at = now;
+        return TransmitMessage(src, dest, msg, len);
     }
+    int entry_len = envelope_entry_header_size + len;
+    if (outbox.count > 0 && (int) outbox.envelope.size() + entry_len > envelope_max_size) {
+        FlushOutbox(dest);
+    }
+    if (outbox.count == 0) {
+        outbox.envelope.resize(envelope_header_size);
+        outbox.opened_at = now;
+    }
+    int offset = outbox.envelope.size();
+    outbox.envelope.resize(offset + entry_len);
+    AppendEnvelopeEntry(outbox.envelope.data(), offset, src, msg, len);
+    outbox.count++;
+    return 0;
 }
 
-void RemoveNodeFromLeafSet(nodeID id) {
-    TracePrintf(10, "Remove dead node %04x from leaf set\n", id);
-    for (auto &e : leaf_set) {
-        if (e.id == id) {
-            e.id = 0;
-            e.pid = 0;
+void FlushOutbox(int pid) {
+    auto it = kernel->outboxes.find(pid);
+    if (it == kernel->outboxes.end() || it->second.count == 0) {
+        return;
+    }
+    Outbox &outbox = it->second;
+    int status;
+    if (outbox.count == 1) {
+        // a single message doesn't need an envelope
+        int src = 0;
+        int len = 0;
+        int offset = ParseEnvelopeEntry(outbox.envelope.data(), outbox.envelope.size(),
+                                        envelope_header_size, &src, &len);
+        status = TransmitMessage(src, pid, outbox.envelope.data() + offset, len);
+    } else {
+        TracePrintf(10, "Send envelope of %d messages to %d\n", outbox.count, pid);
+        MakeEnvelopeHeader(outbox.envelope.data(), outbox.count);
+        status = TransmitMessage(GetPid(), pid, outbox.envelope.data(), outbox.envelope.size());
+    }
+    if (status < 0) {
+        std::cerr << "Fail to send " << outbox.count << " queued messages from "
+                  << GetPid() << " to " << pid << std::endl;
+    }
+    outbox.envelope.clear();
+    outbox.count = 0;
+    outbox.last_sent_at = NowMillis();
+}
+
+void FlushOutboxes(bool all) {
+    long now = NowMillis();
+    for (auto &it : kernel->outboxes) {
+        if (it.second.count > 0 && (all || now - it.second.opened_at >= coalesce_delay)) {
+            FlushOutbox(it.first);
         }
     }
 }
 
-void PrintLeafSet() {
-    TracePrintf(10, "node_id: %04x, leaf_set: (%d), (%d), (%d), (%d)\n",
-                node_id, leaf_set[0].id, leaf_set[1].id, leaf_set[2].id, leaf_set[3].id);
-}
\ No newline at end of file
+KernelContext* NewKernelContext() {
+    return new KernelContext();
+}
+
+void SetKernelContext(KernelContext* context) {
+    kernel = context != NULL ? context : &main_context;
+}
@@ -0,0 +1,115 @@
+/**
+ * This program reports how evenly files are spread over the nodes.
+ * After all nodes join, every process inserts FILES_PER_NODE files
+ * whose fileIDs are clustered around FID_BASE, like the fileIDs used by
+ * store1.c. Every process then publishes the statistics of its own node
+ * as a small file at fileID STATS_FID_BASE + index, and process index 0
+ * looks all of them up and prints the max/mean ratio of the storage used.
+ *
+ * Run it once with the default kernel and once with virtual_node_count
+ * and/or hash_file_ids changed in kernel.cc to compare the ratios.
+ *
+ * Run as: rednet -P 1 -N [other_flags] kernel -- load_report ##
+ */
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rednet.h>
+#include <rednet-p2p.h>
+
+#include "overlay.h"
+
+#define NUM_NODES       32
+#define FILES_PER_NODE  8
+#define FID_BASE        0x1100
+#define STATS_FID_BASE  0xff00
+
+nodeID Nid;
+int Idx;
+
+char data[] = "load report file";
+
+int
+main(int argc, char **argv) {
+    int status;
+    int i;
+    NodeStats stats;
+
+    if (argc < 2) {
+        fprintf(stderr,
+                "Process index argument missing: run with ## on command line.\n");
+        exit(1);
+    }
+
+    Idx = atoi(argv[1]);    /* number from 0 to 31 */
+    Nid = GetNodeID();
+
+    fprintf(stderr, "Pid %d nodeID %04x index %d\n", GetPid(), Nid, Idx);
+
+    /* same join schedule as store1.c */
+    if (Idx != 0) {
+        MilliSleep(25 * 1000);
+    }
+    status = Join(Nid);
+    if (status != 0) {
+        fprintf(stderr, "ERROR: Join returned %d!\n", status);
+        exit(1);
+    }
+    if (Idx == 0) {
+        MilliSleep(25 * 1000);
+    }
+    MilliSleep(25 * 1000);
+
+    /* sequential fileIDs, all of them close to each other on the ring */
+    for (i = 0; i < FILES_PER_NODE; i++) {
+        status = Insert(FID_BASE + Idx * FILES_PER_NODE + i, data, sizeof(data));
+        if (status != 0) {
+            fprintf(stderr, "ERROR: Insert %d returned %d!\n", i, status);
+        }
+    }
+
+    MilliSleep(25 * 1000);  /* allow all Inserts to finish */
+
+    if (GetStats(&stats) != 0) {
+        fprintf(stderr, "ERROR: GetStats failed!\n");
+        exit(1);
+    }
+    fprintf(stderr, "index %d stores %d files, %d bytes in %d distinct bytes with %d virtual nodes\n",
+            Idx, stats.file_count, stats.storage_used, stats.content_bytes, stats.virtual_node_count);
+    status = Insert(STATS_FID_BASE + Idx, &stats, sizeof(stats));
+    if (status != 0) {
+        fprintf(stderr, "ERROR: Insert of stats returned %d!\n", status);
+    }
+
+    MilliSleep(25 * 1000);  /* allow everyone to publish their stats */
+
+    if (Idx == 0) {
+        int reported = 0;
+        long total = 0;
+        int max = 0;
+        for (i = 0; i < NUM_NODES; i++) {
+            status = Lookup(STATS_FID_BASE + i, &stats, sizeof(stats));
+            if (status != sizeof(stats)) {
+                fprintf(stderr, "ERROR: stats of index %d missing!\n", i);
+                continue;
+            }
+            reported++;
+            total += stats.storage_used;
+            if (stats.storage_used > max) {
+                max = stats.storage_used;
+            }
+        }
+        if (reported > 0 && total > 0) {
+            double mean = (double) total / reported;
+            printf("load report: %d nodes, %d virtual nodes each, max %d bytes, "
+                   "mean %.1f bytes, max/mean %.2f\n",
+                   reported, stats.virtual_node_count, max, mean, max / mean);
+        }
+    }
+
+    MilliSleep(25 * 1000);
+    exit(0);
+}
@@ -11,13 +11,20 @@ JoinResponseMessage::JoinResponseMessage(nodeID node_id, Entry other_leaf_set[P2
     std::copy(other_leaf_set, other_leaf_set + P2P_LEAF_SIZE, leaf_set);
 }
 
-ExchangeMessage::ExchangeMessage(nodeID node_id, Entry other_leaf_set[P2P_LEAF_SIZE]):
-    type(EXCHANGE), id(node_id) {
+LeaveMessage::LeaveMessage(nodeID node_id, Entry other_leaf_set[P2P_LEAF_SIZE]):
+    type(LEAVE_NOTICE), id(node_id) {
     std::copy(other_leaf_set, other_leaf_set + P2P_LEAF_SIZE, leaf_set);
 }
 
-ExchangeResponseMessage::ExchangeResponseMessage(nodeID node_id, Entry other_leaf_set[P2P_LEAF_SIZE]):
-    type(EXCHANGE_RES), id(node_id) {
+ExchangeMessage::ExchangeMessage(nodeID node_id, Entry other_leaf_set[P2P_LEAF_SIZE], int free, int lookup_load,
+                                 const KeyFilter &key_filter):
+    type(EXCHANGE), id(node_id), free_capacity(free), load(lookup_load), keys(key_filter) {
+    std::copy(other_leaf_set, other_leaf_set + P2P_LEAF_SIZE, leaf_set);
+}
+
+ExchangeResponseMessage::ExchangeResponseMessage(nodeID node_id, Entry other_leaf_set[P2P_LEAF_SIZE], int free, int lookup_load,
+                                                 const KeyFilter &key_filter):
+    type(EXCHANGE_RES), id(node_id), free_capacity(free), load(lookup_load), keys(key_filter) {
     std::copy(other_leaf_set, other_leaf_set + P2P_LEAF_SIZE, leaf_set);
 }
 
@@ -36,7 +43,7 @@ char* MakeDataMessage(fileID fid, void* contents, int len, int type) {
 int ParseDataMessageHeader(const void* msg, int len, fileID* fid) {
     // skip type
     int offset = sizeof(int);
-    std::memcpy(fid, msg + offset, sizeof(fileID));
+    std::memcpy(fid, (const char*) msg + offset, sizeof(fileID));
     offset += sizeof(fileID);
     return offset;
 }
@@ -44,7 +51,210 @@ int ParseDataMessageHeader(const void* msg, int len, fileID* fid) {
 int ParseDataMessageContent(const void* msg, int len, char* buf, int buf_len) {
     // skip type and fid
     int offset = data_message_header_size;
-    std::memcpy(buf, msg + offset, buf_len * sizeof(char));
+    std::memcpy(buf, (const char*) msg + offset, buf_len * sizeof(char));
     offset += buf_len * sizeof(char);
     return offset;
-}
\ No newline at end of file
+}
+
+char* MakeWriteMessage(fileID fid, int offset, const void* contents, int len, int type) {
+    char* message = new char[write_message_header_size + len * sizeof(char)];
+    std::memcpy(message, &type, sizeof(int));
+    std::memcpy(message + sizeof(int), &fid, sizeof(fileID));
+    std::memcpy(message + data_message_header_size, &offset, sizeof(int));
+    std::memcpy(message + write_message_header_size, contents, len * sizeof(char));
+    return message;
+}
+
+char* MakePathCacheMessage(fileID fid, int version, int ttl, const void* contents, int len) {
+    char* message = new char[path_cache_header_size + len * sizeof(char)];
+    int type = PATH_CACHE;
+    std::memcpy(message, &type, sizeof(int));
+    std::memcpy(message + sizeof(int), &fid, sizeof(fileID));
+    std::memcpy(message + data_message_header_size, &version, sizeof(int));
+    std::memcpy(message + data_message_header_size + sizeof(int), &ttl, sizeof(int));
+    std::memcpy(message + path_cache_header_size, contents, len * sizeof(char));
+    return message;
+}
+
+unsigned long long ContentHash(const void* data, int len) {
+    const unsigned char* bytes = (const unsigned char*) data;
+    unsigned long long hash = 14695981039346656037ULL;
+    for (int i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+int RepairDelayBucket(long delay) {
+    int bucket = 0;
+    while (bucket < repair_delay_buckets - 1 && delay >= ((long) repair_delay_base << bucket)) {
+        bucket++;
+    }
+    return bucket;
+}
+
+unsigned short Mix16(unsigned short x) {
+    // xorshift and multiplication by an odd constant are both invertible modulo 2^16
+    x ^= x >> 7;
+    x *= 0x2f4b;
+    x ^= x >> 9;
+    x *= 0x6d2b;
+    x ^= x >> 8;
+    return x;
+}
+
+fileID ChunkFileID(fileID fid, int index) {
+    // consecutive chunks take consecutive slots, starting at a slot picked by the stream
+    return chunk_fid_base + (Mix16(fid) + index) % chunk_fid_count;
+}
+
+bool IsChunkFileID(fileID fid) {
+    return fid >= chunk_fid_base && fid - chunk_fid_base < chunk_fid_count;
+}
+
+void MakeChunkHeader(char* buf, fileID stream, int index) {
+    std::memcpy(buf, &stream, sizeof(fileID));
+    std::memcpy(buf + sizeof(fileID), &index, sizeof(int));
+}
+
+bool IsChunkOf(const char* chunk, int len, fileID stream, int index) {
+    if (len < chunk_header_size) {
+        return false;
+    }
+    fileID chunk_stream = 0;
+    int chunk_index = 0;
+    std::memcpy(&chunk_stream, chunk, sizeof(fileID));
+    std::memcpy(&chunk_index, chunk + sizeof(fileID), sizeof(int));
+    return chunk_stream == stream && chunk_index == index;
+}
+
+int ParseWriteMessageHeader(const void* msg, int len, fileID* fid, int* offset) {
+    ParseDataMessageHeader(msg, len, fid);
+    std::memcpy(offset, (const char*) msg + data_message_header_size, sizeof(int));
+    return write_message_header_size;
+}
+
+int ParsePathCacheHeader(const void* msg, int len, fileID* fid, int* version, int* ttl) {
+    ParseDataMessageHeader(msg, len, fid);
+    std::memcpy(version, (const char*) msg + data_message_header_size, sizeof(int));
+    std::memcpy(ttl, (const char*) msg + data_message_header_size + sizeof(int), sizeof(int));
+    return path_cache_header_size;
+}
+
+int AppendScanEntry(char* batch, int offset, fileID fid, const char* contents, int len) {
+    std::memcpy(batch + offset, &fid, sizeof(fileID));
+    offset += sizeof(fileID);
+    std::memcpy(batch + offset, &len, sizeof(int));
+    offset += sizeof(int);
+    if (len > 0) {
+        std::memcpy(batch + offset, contents, len * sizeof(char));
+        offset += len * sizeof(char);
+    }
+    return offset;
+}
+
+void MakeScanBatchHeader(char* batch, int sequence, int count, int last) {
+    int header[] = {SCAN_BATCH, sequence, count, last};
+    std::memcpy(batch, header, scan_batch_header_size);
+}
+
+int ParseScanBatchHeader(const void* msg, int* sequence, int* count, int* last) {
+    int header[4];
+    std::memcpy(header, msg, scan_batch_header_size);
+    *sequence = header[1];
+    *count = header[2];
+    *last = header[3];
+    return scan_batch_header_size;
+}
+
+int ParseScanEntry(const void* msg, int msg_len, int offset, fileID* fid, const char** contents, int* len) {
+    if (offset < 0 || offset + (int) (sizeof(fileID) + sizeof(int)) > msg_len) {
+        return -1;
+    }
+    std::memcpy(fid, (const char*) msg + offset, sizeof(fileID));
+    offset += sizeof(fileID);
+    std::memcpy(len, (const char*) msg + offset, sizeof(int));
+    offset += sizeof(int);
+    *contents = (const char*) msg + offset;
+    if (*len > 0) {
+        if (*len > msg_len - offset) {
+            return -1;
+        }
+        offset += *len * sizeof(char);
+    }
+    return offset;
+}
+
+int AppendEnvelopeEntry(char* envelope, int offset, int src, const void* msg, int len) {
+    std::memcpy(envelope + offset, &src, sizeof(int));
+    offset += sizeof(int);
+    std::memcpy(envelope + offset, &len, sizeof(int));
+    offset += sizeof(int);
+    std::memcpy(envelope + offset, msg, len);
+    return offset + len;
+}
+
+void MakeEnvelopeHeader(char* envelope, int count) {
+    int header[] = {ENVELOPE, count};
+    std::memcpy(envelope, header, envelope_header_size);
+}
+
+int ParseEnvelopeHeader(const void* msg) {
+    int header[2];
+    std::memcpy(header, msg, envelope_header_size);
+    return header[1];
+}
+
+int ParseEnvelopeEntry(const void* msg, int msg_len, int offset, int* src, int* len) {
+    if (offset < 0 || offset + 2 * (int) sizeof(int) > msg_len) {
+        return -1;
+    }
+    std::memcpy(src, (const char*) msg + offset, sizeof(int));
+    offset += sizeof(int);
+    std::memcpy(len, (const char*) msg + offset, sizeof(int));
+    offset += sizeof(int);
+    if (*len < 0 || *len > msg_len - offset) {
+        return -1;
+    }
+    return offset;
+}
+
+char* MakeChainMessage(fileID fid, int root, const int* chain, int length, const void* contents, int len) {
+    char* message = new char[chain_message_header_size + len];
+    int type = CHAIN_REPLICATE;
+    int position = 0;
+    int offset = 0;
+    std::memcpy(message + offset, &type, sizeof(int));
+    offset += sizeof(int);
+    std::memcpy(message + offset, &fid, sizeof(fileID));
+    offset += sizeof(fileID);
+    std::memcpy(message + offset, &root, sizeof(int));
+    offset += sizeof(int);
+    std::memcpy(message + offset, &position, sizeof(int));
+    offset += sizeof(int);
+    std::memcpy(message + offset, &length, sizeof(int));
+    offset += sizeof(int);
+    std::memset(message + offset, 0, P2P_LEAF_SIZE * sizeof(int));
+    std::memcpy(message + offset, chain, length * sizeof(int));
+    offset += P2P_LEAF_SIZE * sizeof(int);
+    std::memcpy(message + offset, contents, len);
+    return message;
+}
+
+int ParseChainMessageHeader(const void* msg, fileID* fid, int* root, int* position, int* length, int* chain) {
+    int offset = ParseDataMessageHeader(msg, 0, fid);
+    std::memcpy(root, (const char*) msg + offset, sizeof(int));
+    offset += sizeof(int);
+    std::memcpy(position, (const char*) msg + offset, sizeof(int));
+    offset += sizeof(int);
+    std::memcpy(length, (const char*) msg + offset, sizeof(int));
+    offset += sizeof(int);
+    std::memcpy(chain, (const char*) msg + offset, P2P_LEAF_SIZE * sizeof(int));
+    offset += P2P_LEAF_SIZE * sizeof(int);
+    return offset;
+}
+
+void SetChainPosition(char* msg, int position) {
+    std::memcpy(msg + data_message_header_size + sizeof(int), &position, sizeof(int));
+}
@@ -6,6 +6,8 @@
 
 #include <array>
 
+#include "sketch.h"
+
 const int JOIN = 0;
 const int JOIN_RES = 1;
 const int FLOOD = 2;
@@ -24,8 +26,77 @@ const int RECLAIM_CONFIRM = 14;
 const int RECLAIM_FAIL = 15;
 const int RECLAIM_REPLICATE = 16;
 const int RECLAIM_REPLICATE_CONFIRM = 17;
+const int INSERT_FAIL = 18;
+const int SPILL = 19;
+const int SPILL_FAIL = 20;
+const int SPILL_RELEASE = 21;
+const int LOOK_UP_LOCAL = 22;
+const int STATS = 23;
+const int SCAN = 24;
+const int SCAN_BATCH = 25;
+const int SCAN_NEXT = 26;
+const int WRITE = 27;
+const int WRITE_REPLICATE = 28;
+const int LOOK_UP_HEDGE_CONFIRM = 29;
+const int ENVELOPE = 30;
+const int CHAIN_REPLICATE = 31;
+const int LEAVE = 32;
+const int LEAVE_NOTICE = 33;
+const int HANDOFF = 34;
+const int HANDOFF_CONFIRM = 35;
+const int HANDOFF_FAIL = 36;
+const int HOT_REPLICATE = 37;
+const int HOT_RELEASE = 38;
+const int KEY_ADDED = 39;
+const int LOOK_UP_LEASE_CONFIRM = 40;
+const int LEASE_CHECK = 41;
+const int LEASE_INVALIDATE = 42;
+const int PATH_CACHE = 43;
+const int PATH_RENEW = 44;
+const int LOCATE = 45;
+const int LOCATE_RES = 46;
+const int REPLICATE_OFFER = 47;
+const int REPLICATE_PULL = 48;
+const int HANDOFF_OFFER = 49;
+const int HANDOFF_PULL = 50;
+const int CHUNK_INSERT = 51;
+const int LEASE_INVALIDATE_CONFIRM = 52;
+const int LEASE_TRANSFER = 53;
+const int SPILL_HANDOFF = 54;
+
+// status delivered to the user process when a request timed out
+const int TIMEOUT_ERROR = -2;
 
 const int data_message_header_size = sizeof(int) + sizeof(fileID);
+const int write_message_header_size = data_message_header_size + sizeof(int);
+const int path_cache_header_size = data_message_header_size + 2 * sizeof(int);
+// offset of a write that appends to the end of the file
+const int APPEND_OFFSET = -1;
+
+/**
+ * Streams. A file larger than P2P_FILE_MAXSIZE is split into chunks of
+ * stream_chunk_size bytes, each stored under its own fileID, plus a manifest
+ * stored under the fileID of the file. Chunk fileIDs come from the
+ * chunk_fid_count fileIDs starting at chunk_fid_base, which the kernel doesn't
+ * let the user process insert or write directly. A stored chunk starts with a
+ * chunk header naming its stream and index, since two streams can map chunks to
+ * the same fileID. At most stream_window chunk transfers of a process are in
+ * flight at a time, the kernel holds back the rest.
+ */
+const int chunk_header_size = sizeof(fileID) + sizeof(int);
+const int stream_chunk_size = P2P_FILE_MAXSIZE - chunk_header_size;
+const int stream_window = 8;
+const fileID chunk_fid_base = 0xb000;
+const int chunk_fid_count = 0x1000;
+const int STREAM_MAGIC = 0x5354524d;
+const int scan_batch_header_size = 4 * sizeof(int);
+const int scan_entry_header_size = sizeof(fileID) + sizeof(int);
+// large enough for a batch holding a single file of the maximum size
+const int scan_batch_max_size = scan_batch_header_size + scan_entry_header_size + P2P_FILE_MAXSIZE;
+const int envelope_header_size = 2 * sizeof(int);
+const int envelope_entry_header_size = 2 * sizeof(int);
+const int envelope_max_size = P2P_FILE_MAXSIZE;
+const int chain_message_header_size = data_message_header_size + (3 + P2P_LEAF_SIZE) * sizeof(int);
 
 struct Message {
     int type;
@@ -53,18 +124,43 @@ struct JoinResponseMessage {
     JoinResponseMessage(nodeID node_id, Entry other_leaf_set[P2P_LEAF_SIZE]);
 };
 
+/**
+ * Exchange messages also advertise how many bytes the sender can still store,
+ * so that an over budget node can pick a leaf set member to spill files to, and
+ * how many look ups it served recently, so that reads can go to the least loaded copy.
+ * keys summarizes the fileIDs the sender stores or is the root of.
+ */
 struct ExchangeMessage {
     int type;
     nodeID id;
+    int free_capacity;
+    int load;
     Entry leaf_set[P2P_LEAF_SIZE];
-    ExchangeMessage(nodeID node_id, Entry other_leaf_set[P2P_LEAF_SIZE]);
+    KeyFilter keys;
+    ExchangeMessage(nodeID node_id, Entry other_leaf_set[P2P_LEAF_SIZE], int free, int lookup_load,
+                    const KeyFilter &key_filter);
 };
 
 struct ExchangeResponseMessage {
+    int type;
+    nodeID id;
+    int free_capacity;
+    int load;
+    Entry leaf_set[P2P_LEAF_SIZE];
+    KeyFilter keys;
+    ExchangeResponseMessage(nodeID node_id, Entry other_leaf_set[P2P_LEAF_SIZE], int free, int lookup_load,
+                            const KeyFilter &key_filter);
+};
+
+/**
+ * Sent by a leaving node to its leaf set members once its files are handed off,
+ * with its leaf set so that they can fill the gap it leaves.
+ */
+struct LeaveMessage {
     int type;
     nodeID id;
     Entry leaf_set[P2P_LEAF_SIZE];
-    ExchangeResponseMessage(nodeID node_id, Entry other_leaf_set[P2P_LEAF_SIZE]);
+    LeaveMessage(nodeID node_id, Entry other_leaf_set[P2P_LEAF_SIZE]);
 };
 
 struct FloodMessage {
@@ -80,15 +176,181 @@ struct ReplicateConfirmMessage {
     ReplicateConfirmMessage(fileID file_id): type(REPLICATE_CONFIRM), fid(file_id) {}
 };
 
+/**
+ * Look up len bytes of a file starting at offset. If tagged is set, the reply is
+ * delivered to the user process as a single message starting with the status and
+ * the fileID, so that replies to look ups done in parallel can be told apart.
+ * hedge is set by the kernel on the second request of a hedged look up, which is
+ * answered by a replica instead of the root. root_pid is set when the root passes
+ * the look up on to a replica, so that the replica can hand it back if it has no copy.
+ * lease is set by a user process that caches files, the root then answers the look
+ * up itself and tells the requester when the file changes.
+ * via is set by every node forwarding the look up to its own pid, so the node that
+ * answers it knows the last hop on the way and can push it a copy of a popular file.
+ * version is set by that hop when its copy expired, to ask whether it is still current.
+ * When the root passes the look up on to a replica, it sets version to the version of
+ * its copy, and an extra replica of a hot file with an older copy hands it back.
+ * nocache is set by the kernel for files its user process changed recently, such a
+ * look up skips the copies cached along the way.
+ */
 struct LookupMessage {
     int type;
     fileID fid;
+    int offset;
     int len;
-    LookupMessage(fileID file_id, int length): type(LOOK_UP), fid(file_id), len(length) {}
+    int tagged;
+    int hedge;
+    int root_pid;
+    int lease;
+    int via;
+    int version;
+    int nocache;
+    LookupMessage(fileID file_id, int off, int length, int tag = 0):
+        type(LOOK_UP), fid(file_id), offset(off), len(length), tagged(tag), hedge(0), root_pid(0),
+        lease(0), via(0), version(0), nocache(0) {}
+};
+
+/**
+ * Hands a lease the sender granted on a file to the new root of the file, so that
+ * the new root invalidates it before the file changes. expires_in is the time left
+ * on the lease in milliseconds.
+ */
+struct LeaseTransferMessage {
+    int type;
+    fileID fid;
+    int pid;
+    int expires_in;
+    LeaseTransferMessage(fileID file_id, int holder, int time_left):
+        type(LEASE_TRANSFER), fid(file_id), pid(holder), expires_in(time_left) {}
+};
+
+/**
+ * Hands the pointer to a spilled file to the node that is its root now. holder names
+ * the leaf set member holding the file and len is the length of the file. Sent by the
+ * old root on a handoff, and by the holder once the root that spilled the file to it
+ * isn't the root of the file anymore.
+ */
+struct SpillHandoffMessage {
+    int type;
+    fileID fid;
+    Entry holder;
+    int len;
+    SpillHandoffMessage(fileID file_id, Entry holder_entry, int length):
+        type(SPILL_HANDOFF), fid(file_id), holder(holder_entry), len(length) {}
+};
+
+/**
+ * Offers a file to a node that may have the same content already, so that the
+ * content is only sent if the copy of the receiver differs. len is -1 if no
+ * content is offered, as for a LOCATE of a write.
+ */
+struct OfferMessage {
+    int type;
+    fileID fid;
+    int len;
+    unsigned long long hash;
+    OfferMessage(int message_type, fileID file_id, int length, unsigned long long content_hash):
+        type(message_type), fid(file_id), len(length), hash(content_hash) {}
+};
+
+/**
+ * Tells a node caching a copy of a file along the look up route that its copy,
+ * stamped with version, is still current for another ttl milliseconds.
+ */
+struct PathRenewMessage {
+    int type;
+    fileID fid;
+    int version;
+    int ttl;
+    PathRenewMessage(fileID file_id, int file_version, int time_to_live):
+        type(PATH_RENEW), fid(file_id), version(file_version), ttl(time_to_live) {}
+};
+
+/**
+ * Stored under the fileID of a stream, describes its chunks.
+ */
+struct StreamManifest {
+    int magic;
+    int length;
+    int chunk_size;
+    int chunk_count;
+};
+
+/**
+ * Scan the files with fileID in [lo, hi]. The scan visits the owner of cursor and
+ * continues with its successor until remaining ring keys are covered.
+ */
+struct ScanMessage {
+    int type;
+    fileID lo;
+    fileID hi;
+    nodeID cursor;
+    int remaining;
+    int sequence;
+    ScanMessage(fileID low, fileID high):
+        type(SCAN), lo(low), hi(high), cursor(0), remaining(0), sequence(0) {}
+};
+
+// bucket i of the repair delay histogram counts delays below repair_delay_base << i
+// milliseconds, the last bucket counts the rest
+const int repair_delay_buckets = 8;
+const int repair_delay_base = 250;
+
+/**
+ * Statistics of a node, delivered to the user process in reply to a STATS message.
+ */
+struct NodeStats {
+    int file_count;
+    int storage_used;
+    int storage_capacity;
+    int virtual_node_count;
+    // look ups of the local user process that got an answer
+    int lookup_count;
+    // look ups that sent a second request to a replica
+    int hedge_count;
+    // hedged look ups answered by the replica first
+    int hedge_win_count;
+    // hedges that left this node by another first hop than their look up
+    int hedge_detour_count;
+    // current delay in milliseconds before a look up is hedged
+    int hedge_delay;
+    // joins this node answered as part of a batch of concurrent joins
+    int batched_join_count;
+    // number of changes of the leaf sets and milliseconds since the last one
+    int leaf_set_change_count;
+    int leaf_set_age;
+    // look ups this node answered
+    int served_lookup_count;
+    // files this node is the root of that have extra read replicas
+    int hot_key_count;
+    // look ups failed early or redirected by the key summaries of the leaf set
+    int filtered_lookup_count;
+    // look ups answered from copies cached along the look up route
+    int path_cache_hit_count;
+    // bytes of distinct contents, files with the same content are stored once
+    int content_bytes;
+    // leaf set of the first virtual node
+    Entry leaf_set[P2P_LEAF_SIZE];
+    // exchange periods so far, and the one the leaf sets last changed in
+    int exchange_round;
+    int leaf_set_round;
+    // bytes sent to keep the overlay up: joins, ring searches, exchanges and leave notices
+    long maintenance_bytes;
+    // bytes sent to copy files between nodes: replicas, spills, handoffs and offers
+    long replication_bytes;
+    // replicas this node repaired as the root, the bytes sent for them, and how long
+    // after the leaf set change they were repaired
+    int repaired_file_count;
+    long repair_bytes;
+    int repair_delays[repair_delay_buckets];
 };
 
 /**
  * This message is used for difference steps of reclaiming a file based on the type given.
+ * It is also used for the SPILL_FAIL and SPILL_RELEASE steps of spilling a file,
+ * and for the HANDOFF_CONFIRM and HANDOFF_FAIL steps of leaving, HOT_RELEASE, KEY_ADDED,
+ * LEASE_CHECK, LEASE_INVALIDATE, LEASE_INVALIDATE_CONFIRM, LOCATE_RES of sending a
+ * payload directly, and REPLICATE_PULL and HANDOFF_PULL.
  */
 struct FileMessage {
     int type;
@@ -111,5 +373,176 @@ char* MakeDataMessage(fileID fid, void* contents, int len, int type);
 int ParseDataMessageHeader(const void* msg, int len, fileID* fid);
 int ParseDataMessageContent(const void* msg, int len, char* buf, int buf_len);
 
+/**
+ * Write message format:
+ * int type
+ * fileID fid
+ * int offset  (APPEND_OFFSET to append)
+ * char[len]
+ *
+ * @param  fid      fileID
+ * @param  offset   where to write the contents in the file
+ * @param  contents new content of that part of the file
+ * @param  len      length of the content
+ * @return          allocated Write message
+ */
+char* MakeWriteMessage(fileID fid, int offset, const void* contents, int len, int type);
+/**
+ * A CHUNK_INSERT message has the same format, with the fileID of the stream
+ * and the index of the chunk as offset. A HOT_REPLICATE message too, with the
+ * version of the file at its root as offset.
+ */
+int ParseWriteMessageHeader(const void* msg, int len, fileID* fid, int* offset);
+
+/**
+ * Path cache message format:
+ * int type
+ * fileID fid
+ * int version
+ * int ttl
+ * char[len]
+ *
+ * @param  fid      fileID
+ * @param  version  version stamp of the file at its root
+ * @param  ttl      milliseconds the copy may be used before it is checked with the root
+ * @param  contents content of the file
+ * @param  len      length of the content
+ * @return          allocated Path cache message
+ */
+char* MakePathCacheMessage(fileID fid, int version, int ttl, const void* contents, int len);
+int ParsePathCacheHeader(const void* msg, int len, fileID* fid, int* version, int* ttl);
+
+/**
+ * Hash of the content of a file or message, FNV-1a
+ * @param  data content
+ * @param  len  length of the content
+ * @return      64 bit hash
+ */
+unsigned long long ContentHash(const void* data, int len);
+
+/**
+ * Bucket of the repair delay histogram of NodeStats
+ * @param  delay delay in milliseconds
+ * @return       index of the bucket
+ */
+int RepairDelayBucket(long delay);
+
+/**
+ * Mix the bits of a 16 bit value. The mix is a bijection, so different
+ * values never collide.
+ */
+unsigned short Mix16(unsigned short x);
+
+/**
+ * The fileID a chunk of a stream is stored under, in the chunk range. Chunks of
+ * the same stream never share a fileID with each other while the stream has at
+ * most chunk_fid_count chunks, and never share one with a plain file.
+ * @param  fid   fileID of the stream
+ * @param  index index of the chunk
+ * @return       fileID of the chunk
+ */
+fileID ChunkFileID(fileID fid, int index);
+
+/**
+ * Whether a fileID is in the range reserved for the chunks of streams
+ */
+bool IsChunkFileID(fileID fid);
+
+/**
+ * Chunk header format:
+ * fileID stream
+ * int index
+ * Write the header of a chunk in front of its content.
+ * @param buf    buffer of at least chunk_header_size bytes
+ * @param stream fileID of the stream
+ * @param index  index of the chunk in the stream
+ */
+void MakeChunkHeader(char* buf, fileID stream, int index);
+
+/**
+ * Whether a stored chunk belongs to the given stream at the given index
+ * @param  chunk  content of the stored chunk, starting with its header
+ * @param  len    length of the stored chunk
+ * @param  stream fileID of the stream
+ * @param  index  index of the chunk in the stream
+ * @return        true if the header names stream and index
+ */
+bool IsChunkOf(const char* chunk, int len, fileID stream, int index);
+
+/**
+ * Scan batch message format:
+ * int type
+ * int sequence
+ * int count
+ * int last
+ * count entries of:
+ *     fileID fid
+ *     int len     (negative if the content is not part of the batch)
+ *     char[len]
+ *
+ * @param  batch    buffer of at least scan_batch_max_size bytes
+ * @param  offset   where to append the entry, scan_batch_header_size for the first one
+ * @param  fid      fileID
+ * @param  contents content of the file
+ * @param  len      length of the content, negative to leave the content out
+ * @return          offset after the entry
+ */
+int AppendScanEntry(char* batch, int offset, fileID fid, const char* contents, int len);
+void MakeScanBatchHeader(char* batch, int sequence, int count, int last);
+int ParseScanBatchHeader(const void* msg, int* sequence, int* count, int* last);
+/**
+ * @param  msg_len  length of the batch
+ * @return          offset after the entry, -1 if the entry runs past msg_len
+ */
+int ParseScanEntry(const void* msg, int msg_len, int offset, fileID* fid, const char** contents, int* len);
+
+/**
+ * Chain replicate message format:
+ * int type
+ * fileID fid
+ * int root                    (pid to confirm to)
+ * int position                (index of the receiver in chain)
+ * int length                  (number of pids in chain)
+ * int chain[P2P_LEAF_SIZE]
+ * char[] content
+ *
+ * @param  fid      fileID
+ * @param  root     pid of the root of the file
+ * @param  chain    pids the copy passes through, in order
+ * @param  length   number of pids in chain, at most P2P_LEAF_SIZE
+ * @param  contents content of the file
+ * @param  len      length of the content
+ * @return          message of chain_message_header_size + len bytes allocated with new[]
+ */
+char* MakeChainMessage(fileID fid, int root, const int* chain, int length, const void* contents, int len);
+int ParseChainMessageHeader(const void* msg, fileID* fid, int* root, int* position, int* length, int* chain);
+void SetChainPosition(char* msg, int position);
+
+/**
+ * Envelope message format, several small messages to the same pid:
+ * int type
+ * int count
+ * count entries of:
+ *     int src     (original source of the message)
+ *     int len
+ *     char[len]
+ * Entries aren't padded, so the message of an entry isn't aligned in the envelope.
+ *
+ * @param  envelope buffer with room for the entry
+ * @param  offset   where to append the entry, envelope_header_size for the first one
+ * @param  src      original source of the message
+ * @param  msg      the message
+ * @param  len      length of the message
+ * @return          offset after the entry
+ */
+int AppendEnvelopeEntry(char* envelope, int offset, int src, const void* msg, int len);
+void MakeEnvelopeHeader(char* envelope, int count);
+int ParseEnvelopeHeader(const void* msg);
+/**
+ * @param  msg_len  length of the envelope
+ * @return          offset of the message of the entry, -1 if the entry runs past msg_len
+ */
+int ParseEnvelopeEntry(const void* msg, int msg_len, int offset, int* src, int* len);
+
 #endif
 
@@ -0,0 +1,152 @@
+#include "nearest.h"
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+static_assert(sizeof(nodeID) == 2, "the vector search works on 16 bit nodeIDs");
+
+void CandidateSet::Clear() {
+    ids.clear();
+    pids.clear();
+}
+
+void CandidateSet::Add(nodeID id, int pid) {
+    ids.push_back(id);
+    pids.push_back(pid);
+}
+
+int CandidateSet::Size() const {
+    return ids.size();
+}
+
+unsigned short RingDistance(nodeID x, nodeID y) {
+    // the ring has 2^16 nodeIDs, so the subtraction wraps around it
+    unsigned short forward = x - y;
+    unsigned short backward = y - x;
+    return forward < backward ? forward : backward;
+}
+
+int NearestCandidateScalar(const nodeID* ids, int count, nodeID key) {
+    int index = -1;
+    unsigned short min_distance = 0;
+    for (int i = 0; i < count; i++) {
+        unsigned short distance = RingDistance(ids[i], key);
+        if (index < 0 || distance < min_distance) {
+            min_distance = distance;
+            index = i;
+        }
+    }
+    return index;
+}
+
+#if defined(__AVX2__) || defined(__SSE2__)
+
+#if defined(__AVX2__)
+typedef __m256i Vector;
+const int lanes = 16;
+
+static inline Vector Load(const nodeID* ids) {
+    return _mm256_loadu_si256((const __m256i*) ids);
+}
+
+static inline Vector Broadcast(unsigned short x) {
+    return _mm256_set1_epi16(x);
+}
+
+static inline Vector Min(Vector a, Vector b) {
+    return _mm256_min_epu16(a, b);
+}
+
+static inline Vector Distances(Vector ids, Vector key) {
+    Vector forward = _mm256_sub_epi16(ids, key);
+    Vector backward = _mm256_sub_epi16(key, ids);
+    return Min(forward, backward);
+}
+
+static inline unsigned int EqualMask(Vector a, Vector b) {
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi16(a, b));
+}
+#else
+typedef __m128i Vector;
+const int lanes = 8;
+
+static inline Vector Load(const nodeID* ids) {
+    return _mm_loadu_si128((const __m128i*) ids);
+}
+
+static inline Vector Broadcast(unsigned short x) {
+    return _mm_set1_epi16(x);
+}
+
+static inline Vector Min(Vector a, Vector b) {
+    // SSE2 only has a signed 16 bit min, flip the sign bits around it
+    const Vector bias = _mm_set1_epi16((short) 0x8000);
+    return _mm_xor_si128(_mm_min_epi16(_mm_xor_si128(a, bias), _mm_xor_si128(b, bias)), bias);
+}
+
+static inline Vector Distances(Vector ids, Vector key) {
+    Vector forward = _mm_sub_epi16(ids, key);
+    Vector backward = _mm_sub_epi16(key, ids);
+    return Min(forward, backward);
+}
+
+static inline unsigned int EqualMask(Vector a, Vector b) {
+    return _mm_movemask_epi8(_mm_cmpeq_epi16(a, b));
+}
+#endif
+
+int NearestCandidate(const nodeID* ids, int count, nodeID key) {
+    if (count < lanes) {
+        return NearestCandidateScalar(ids, count, key);
+    }
+    Vector keys = Broadcast(key);
+
+    // first pass, the smallest distance
+    Vector best = Broadcast(0xffff);
+    int i = 0;
+    for (; i + lanes <= count; i += lanes) {
+        best = Min(best, Distances(Load(ids + i), keys));
+    }
+    unsigned short lane_best[lanes];
+    std::memcpy(lane_best, &best, sizeof(Vector));
+    unsigned short min_distance = 0xffff;
+    for (int j = 0; j < lanes; j++) {
+        if (lane_best[j] < min_distance) {
+            min_distance = lane_best[j];
+        }
+    }
+    for (; i < count; i++) {
+        unsigned short distance = RingDistance(ids[i], key);
+        if (distance < min_distance) {
+            min_distance = distance;
+        }
+    }
+
+    // second pass, the first candidate at that distance
+    Vector target = Broadcast(min_distance);
+    for (i = 0; i + lanes <= count; i += lanes) {
+        unsigned int mask = EqualMask(Distances(Load(ids + i), keys), target);
+        if (mask != 0) {
+            // two mask bits per 16 bit lane
+            return i + __builtin_ctz(mask) / 2;
+        }
+    }
+    for (; i < count; i++) {
+        if (RingDistance(ids[i], key) == min_distance) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+#else
+
+int NearestCandidate(const nodeID* ids, int count, nodeID key) {
+    return NearestCandidateScalar(ids, count, key);
+}
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef NEAREST_H
+#define NEAREST_H
+
+#include <rednet-p2p.h>
+#include <vector>
+
+/**
+ * Candidates for the next hop of a message, stored as a structure of arrays so
+ * that the nodeIDs are contiguous and can be searched with NearestCandidate().
+ */
+struct CandidateSet {
+    std::vector<nodeID> ids;
+    std::vector<int> pids;
+    void Clear();
+    void Add(nodeID id, int pid);
+    int Size() const;
+};
+
+/**
+ * The numeric distance between x and y on the ring
+ * @param  x node id of first node
+ * @param  y node id of second node
+ * @return   absolute distance between x and y
+ */
+unsigned short RingDistance(nodeID x, nodeID y);
+
+/**
+ * Find the candidate that is numerically closest to key. Ties go to the candidate
+ * with the smaller index. Uses AVX2 or SSE2 when the compiler targets them.
+ * @param  ids   nodeIDs of the candidates
+ * @param  count number of candidates
+ * @param  key   node id to search for
+ * @return       index of the closest candidate, -1 if there is none
+ */
+int NearestCandidate(const nodeID* ids, int count, nodeID key);
+
+/**
+ * Same as NearestCandidate(), one candidate at a time
+ */
+int NearestCandidateScalar(const nodeID* ids, int count, nodeID key);
+
+#endif
@@ -1,8 +1,125 @@
 #include <rednet.h>
 #include <rednet-p2p.h>
 #include <iostream>
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+#include <list>
+#include <vector>
 
-#include "message.h"
+#include "overlay.h"
+
+struct CachedFile {
+    fileID fid;
+    std::vector<char> contents;
+};
+
+// most recently used file first
+static std::list<CachedFile> lookup_cache;
+static std::unordered_map<fileID, std::list<CachedFile>::iterator> lookup_cache_index;
+static int lookup_cache_capacity = 0;
+
+/**
+ * Keep up to capacity recently looked up files in this process.
+ * @param capacity number of files to keep
+ */
+void EnableLookupCache(int capacity) {
+    lookup_cache_capacity = std::max(capacity, 0);
+    while ((int) lookup_cache.size() > lookup_cache_capacity) {
+        lookup_cache_index.erase(lookup_cache.back().fid);
+        lookup_cache.pop_back();
+    }
+}
+
+/**
+ * Drop the cached copy of a file
+ * @param fid fileID
+ */
+static void DropCachedFile(fileID fid) {
+    auto it = lookup_cache_index.find(fid);
+    if (it != lookup_cache_index.end()) {
+        lookup_cache.erase(it->second);
+        lookup_cache_index.erase(it);
+    }
+}
+
+/**
+ * Copy part of a file the way the kernel does
+ * @param  file     content of the whole file
+ * @param  offset   offset of the first byte to copy
+ * @param  contents buffer to hold the file content
+ * @param  len      length of the buffer
+ * @return          number of bytes copied
+ */
+static int CopyRange(const std::vector<char> &file, int offset, void* contents, int len) {
+    offset = std::min(offset, (int) file.size());
+    int copied = std::min(len, (int) file.size() - offset);
+    std::memcpy(contents, file.data() + offset, copied);
+    return copied;
+}
+
+/**
+ * Copy part of a cached file if the lease on it is still valid
+ * @param  fid      fileID
+ * @param  offset   offset of the first byte to copy
+ * @param  contents buffer to hold the file content
+ * @param  len      length of the buffer
+ * @return          number of bytes copied, negative if the file isn't cached
+ */
+static int LookupCachedFile(fileID fid, int offset, void* contents, int len) {
+    auto it = lookup_cache_index.find(fid);
+    if (it == lookup_cache_index.end()) {
+        return -1;
+    }
+    // ask the local kernel whether the root invalidated the lease
+    int src = 0;
+    int status = 0;
+    FileMessage message(LEASE_CHECK, fid);
+    SendMessage(0, &message, sizeof(FileMessage));
+    if (ReceiveMessage(&src, &status, sizeof(int)) < 0 || status < 0) {
+        DropCachedFile(fid);
+        return -1;
+    }
+    lookup_cache.splice(lookup_cache.begin(), lookup_cache, it->second);
+    TracePrintf(10, "Found file %hu in the look up cache\n", fid);
+    return CopyRange(it->second->contents, offset, contents, len);
+}
+
+/**
+ * Look up a whole file with a lease, cache it and copy part of it
+ * @param  fid      fileID
+ * @param  offset   offset of the first byte to copy
+ * @param  contents buffer to hold the file content
+ * @param  len      length of the buffer
+ * @return          number of bytes copied, negative if the lookup failed
+ */
+static int CacheFile(fileID fid, int offset, void* contents, int len) {
+    int src = 0;
+    int status = 0;
+    std::vector<char> file(P2P_FILE_MAXSIZE);
+    LookupMessage message(fid, 0, P2P_FILE_MAXSIZE);
+    message.lease = 1;
+    SendMessage(0, &message, sizeof(LookupMessage));
+
+    if (ReceiveMessage(&src, &status, sizeof(int)) < 0) {
+        std::cerr << "Fail to receive confirmation message for lookup" << std::endl;
+    }
+    if (status < 0) {
+        return status;
+    }
+    if (ReceiveMessage(&src, file.data(), P2P_FILE_MAXSIZE) < 0) {
+        std::cerr << "Fail to receive reply message for lookup" << std::endl;
+    }
+    file.resize(status);
+    DropCachedFile(fid);
+    lookup_cache.push_front({fid, file});
+    lookup_cache_index[fid] = lookup_cache.begin();
+    if ((int) lookup_cache.size() > lookup_cache_capacity) {
+        lookup_cache_index.erase(lookup_cache.back().fid);
+        lookup_cache.pop_back();
+    }
+    return CopyRange(file, offset, contents, len);
+}
 
 /**
  * Join the p2p storage system.
@@ -13,9 +130,8 @@ int Join(nodeID id) {
     TracePrintf(10, "Forward join request from nodeID %hu\n", id);
     int status = 0;
     int src = 0;
-    JoinMessage* message = new JoinMessage(id);
-    SendMessage(0, message, sizeof(message));
-    delete message;
+    JoinMessage message(id);
+    SendMessage(0, &message, sizeof(JoinMessage));
 
     if (ReceiveMessage(&src, &status, sizeof(int)) < 0) {
         std::cerr << "Fail to receive confirmation message for join" << std::endl;
@@ -37,6 +153,7 @@ int Insert(fileID fid, void* contents, int len) {
         std::cerr << "File too large!" << std::endl;
         return -1;
     }
+    DropCachedFile(fid);
     int status = 0;
     int src = 0;
     char* message = MakeDataMessage(fid, contents, len, INSERT);
@@ -58,6 +175,18 @@ int Insert(fileID fid, void* contents, int len) {
  * @return          status of the lookup
  */
 int Lookup(fileID fid, void* contents, int len) {
+    return LookupRange(fid, 0, contents, len);
+}
+
+/**
+ * Retrieve a copy of part of a file
+ * @param  fid      fileID
+ * @param  offset   offset of the first byte to retrieve
+ * @param  contents buffer to hold the file content
+ * @param  len      length of the buffer
+ * @return          status of the lookup, number of bytes retrieved on success
+ */
+int LookupRange(fileID fid, int offset, void* contents, int len) {
     TracePrintf(10, "Forward lookup request\n");
     int src = 0;
     int status = 0;
@@ -65,9 +194,16 @@ int Lookup(fileID fid, void* contents, int len) {
     if (len == 0) {
         return 0;
     }
-    LookupMessage* message = new LookupMessage(fid, len);
-    SendMessage(0, message, sizeof(LookupMessage));
-    delete message;
+    if (lookup_cache_capacity > 0 && offset >= 0) {
+        status = LookupCachedFile(fid, offset, contents, len);
+        if (status < 0) {
+            status = CacheFile(fid, offset, contents, len);
+        }
+        TracePrintf(10, "Done looking up file %hu\n", fid);
+        return status;
+    }
+    LookupMessage message(fid, offset, len);
+    SendMessage(0, &message, sizeof(LookupMessage));
 
     // receive status first
     if (ReceiveMessage(&src, &status, sizeof(int)) < 0) {
@@ -86,6 +222,61 @@ int Lookup(fileID fid, void* contents, int len) {
     return status;
 }
 
+/**
+ * Send a write request to the local kernel and wait for its confirmation
+ * @param  fid      fileID
+ * @param  offset   where to write the content, APPEND_OFFSET to append
+ * @param  contents new content
+ * @param  len      length of the content
+ * @return          status of the write
+ */
+static int Write(fileID fid, int offset, void* contents, int len) {
+    if (len > P2P_FILE_MAXSIZE) {
+        std::cerr << "Write too large!" << std::endl;
+        return -1;
+    }
+    DropCachedFile(fid);
+    int status = 0;
+    int src = 0;
+    char* message = MakeWriteMessage(fid, offset, contents, len, WRITE);
+    SendMessage(0, message, write_message_header_size + len * sizeof(char));
+    delete[] message;
+
+    if (ReceiveMessage(&src, &status, sizeof(int)) < 0) {
+        std::cerr << "Fail to receive confirmation message for write" << std::endl;
+    }
+    TracePrintf(10, "Done writing file %hu\n", fid);
+    return status;
+}
+
+/**
+ * Overwrite part of a stored file. Only the new bytes are sent through the network.
+ * @param  fid      fileID
+ * @param  offset   where to write the content, at most the length of the file
+ * @param  contents new content
+ * @param  len      length of the content
+ * @return          status of the update
+ */
+int Update(fileID fid, int offset, void* contents, int len) {
+    TracePrintf(10, "Forward update request\n");
+    if (offset < 0) {
+        return -1;
+    }
+    return Write(fid, offset, contents, len);
+}
+
+/**
+ * Append to a stored file. Only the new bytes are sent through the network.
+ * @param  fid      fileID
+ * @param  contents content to append
+ * @param  len      length of the content
+ * @return          status of the append
+ */
+int Append(fileID fid, void* contents, int len) {
+    TracePrintf(10, "Forward append request\n");
+    return Write(fid, APPEND_OFFSET, contents, len);
+}
+
 /**
  * Remove a file
  * @param  fid fileID
@@ -93,15 +284,258 @@ int Lookup(fileID fid, void* contents, int len) {
  */
 int Reclaim(fileID fid) {
     TracePrintf(10, "Forward reclaim request\n");
+    DropCachedFile(fid);
     int status = 0;
     int src = 0;
-    FileMessage* message = new FileMessage(RECLAIM, fid);
-    SendMessage(0, message, sizeof(FileMessage));
-    delete message;
+    FileMessage message(RECLAIM, fid);
+    SendMessage(0, &message, sizeof(FileMessage));
 
     if (ReceiveMessage(&src, &status, sizeof(int)) < 0) {
         std::cerr << "Fail to receive confirmation message for reclaim" << std::endl;
     }
     TracePrintf(10, "Done reclaiming file %hu\n", fid);
     return status;
-}
\ No newline at end of file
+}
+
+/**
+ * Leave the p2p storage system.
+ * @return status of the leave
+ */
+int Leave() {
+    TracePrintf(10, "Forward leave request\n");
+    int status = 0;
+    int src = 0;
+    Message message(LEAVE);
+    SendMessage(0, &message, sizeof(Message));
+
+    if (ReceiveMessage(&src, &status, sizeof(int)) < 0) {
+        std::cerr << "Fail to receive confirmation message for leave" << std::endl;
+    }
+    TracePrintf(10, "Done leaving\n");
+    return status;
+}
+
+/**
+ * Get statistics of the local node
+ * @param  stats buffer to hold the statistics
+ * @return       status of the request
+ */
+int GetStats(NodeStats* stats) {
+    int src = 0;
+    Message message(STATS);
+    SendMessage(0, &message, sizeof(Message));
+
+    if (ReceiveMessage(&src, stats, sizeof(NodeStats)) < 0) {
+        std::cerr << "Fail to receive stats" << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Enumerate the files with fileID in [lo, hi].
+ * @param  lo       smallest fileID to scan
+ * @param  hi       largest fileID to scan
+ * @param  callback called for every file found
+ * @return          number of files found, negative if the scan failed
+ */
+int Scan(fileID lo, fileID hi, ScanCallback callback) {
+    TracePrintf(10, "Forward scan request\n");
+    int src = 0;
+    int total = 0;
+    int last = 0;
+    ScanMessage message(lo, hi);
+    SendMessage(0, &message, sizeof(ScanMessage));
+
+    char* batch = new char[scan_batch_max_size];
+    char* file = new char[P2P_FILE_MAXSIZE];
+    while (!last) {
+        // ask for batches one at a time so that look ups of spilled files
+        // don't receive a batch instead of their reply
+        Message next(SCAN_NEXT);
+        SendMessage(0, &next, sizeof(Message));
+        int batch_len = ReceiveMessage(&src, batch, scan_batch_max_size);
+        if (batch_len < scan_batch_header_size) {
+            std::cerr << "Fail to receive scan batch" << std::endl;
+            total = -1;
+            break;
+        }
+        int sequence, count;
+        int offset = ParseScanBatchHeader(batch, &sequence, &count, &last);
+        for (int i = 0; i < count; i++) {
+            fileID fid;
+            const char* contents;
+            int len;
+            offset = ParseScanEntry(batch, batch_len, offset, &fid, &contents, &len);
+            if (offset < 0) {
+                std::cerr << "Scan batch " << sequence << " is truncated" << std::endl;
+                break;
+            }
+            if (len < 0) {
+                // the file was spilled to another node, fetch it separately
+                len = Lookup(fid, file, P2P_FILE_MAXSIZE);
+                if (len < 0) {
+                    continue;
+                }
+                contents = file;
+            }
+            callback(fid, contents, len);
+            total++;
+        }
+    }
+    delete[] batch;
+    delete[] file;
+    TracePrintf(10, "Done scanning %d files\n", total);
+    return total;
+}
+
+/**
+ * Store a file of any size as a stream of chunks.
+ * @param  fid      fileID
+ * @param  contents content of the file
+ * @param  len      length of the content
+ * @return          status of the insert
+ */
+int InsertStream(fileID fid, void* contents, int len) {
+    TracePrintf(10, "Forward stream insert request\n");
+    int src = 0;
+    int chunk_count = (len + stream_chunk_size - 1) / stream_chunk_size;
+    if (IsChunkFileID(fid) || chunk_count > chunk_fid_count) {
+        TracePrintf(10, "Refuse stream %hu of %d chunks\n", fid, chunk_count);
+        return -1;
+    }
+    int sent = 0;
+    int confirmed = 0;
+    int failed = 0;
+    while (confirmed < chunk_count) {
+        // keep at most stream_window chunks in flight
+        while (sent < chunk_count && sent - confirmed < stream_window) {
+            int offset = sent * stream_chunk_size;
+            int chunk_len = std::min(stream_chunk_size, len - offset);
+            char* message = MakeWriteMessage(fid, sent, (char*) contents + offset, chunk_len,
+                                             CHUNK_INSERT);
+            SendMessage(0, message, write_message_header_size + chunk_len * sizeof(char));
+            delete[] message;
+            sent++;
+        }
+        int status = 0;
+        if (ReceiveMessage(&src, &status, sizeof(int)) < 0) {
+            std::cerr << "Fail to receive confirmation message for stream insert" << std::endl;
+            status = -1;
+        }
+        if (status < 0) {
+            failed++;
+        }
+        confirmed++;
+    }
+    if (failed > 0) {
+        TracePrintf(10, "Failed inserting %d chunks of stream %hu\n", failed, fid);
+        return -1;
+    }
+
+    // the manifest is only stored once all chunks are in place
+    StreamManifest manifest = {STREAM_MAGIC, len, stream_chunk_size, chunk_count};
+    int status = Insert(fid, &manifest, sizeof(StreamManifest));
+    TracePrintf(10, "Done inserting stream %hu of %d chunks\n", fid, chunk_count);
+    return status;
+}
+
+/**
+ * Retrieve a copy of a file stored with InsertStream(). Chunks are fetched in parallel.
+ * @param  fid      fileID
+ * @param  contents buffer to hold the file content
+ * @param  len      length of the buffer
+ * @return          number of bytes retrieved, negative if the lookup failed
+ */
+int LookupStream(fileID fid, void* contents, int len) {
+    TracePrintf(10, "Forward stream lookup request\n");
+    int src = 0;
+    StreamManifest manifest;
+    if (Lookup(fid, &manifest, sizeof(StreamManifest)) != sizeof(StreamManifest)
+            || manifest.magic != STREAM_MAGIC) {
+        TracePrintf(10, "Failed looking up manifest of stream %hu\n", fid);
+        return -1;
+    }
+    if (manifest.chunk_size <= 0 || manifest.chunk_size > stream_chunk_size || manifest.length < 0) {
+        TracePrintf(10, "Bad manifest of stream %hu\n", fid);
+        return -1;
+    }
+    int total = std::min(len, manifest.length);
+    int chunk_count = (total + manifest.chunk_size - 1) / manifest.chunk_size;
+    int chunk_len = chunk_header_size + manifest.chunk_size;
+    int reply_len = data_message_header_size + chunk_len;
+    char* reply = new char[reply_len];
+    std::unordered_map<fileID, int> chunk_index;
+    int requested = 0;
+    int received = 0;
+    int failed = 0;
+    while (received < chunk_count) {
+        // keep at most stream_window look ups in flight
+        while (requested < chunk_count && requested - received < stream_window) {
+            fileID chunk = ChunkFileID(fid, requested);
+            chunk_index[chunk] = requested;
+            LookupMessage message(chunk, 0, chunk_len, 1);
+            SendMessage(0, &message, sizeof(LookupMessage));
+            requested++;
+        }
+        received++;
+        if (ReceiveMessage(&src, reply, reply_len) < 0) {
+            std::cerr << "Fail to receive reply message for stream lookup" << std::endl;
+            failed++;
+            continue;
+        }
+        // tagged reply: status, fileID, content
+        int status = 0;
+        fileID chunk = 0;
+        std::memcpy(&status, reply, sizeof(int));
+        ParseDataMessageHeader(reply, reply_len, &chunk);
+        const char* content = reply + data_message_header_size;
+        if (status < 0 || chunk_index.find(chunk) == chunk_index.end()
+                || !IsChunkOf(content, status, fid, chunk_index[chunk])) {
+            // missing, or the slot holds a chunk of another stream
+            failed++;
+            continue;
+        }
+        int offset = chunk_index[chunk] * manifest.chunk_size;
+        int copy_len = std::min(status - chunk_header_size, total - offset);
+        std::memcpy((char*) contents + offset, content + chunk_header_size, copy_len);
+    }
+    delete[] reply;
+    if (failed > 0) {
+        TracePrintf(10, "Failed looking up %d chunks of stream %hu\n", failed, fid);
+        return -1;
+    }
+    TracePrintf(10, "Done looking up stream %hu\n", fid);
+    return total;
+}
+
+/**
+ * Remove a file stored with InsertStream(). A chunk is only reclaimed after
+ * its header shows it still belongs to the stream.
+ * @param  fid fileID
+ * @return     status of reclaim
+ */
+int ReclaimStream(fileID fid) {
+    TracePrintf(10, "Forward stream reclaim request\n");
+    StreamManifest manifest;
+    if (Lookup(fid, &manifest, sizeof(StreamManifest)) != sizeof(StreamManifest)
+            || manifest.magic != STREAM_MAGIC
+            || manifest.chunk_count < 0 || manifest.chunk_count > chunk_fid_count) {
+        return -1;
+    }
+    int status = Reclaim(fid);
+    for (int i = 0; i < manifest.chunk_count; i++) {
+        fileID chunk = ChunkFileID(fid, i);
+        char header[chunk_header_size];
+        int header_len = LookupRange(chunk, 0, header, chunk_header_size);
+        if (header_len < 0 || !IsChunkOf(header, header_len, fid, i)) {
+            TracePrintf(10, "Leave chunk %d of stream %hu, file %hu isn't ours\n", i, fid, chunk);
+            status = -1;
+            continue;
+        }
+        if (Reclaim(chunk) < 0) {
+            status = -1;
+        }
+    }
+    return status;
+}
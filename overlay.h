@@ -0,0 +1,124 @@
+#ifndef OVERLAY_H
+#define OVERLAY_H
+
+#include <rednet-p2p.h>
+
+#include "message.h"
+
+/**
+ * Extensions to the overlay network interface declared in rednet-p2p.h.
+ *
+ * The fileIDs from chunk_fid_base to chunk_fid_base + chunk_fid_count - 1
+ * (0xb000 to 0xbfff) hold the chunks of streams. Insert() and the writes below
+ * fail for a fileID in that range, and the range can only be stored with
+ * InsertStream().
+ */
+
+/**
+ * Keep up to capacity recently looked up files in this process. Cached files are
+ * looked up with a lease from their root, which tells the local kernel when the file
+ * changes, so a repeated look up is answered without going through the network.
+ * Disabled with capacity 0, the default.
+ * @param capacity number of files to keep
+ */
+void EnableLookupCache(int capacity);
+
+/**
+ * Retrieve a copy of part of a file
+ * @param  fid      fileID
+ * @param  offset   offset of the first byte to retrieve
+ * @param  contents buffer to hold the file content
+ * @param  len      length of the buffer
+ * @return          number of bytes retrieved, negative if the lookup failed
+ */
+int LookupRange(fileID fid, int offset, void* contents, int len);
+
+/**
+ * Overwrite part of a stored file, growing it if the new content goes past its end.
+ * Only the new bytes are sent to the root and its replicas.
+ * @param  fid      fileID
+ * @param  offset   where to write the content, at most the length of the file
+ * @param  contents new content
+ * @param  len      length of the content
+ * @return          0 on success, negative if the file doesn't exist, doesn't fit or
+ *                  fid is in the chunk range
+ */
+int Update(fileID fid, int offset, void* contents, int len);
+
+/**
+ * Append to a stored file. Only the new bytes are sent to the root and its replicas.
+ * @param  fid      fileID
+ * @param  contents content to append
+ * @param  len      length of the content
+ * @return          0 on success, negative if the file doesn't exist, doesn't fit or
+ *                  fid is in the chunk range
+ */
+int Append(fileID fid, void* contents, int len);
+
+/**
+ * Store a file of any size. The file is split into chunks of stream_chunk_size bytes,
+ * each stored under its own fileID derived with ChunkFileID(), and a manifest is
+ * stored under fid once every chunk is confirmed. At most stream_window chunks are
+ * in flight at a time. fid can't be in the chunk range, and a stream has at most
+ * chunk_fid_count chunks. The insert fails if a chunk slot holds a chunk of
+ * another stream.
+ * @param  fid      fileID
+ * @param  contents content of the file
+ * @param  len      length of the content
+ * @return          0 on success, negative if any chunk failed
+ */
+int InsertStream(fileID fid, void* contents, int len);
+
+/**
+ * Retrieve a copy of a file stored with InsertStream(). Up to stream_window
+ * chunks are looked up in parallel.
+ * @param  fid      fileID
+ * @param  contents buffer to hold the file content
+ * @param  len      length of the buffer
+ * @return          number of bytes retrieved, negative if the lookup failed, the
+ *                  manifest is malformed or a chunk belongs to another stream
+ */
+int LookupStream(fileID fid, void* contents, int len);
+
+/**
+ * Remove a file stored with InsertStream(), including all of its chunks. A chunk
+ * slot that holds a chunk of another stream is left alone.
+ * @param  fid fileID
+ * @return     0 on success, negative if the manifest or any chunk is missing
+ */
+int ReclaimStream(fileID fid);
+
+/**
+ * Leave the p2p storage system. Every file this node is the root of is handed off
+ * to the node that becomes its root, then the leaf set members are told to drop
+ * this node. Returns once the handoffs are confirmed.
+ * @return 0 on success, negative if the node hasn't joined or a file couldn't be handed off
+ */
+int Leave();
+
+/**
+ * Get statistics of the local node
+ * @param  stats buffer to hold the statistics
+ * @return       status of the request
+ */
+int GetStats(NodeStats* stats);
+
+/**
+ * Callback receiving the files found by Scan()
+ * @param fid      fileID
+ * @param contents content of the file
+ * @param len      length of the content
+ */
+typedef void (*ScanCallback)(fileID fid, const void* contents, int len);
+
+/**
+ * Enumerate the files with fileID in [lo, hi]. Files are passed to the callback
+ * in fileID order, batch by batch as they arrive.
+ * @param  lo       smallest fileID to scan
+ * @param  hi       largest fileID to scan
+ * @param  callback called for every file found
+ * @return          number of files found, negative if the scan failed
+ */
+int Scan(fileID lo, fileID hi, ScanCallback callback);
+
+#endif
@@ -0,0 +1,126 @@
+/**
+ * Replays a message log recorded by a kernel with record_messages set. Every
+ * recorded call of HandleMessage is fed to the kernel again, with NowMillis()
+ * returning the recorded time, so the kernel goes through the same routing and
+ * leaf set changes as the recorded one without RedNet. Instead of being sent,
+ * the messages the kernel transmits and delivers are counted by type and hashed
+ * into a digest. Two builds of the kernel that replay the same log with the same
+ * digest behaved the same, which makes the digest usable to bisect a regression.
+ *
+ * Build with "make -f Makefile.sys replay", which links kernel.o without the
+ * RedNet library.
+ *
+ * Run as: ./replay kernel-trace.<pid> [trace_level]
+ * With trace_level 10 the TracePrintf output of the kernel is shown, including
+ * its leaf set on every exchange.
+ */
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <vector>
+
+#include <rednet.h>
+
+#include "message.h"
+#include "trace.h"
+
+int replay_pid = 0;
+int trace_level = 0;
+unsigned long long digest = 14695981039346656037ULL;
+// message type to number of messages and bytes sent
+std::map<int, std::pair<long, long>> transmitted;
+long delivered = 0;
+
+void Digest(int kind, int src, int dest, const void *msg, int len) {
+    unsigned long long fields[] = {
+        (unsigned long long) kind, (unsigned long long) src, (unsigned long long) dest,
+        (unsigned long long) len, ContentHash(msg, len),
+    };
+    for (unsigned long long field : fields) {
+        digest = (digest ^ field) * 1099511628211ULL;
+    }
+}
+
+int GetPid(void) {
+    return replay_pid;
+}
+
+int TransmitMessage(int src, int dest, const void *msg, int len) {
+    int type = len >= (int) sizeof(int) ? ((const Message*) msg)->type : -1;
+    transmitted[type].first++;
+    transmitted[type].second += len;
+    Digest(0, src, dest, msg, len);
+    return 0;
+}
+
+int DeliverMessage(int src, int dest, const void *msg, int len) {
+    delivered++;
+    Digest(1, src, dest, msg, len);
+    return 0;
+}
+
+void TracePrintf(int level, const char *fmt, ...) {
+    if (level > trace_level) {
+        return;
+    }
+    va_list args;
+    va_start(args, fmt);
+    std::vfprintf(stderr, fmt, args);
+    va_end(args);
+}
+
+int
+main(int argc, char **argv) {
+    if (argc < 2) {
+        std::fprintf(stderr, "Usage: %s kernel-trace.<pid> [trace_level]\n", argv[0]);
+        return 1;
+    }
+    if (argc > 2) {
+        trace_level = std::atoi(argv[2]);
+    }
+    TraceReader reader;
+    if (!reader.Open(argv[1])) {
+        std::fprintf(stderr, "%s is not a message log\n", argv[1]);
+        return 1;
+    }
+    if (!reader.header.payloads) {
+        std::fprintf(stderr, "%s was recorded without payloads and can't be replayed\n", argv[1]);
+        return 1;
+    }
+    replay_pid = reader.header.pid;
+
+    TraceEvent event;
+    std::vector<char> payload;
+    long events = 0;
+    long corrupt = 0;
+    long long first_time = -1;
+    auto started = std::chrono::steady_clock::now();
+    while (reader.Next(&event, &payload)) {
+        if (ContentHash(payload.data(), event.len) != event.hash) {
+            corrupt++;
+            continue;
+        }
+        if (first_time < 0) {
+            first_time = event.time;
+        }
+        replay_time = event.time;
+        HandleMessage(event.src, event.dest, payload.data(), event.len);
+        events++;
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    long sent = 0;
+    long bytes = 0;
+    for (const auto &it : transmitted) {
+        std::printf("type %2d: %8ld messages %10ld bytes\n", it.first, it.second.first, it.second.second);
+        sent += it.second.first;
+        bytes += it.second.second;
+    }
+    std::printf("replayed %ld events of pid %d covering %lld ms in %.3f s, %ld corrupt\n",
+                events, replay_pid, events > 0 ? replay_time - first_time : 0, elapsed, corrupt);
+    std::printf("transmitted %ld messages, %ld bytes, delivered %ld, digest %016llx\n",
+                sent, bytes, delivered, digest);
+    return 0;
+}
@@ -0,0 +1,466 @@
+/**
+ * Simulates an overlay of many kernels in one process, without RedNet. Every
+ * node runs the real kernel code, with its state kept in a KernelContext that
+ * the worker thread points the kernel at while the node handles a message. The nodes are split into
+ * contiguous blocks of pids, one block per worker thread.
+ *
+ * Messages take link_delay milliseconds to arrive, so nothing a node sends can
+ * affect another node sooner than that. The workers use this as lookahead: they
+ * all handle the events of the next link_delay milliseconds in parallel, then
+ * exchange the messages sent between blocks at a barrier and skip ahead to the
+ * earliest pending event. Events that happen at the same millisecond are
+ * ordered by the node that caused them and its sequence number, so a run gives
+ * the same digest on any number of threads.
+ *
+ * Node 1 joins first, the others join join_spacing milliseconds apart and ring
+ * search through the physical network, a binary tree with node pid / 2 as the
+ * parent of node pid. After all joins and
+ * settle_time, every node inserts one file and looks up the file of a random
+ * node every lookup_interval milliseconds. With a fail percentage, that many
+ * nodes fail at random times while the look ups run.
+ *
+ * Build with "make -f Makefile.sys sim", which links kernel.o without the
+ * RedNet library.
+ *
+ * Run as: ./sim [nodes] [threads] [seconds] [fail_percent]
+ * nodeIDs are 16 bits, so there can be at most 65535 nodes.
+ */
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <rednet.h>
+
+#include "context.h"
+#include "message.h"
+#include "trace.h"
+
+// one way delay of every message, and the lookahead of the workers
+const int link_delay = 5;
+const int alarm_interval = 500;
+// node 1 has to give up its ring search and start the overlay first
+const int join_start = 8000;
+const int join_spacing = 2;
+const int settle_time = 10000;
+const int lookup_interval = 1000;
+const int max_nodes = 65535;
+
+const int EVENT_MESSAGE = 0;
+const int EVENT_ALARM = 1;
+const int EVENT_JOIN = 2;
+const int EVENT_INSERT = 3;
+const int EVENT_LOOKUP = 4;
+const int EVENT_FAIL = 5;
+
+struct Event {
+    long long time;
+    // pid of the node that caused the event and its sequence number there
+    unsigned long long order;
+    int kind;
+    int src;
+    int dest;
+    std::vector<char> msg;
+};
+
+// the heaps keep the earliest event at the front
+bool Later(const Event &a, const Event &b) {
+    return a.time != b.time ? a.time > b.time : a.order > b.order;
+}
+
+struct SimNode {
+    int pid;
+    nodeID id;
+    fileID fid;
+    KernelContext* context;
+    bool up;
+    unsigned int sequence;
+    unsigned int random;
+    // request the user side is waiting for, 0 if none, and since when
+    int waiting;
+    long long waiting_since;
+    bool joined;
+    long events;
+    long transmitted;
+    long bytes;
+    int inserts;
+    int failed_inserts;
+    long lookups;
+    long failed_lookups;
+    long long lookup_millis;
+    unsigned long long digest;
+};
+
+struct Worker {
+    // events of the nodes of this worker
+    std::vector<Event> queue;
+    // events for the nodes of each other worker, sent during the current window
+    std::vector<std::vector<Event>> outboxes;
+    long long next_time;
+};
+
+struct Barrier {
+    std::mutex mutex;
+    std::condition_variable released;
+    int count;
+    int arrived;
+    int generation;
+    void Wait();
+};
+
+void Barrier::Wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    int current = generation;
+    if (++arrived == count) {
+        arrived = 0;
+        generation++;
+        released.notify_all();
+        return;
+    }
+    released.wait(lock, [this, current] { return generation != current; });
+}
+
+int node_count = 1000;
+int worker_count = 1;
+long long end_time = 60000;
+int fail_percent = 0;
+long long insert_start = 0;
+long long lookup_start = 0;
+
+// indexed by pid, entry 0 is unused
+std::vector<SimNode> nodes;
+std::vector<Worker> workers;
+Barrier barrier;
+
+thread_local int current_worker = 0;
+thread_local SimNode* current_node = NULL;
+// node whose context is swapped into the kernel state of this thread
+thread_local SimNode* loaded_node = NULL;
+
+int WorkerOf(int pid) {
+    return (int) ((long long) (pid - 1) * worker_count / node_count);
+}
+
+unsigned int NextRandom(SimNode* node) {
+    // xorshift, seeded per node so that runs don't depend on the threads
+    node->random ^= node->random << 13;
+    node->random ^= node->random >> 17;
+    node->random ^= node->random << 5;
+    return node->random;
+}
+
+void Digest(SimNode* node, int src, int dest, const void *msg, int len) {
+    // messages aren't hashed, the padding of the message structs is whatever was on the stack
+    int type = len >= (int) sizeof(int) ? ((const Message*) msg)->type : -1;
+    unsigned long long fields[] = {
+        (unsigned long long) replay_time, (unsigned long long) src, (unsigned long long) dest,
+        (unsigned long long) len, (unsigned long long) type,
+    };
+    for (unsigned long long field : fields) {
+        node->digest = (node->digest ^ field) * 1099511628211ULL;
+    }
+}
+
+/**
+ * Queue an event
+ * @param cause node that causes the event, its sequence number orders events of the same time
+ * @param time  simulated time of the event
+ * @param kind  EVENT_MESSAGE or one of the events of the user side
+ * @param src   source pid of a message
+ * @param dest  pid of the node the event happens at
+ * @param msg   the message, copied
+ * @param len   length of the message
+ */
+void Schedule(SimNode* cause, long long time, int kind, int src, int dest, const void *msg, int len) {
+    Event event;
+    event.time = time;
+    event.order = ((unsigned long long) cause->pid << 32) | cause->sequence++;
+    event.kind = kind;
+    event.src = src;
+    event.dest = dest;
+    event.msg.assign((const char*) msg, (const char*) msg + len);
+    int worker = WorkerOf(dest);
+    if (worker == current_worker) {
+        std::vector<Event> &queue = workers[worker].queue;
+        queue.push_back(std::move(event));
+        std::push_heap(queue.begin(), queue.end(), Later);
+    } else {
+        workers[current_worker].outboxes[worker].push_back(std::move(event));
+    }
+}
+
+void ScheduleLocal(SimNode* node, long long time, int kind) {
+    if (time < end_time) {
+        Schedule(node, time, kind, node->pid, node->pid, NULL, 0);
+    }
+}
+
+int GetPid(void) {
+    return current_node->pid;
+}
+
+int TransmitMessage(int src, int dest, const void *msg, int len) {
+    SimNode* node = current_node;
+    node->transmitted++;
+    node->bytes += len;
+    Digest(node, src, dest, msg, len);
+    long long arrival = replay_time + link_delay;
+    if (dest == -1) {
+        // the physical network is a binary tree of pids, a broadcast reaches the parent
+        // and the children, which join before and after the node
+        int neighbors[] = {node->pid / 2, node->pid * 2, node->pid * 2 + 1};
+        for (int neighbor : neighbors) {
+            if (neighbor >= 1 && neighbor <= node_count) {
+                Schedule(node, arrival, EVENT_MESSAGE, src, neighbor, msg, len);
+            }
+        }
+        return 0;
+    }
+    if (dest < 1 || dest > node_count) {
+        return -1;
+    }
+    Schedule(node, arrival, EVENT_MESSAGE, src, dest, msg, len);
+    return 0;
+}
+
+int DeliverMessage(int src, int dest, const void *msg, int len) {
+    SimNode* node = current_node;
+    if (node->waiting == 0 || len < (int) sizeof(int)) {
+        // the content of a look up, which follows its status
+        return 0;
+    }
+    int status = 0;
+    std::memcpy(&status, msg, sizeof(int));
+    long long now = replay_time;
+    int request = node->waiting;
+    node->waiting = 0;
+    switch (request) {
+    case EVENT_JOIN:
+        node->joined = status == 0;
+        if (node->joined) {
+            ScheduleLocal(node, std::max(now, insert_start + node->pid % 1000), EVENT_INSERT);
+        }
+        break;
+    case EVENT_INSERT:
+        node->inserts++;
+        if (status != 0) {
+            node->failed_inserts++;
+        }
+        ScheduleLocal(node, std::max(now, lookup_start + NextRandom(node) % lookup_interval), EVENT_LOOKUP);
+        break;
+    case EVENT_LOOKUP:
+        node->lookups++;
+        node->lookup_millis += now - node->waiting_since;
+        if (status < 0) {
+            node->failed_lookups++;
+        }
+        ScheduleLocal(node, now + lookup_interval, EVENT_LOOKUP);
+        break;
+    }
+    return 0;
+}
+
+void TracePrintf(int level, const char *fmt, ...) {
+}
+
+/**
+ * Make the kernel state of this thread the one of a node
+ * @param node the node to handle an event of
+ */
+void Load(SimNode* node) {
+    if (loaded_node == node) {
+        return;
+    }
+    SetKernelContext(node->context);
+    loaded_node = node;
+}
+
+void Request(SimNode* node, int kind, const void *msg, int len) {
+    node->waiting = kind;
+    node->waiting_since = replay_time;
+    HandleMessage(node->pid, 0, msg, len);
+}
+
+void HandleEvent(Event &event) {
+    SimNode* node = &nodes[event.dest];
+    if (!node->up) {
+        return;
+    }
+    node->events++;
+    current_node = node;
+    replay_time = event.time;
+    Load(node);
+    switch (event.kind) {
+    case EVENT_MESSAGE:
+        HandleMessage(event.src, event.dest, event.msg.data(), (int) event.msg.size());
+        break;
+    case EVENT_ALARM:
+        HandleMessage(0, 0, NULL, 0);
+        ScheduleLocal(node, event.time + alarm_interval, EVENT_ALARM);
+        break;
+    case EVENT_JOIN: {
+        JoinMessage message(node->id);
+        Request(node, EVENT_JOIN, &message, sizeof(JoinMessage));
+        break;
+    }
+    case EVENT_INSERT: {
+        char data[32];
+        int len = std::sprintf(data, "sim file %d", node->pid) + 1;
+        char* message = MakeDataMessage(node->fid, data, len, INSERT);
+        Request(node, EVENT_INSERT, message, data_message_header_size + len);
+        delete[] message;
+        break;
+    }
+    case EVENT_LOOKUP: {
+        int target = 1 + NextRandom(node) % node_count;
+        LookupMessage message(nodes[target].fid, 0, P2P_FILE_MAXSIZE);
+        Request(node, EVENT_LOOKUP, &message, sizeof(LookupMessage));
+        break;
+    }
+    case EVENT_FAIL:
+        node->up = false;
+        break;
+    }
+}
+
+void RunWorker(int index) {
+    current_worker = index;
+    Worker &worker = workers[index];
+    long long window = 0;
+    while (window < end_time) {
+        long long window_end = std::min(window + link_delay, end_time);
+        while (!worker.queue.empty() && worker.queue.front().time < window_end) {
+            std::pop_heap(worker.queue.begin(), worker.queue.end(), Later);
+            Event event = std::move(worker.queue.back());
+            worker.queue.pop_back();
+            HandleEvent(event);
+        }
+        barrier.Wait();
+        for (auto &other : workers) {
+            for (auto &event : other.outboxes[index]) {
+                worker.queue.push_back(std::move(event));
+                std::push_heap(worker.queue.begin(), worker.queue.end(), Later);
+            }
+            other.outboxes[index].clear();
+        }
+        worker.next_time = worker.queue.empty() ? LLONG_MAX : worker.queue.front().time;
+        barrier.Wait();
+        long long next = LLONG_MAX;
+        for (const auto &other : workers) {
+            next = std::min(next, other.next_time);
+        }
+        window = std::max(window_end, next);
+    }
+    SetKernelContext(NULL);
+    loaded_node = NULL;
+}
+
+int
+main(int argc, char **argv) {
+    if (argc > 1) {
+        node_count = std::atoi(argv[1]);
+    }
+    worker_count = argc > 2 ? std::atoi(argv[2]) : (int) std::thread::hardware_concurrency();
+    if (argc > 3) {
+        end_time = std::atoll(argv[3]) * 1000;
+    }
+    if (argc > 4) {
+        fail_percent = std::atoi(argv[4]);
+    }
+    if (node_count < 1 || node_count > max_nodes) {
+        std::fprintf(stderr, "Number of nodes must be between 1 and %d\n", max_nodes);
+        return 1;
+    }
+    worker_count = std::max(1, std::min(worker_count, node_count));
+    insert_start = join_start + (long long) node_count * join_spacing + settle_time;
+    lookup_start = insert_start + settle_time;
+    if (lookup_start >= end_time) {
+        std::fprintf(stderr, "%d nodes need more than %lld s to join and insert\n",
+                     node_count, lookup_start / 1000);
+        return 1;
+    }
+
+    workers.resize(worker_count);
+    for (auto &worker : workers) {
+        worker.outboxes.resize(worker_count);
+    }
+    barrier.count = worker_count;
+    barrier.arrived = 0;
+    barrier.generation = 0;
+
+    nodes.resize(node_count + 1);
+    unsigned short fid_seed = 0;
+    for (int pid = 1; pid <= node_count; pid++) {
+        SimNode &node = nodes[pid];
+        std::memset(&node, 0, sizeof(SimNode));
+        node.pid = pid;
+        // Mix16 is a bijection, so nodeIDs and fileIDs are unique. fileIDs skip the
+        // chunk range, and repeat only with more nodes than fileIDs outside of it.
+        node.id = Mix16(pid);
+        do {
+            node.fid = Mix16(++fid_seed ^ 0x5555);
+        } while (IsChunkFileID(node.fid));
+        node.context = NewKernelContext();
+        node.up = true;
+        node.random = 2654435761U * pid;
+        node.digest = 14695981039346656037ULL;
+        // scheduled straight into the queue of the node's worker
+        current_worker = WorkerOf(pid);
+        ScheduleLocal(&node, (long long) pid * 7 % alarm_interval, EVENT_ALARM);
+        ScheduleLocal(&node, pid == 1 ? 0 : join_start + (long long) pid * join_spacing, EVENT_JOIN);
+        if (pid != 1 && (int) (NextRandom(&node) % 100) < fail_percent) {
+            ScheduleLocal(&node, lookup_start + NextRandom(&node) % (end_time - lookup_start), EVENT_FAIL);
+        }
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 1; i < worker_count; i++) {
+        threads.push_back(std::thread(RunWorker, i));
+    }
+    RunWorker(0);
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    long events = 0;
+    long transmitted = 0;
+    long bytes = 0;
+    int joined = 0;
+    int failed_nodes = 0;
+    int inserts = 0;
+    int failed_inserts = 0;
+    long lookups = 0;
+    long failed_lookups = 0;
+    long long lookup_millis = 0;
+    unsigned long long digest = 14695981039346656037ULL;
+    for (int pid = 1; pid <= node_count; pid++) {
+        const SimNode &node = nodes[pid];
+        events += node.events;
+        transmitted += node.transmitted;
+        bytes += node.bytes;
+        joined += node.joined ? 1 : 0;
+        failed_nodes += node.up ? 0 : 1;
+        inserts += node.inserts;
+        failed_inserts += node.failed_inserts;
+        lookups += node.lookups;
+        failed_lookups += node.failed_lookups;
+        lookup_millis += node.lookup_millis;
+        digest = (digest ^ node.digest) * 1099511628211ULL;
+    }
+    std::printf("simulated %d nodes for %lld s on %d threads in %.3f s, %ld events (%.0f per s)\n",
+                node_count, end_time / 1000, worker_count, elapsed, events, events / elapsed);
+    std::printf("joined %d, failed %d, inserts %d (%d failed), look ups %ld (%ld failed), "
+                "mean look up %.1f ms\n",
+                joined, failed_nodes, inserts, failed_inserts, lookups, failed_lookups,
+                lookups > 0 ? (double) lookup_millis / lookups : 0.0);
+    std::printf("transmitted %ld messages, %ld bytes, digest %016llx\n", transmitted, bytes, digest);
+    return 0;
+}
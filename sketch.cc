@@ -0,0 +1,67 @@
+#include "sketch.h"
+#include <cstring>
+#include <algorithm>
+
+// odd multipliers of the multiply-shift hash of each row
+static const unsigned int row_seeds[sketch_depth] = {
+    0x9e3779b1u, 0x85ebca77u, 0xc2b2ae3du, 0x27d4eb2fu,
+};
+
+static_assert(key_filter_hashes <= sketch_depth, "the key filter uses the seeds of the sketch rows");
+
+static int Hash(int row, fileID fid, int range) {
+    unsigned int hash = (fid + 1u) * row_seeds[row];
+    // the high bits of the product are the well mixed ones
+    return ((unsigned long long) hash * range) >> 32;
+}
+
+static int Column(int row, fileID fid) {
+    return Hash(row, fid, sketch_width);
+}
+
+CountMinSketch::CountMinSketch() {
+    std::memset(counters, 0, sizeof(counters));
+}
+
+void CountMinSketch::Add(fileID fid) {
+    for (int row = 0; row < sketch_depth; row++) {
+        counters[row][Column(row, fid)]++;
+    }
+}
+
+int CountMinSketch::Estimate(fileID fid) const {
+    int estimate = counters[0][Column(0, fid)];
+    for (int row = 1; row < sketch_depth; row++) {
+        estimate = std::min(estimate, counters[row][Column(row, fid)]);
+    }
+    return estimate;
+}
+
+void CountMinSketch::Decay() {
+    for (auto &row : counters) {
+        for (int &counter : row) {
+            counter /= 2;
+        }
+    }
+}
+
+void KeyFilter::Clear() {
+    std::memset(bits, 0, sizeof(bits));
+}
+
+void KeyFilter::Add(fileID fid) {
+    for (int i = 0; i < key_filter_hashes; i++) {
+        int bit = Hash(i, fid, key_filter_bits);
+        bits[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+bool KeyFilter::MayContain(fileID fid) const {
+    for (int i = 0; i < key_filter_hashes; i++) {
+        int bit = Hash(i, fid, key_filter_bits);
+        if ((bits[bit / 8] & (1 << (bit % 8))) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,39 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <rednet-p2p.h>
+
+const int sketch_depth = 4;
+// number of counters per row
+const int sketch_width = 256;
+
+/**
+ * Count-min sketch of how often each fileID was seen. Estimates never undercount,
+ * and overcount only when a key collides with a busier key in every row.
+ */
+struct CountMinSketch {
+    int counters[sketch_depth][sketch_width];
+    CountMinSketch();
+    void Add(fileID fid);
+    int Estimate(fileID fid) const;
+    // halve every counter so that old counts fade out
+    void Decay();
+};
+
+const int key_filter_bits = 1024;
+const int key_filter_hashes = 3;
+
+/**
+ * Bloom filter of a set of fileIDs, small enough to be sent in every exchange
+ * message. MayContain() has no false negatives, and false positives for about
+ * 2% of the keys with 100 keys in the filter. Keys can't be removed, so the
+ * filter is rebuilt from scratch instead.
+ */
+struct KeyFilter {
+    unsigned char bits[key_filter_bits / 8];
+    void Clear();
+    void Add(fileID fid);
+    bool MayContain(fileID fid) const;
+};
+
+#endif
@@ -0,0 +1,112 @@
+/**
+ * This test is used to verify the look up cache. After all nodes join,
+ * process index 5 inserts a file. Process index 12 enables the cache and
+ * looks the file up twice, the second time from its cache. Process index
+ * 5 then updates the file, and process index 12 must see the new content,
+ * because the root invalidated its lease. Process index 12 finally updates
+ * the file itself and must read back its own write.
+ */
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rednet.h>
+#include <rednet-p2p.h>
+
+#include "overlay.h"
+
+#define FID1    0x5511
+char data1[] = "cached file";
+char data2[] = "changed file";
+char data3[] = "written file";
+
+nodeID Nid;
+int Idx;
+
+char buff[P2P_FILE_MAXSIZE];
+
+/**
+ * Look up FID1 and compare it with the expected content
+ */
+void
+Check(const char* step, const char* expected) {
+    int status = Lookup(FID1, buff, sizeof(buff));
+    if (status != (int) strlen(expected) + 1 || strcmp(buff, expected) != 0) {
+        fprintf(stderr, "ERROR: %s: Lookup returned %d!\n", step, status);
+        exit(1);
+    }
+}
+
+int
+main(int argc, char **argv) {
+    int status;
+
+    if (argc < 2) {
+        fprintf(stderr,
+                "Process index argument missing: run with ## on command line.\n");
+        exit(1);
+    }
+
+    Idx = atoi(argv[1]);    /* number from 0 to 31 */
+    Nid = GetNodeID();
+
+    fprintf(stderr, "Pid %d nodeID %04x index %d\n", GetPid(), Nid, Idx);
+
+    /* same join schedule as store1.c */
+    if (Idx != 0) {
+        MilliSleep(25 * 1000);
+    }
+    status = Join(Nid);
+    if (status != 0) {
+        fprintf(stderr, "ERROR: Join returned %d!\n", status);
+        exit(1);
+    }
+    if (Idx == 0) {
+        MilliSleep(25 * 1000);
+    }
+    MilliSleep(25 * 1000);
+
+    if (Idx == 5) {
+        status = Insert(FID1, data1, strlen(data1) + 1);
+        if (status != 0) {
+            fprintf(stderr, "ERROR: Insert returned %d!\n", status);
+            exit(1);
+        }
+    }
+
+    MilliSleep(5 * 1000);   /* allow the Insert to finish */
+
+    if (Idx == 12) {
+        EnableLookupCache(8);
+        Check("first look up", data1);
+        Check("cached look up", data1);
+    }
+
+    MilliSleep(1000);
+
+    if (Idx == 5) {
+        status = Update(FID1, 0, data2, strlen(data2) + 1);
+        if (status != 0) {
+            fprintf(stderr, "ERROR: Update returned %d!\n", status);
+            exit(1);
+        }
+    }
+
+    MilliSleep(1000);       /* well within the lease */
+
+    if (Idx == 12) {
+        Check("look up after the update", data2);
+        status = Update(FID1, 0, data3, strlen(data3) + 1);
+        if (status != 0) {
+            fprintf(stderr, "ERROR: Update returned %d!\n", status);
+            exit(1);
+        }
+        Check("look up after our own update", data3);
+        fprintf(stderr, "Cache tests passed\n");
+    }
+
+    MilliSleep(25 * 1000);
+    exit(0);
+}
@@ -0,0 +1,101 @@
+/**
+ * This test is used to verify that a node can leave without losing files.
+ * After all nodes join, every process inserts one file. Process index 5
+ * then calls Leave and exits, while process index 12 keeps looking up
+ * every file, first while index 5 hands off its files and then again
+ * after index 5 is gone. Every file should be found in every round.
+ */
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rednet.h>
+#include <rednet-p2p.h>
+
+#include "overlay.h"
+
+#define NUM_NODES   32
+#define FID_BASE    0x2200
+#define ROUNDS      4
+
+nodeID Nid;
+int Idx;
+
+char data[32];
+char buff[P2P_FILE_MAXSIZE];
+
+int
+main(int argc, char **argv) {
+    int status;
+    int i;
+    int round;
+
+    if (argc < 2) {
+        fprintf(stderr,
+                "Process index argument missing: run with ## on command line.\n");
+        exit(1);
+    }
+
+    Idx = atoi(argv[1]);    /* number from 0 to 31 */
+    Nid = GetNodeID();
+
+    fprintf(stderr, "Pid %d nodeID %04x index %d\n", GetPid(), Nid, Idx);
+
+    /* same join schedule as store1.c */
+    if (Idx != 0) {
+        MilliSleep(25 * 1000);
+    }
+    status = Join(Nid);
+    if (status != 0) {
+        fprintf(stderr, "ERROR: Join returned %d!\n", status);
+        exit(1);
+    }
+    if (Idx == 0) {
+        MilliSleep(25 * 1000);
+    }
+    MilliSleep(25 * 1000);
+
+    sprintf(data, "leave test file %d", Idx);
+    status = Insert(FID_BASE + Idx, data, strlen(data) + 1);
+    if (status != 0) {
+        fprintf(stderr, "ERROR: Insert returned %d!\n", status);
+    }
+
+    MilliSleep(25 * 1000);  /* allow all Inserts to finish */
+
+    if (Idx == 5) {
+        status = Leave();
+        if (status != 0) {
+            fprintf(stderr, "ERROR: Leave returned %d!\n", status);
+        } else {
+            fprintf(stderr, "Process Idx %d left\n", Idx);
+        }
+        exit(0);
+    }
+
+    if (Idx == 12) {
+        for (round = 0; round < ROUNDS; round++) {
+            int found = 0;
+            for (i = 0; i < NUM_NODES; i++) {
+                sprintf(data, "leave test file %d", i);
+                status = Lookup(FID_BASE + i, buff, sizeof(buff));
+                if (status < 0) {
+                    fprintf(stderr, "ERROR: round %d, Lookup of file %d returned %d!\n",
+                            round, i, status);
+                } else if (strcmp(buff, data) != 0) {
+                    fprintf(stderr, "ERROR: round %d, file %d has content %s!\n",
+                            round, i, buff);
+                } else {
+                    found++;
+                }
+            }
+            printf("round %d: found %d of %d files\n", round, found, NUM_NODES);
+            MilliSleep(5 * 1000);
+        }
+    }
+
+    MilliSleep(1000 * 1000);
+    exit(0);
+}
@@ -0,0 +1,107 @@
+/**
+ * This test is used to verify ranged look ups and writes. After all
+ * nodes join, process index 5 inserts a file, overwrites a few bytes
+ * in the middle of it and appends to it. Process index 12 then reads
+ * back parts of the file with LookupRange and checks their content.
+ */
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rednet.h>
+#include <rednet-p2p.h>
+
+#include "overlay.h"
+
+#define FID1    0x1111
+char data1[] = "0123456789";
+char patch[] = "abc";
+char tail[] = "XYZ";
+/* content after the update at offset 4 and the append, without the terminating null */
+char expected[] = "0123abc789XYZ";
+
+nodeID Nid;
+int Idx;
+
+char buff[P2P_FILE_MAXSIZE];
+
+int
+main(int argc, char **argv) {
+    int status;
+
+    if (argc < 2) {
+        fprintf(stderr,
+                "Process index argument missing: run with ## on command line.\n");
+        exit(1);
+    }
+
+    Idx = atoi(argv[1]);    /* number from 0 to 31 */
+    Nid = GetNodeID();
+
+    fprintf(stderr, "Pid %d nodeID %04x index %d\n", GetPid(), Nid, Idx);
+
+    /* same join schedule as store1.c */
+    if (Idx != 0) {
+        MilliSleep(25 * 1000);
+    }
+    status = Join(Nid);
+    if (status != 0) {
+        fprintf(stderr, "ERROR: Join returned %d!\n", status);
+        exit(1);
+    }
+    if (Idx == 0) {
+        MilliSleep(25 * 1000);
+    }
+    MilliSleep(25 * 1000);
+
+    if (Idx == 5) {
+        /* insert without the terminating null so that the append lines up */
+        status = Insert(FID1, data1, strlen(data1));
+        if (status != 0) {
+            fprintf(stderr, "ERROR: Insert returned %d!\n", status);
+            exit(1);
+        }
+        status = Update(FID1, 4, patch, strlen(patch));
+        if (status != 0) {
+            fprintf(stderr, "ERROR: Update returned %d!\n", status);
+            exit(1);
+        }
+        status = Append(FID1, tail, strlen(tail));
+        if (status != 0) {
+            fprintf(stderr, "ERROR: Append returned %d!\n", status);
+            exit(1);
+        }
+        /* writing past the end of the file would leave a hole */
+        status = Update(FID1, 100, patch, strlen(patch));
+        if (status >= 0) {
+            fprintf(stderr, "ERROR: Update past the end didn't return error!\n");
+            exit(1);
+        }
+    }
+
+    MilliSleep(25 * 1000);  /* allow all writes to finish first */
+
+    if (Idx == 12) {
+        status = Lookup(FID1, buff, sizeof(buff));
+        if (status != (int) strlen(expected) || memcmp(buff, expected, status) != 0) {
+            fprintf(stderr, "ERROR: Lookup returned %d!\n", status);
+            exit(1);
+        }
+        status = LookupRange(FID1, 4, buff, 3);
+        if (status != 3 || memcmp(buff, "abc", 3) != 0) {
+            fprintf(stderr, "ERROR: LookupRange in the middle returned %d!\n", status);
+            exit(1);
+        }
+        status = LookupRange(FID1, 10, buff, sizeof(buff));
+        if (status != 3 || memcmp(buff, "XYZ", 3) != 0) {
+            fprintf(stderr, "ERROR: LookupRange of the tail returned %d!\n", status);
+            exit(1);
+        }
+        fprintf(stderr, "Range tests passed\n");
+    }
+
+    MilliSleep(25 * 1000);
+    exit(0);
+}
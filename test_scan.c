@@ -0,0 +1,117 @@
+/**
+ * This test is used to verify range scans. After all nodes join,
+ * process index 5 inserts NUM_FILES files with consecutive fileIDs
+ * starting at FID_BASE. Process index 12 then scans the whole range
+ * and a range in the middle of it, and checks that every file is
+ * found exactly once, in fileID order, with the right content.
+ */
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rednet.h>
+#include <rednet-p2p.h>
+
+#include "overlay.h"
+
+#define NUM_FILES   64
+#define FID_BASE    0x4000
+
+nodeID Nid;
+int Idx;
+
+int found;
+int errors;
+fileID last_fid;
+
+void
+check_file(fileID fid, const void *contents, int len) {
+    char expected[32];
+
+    sprintf(expected, "file %04x", fid);
+    if (len != (int) strlen(expected) + 1 || strcmp((const char *) contents, expected) != 0) {
+        fprintf(stderr, "ERROR: wrong content for file %04x!\n", fid);
+        errors++;
+    }
+    if (found > 0 && fid <= last_fid) {
+        fprintf(stderr, "ERROR: file %04x found after %04x!\n", fid, last_fid);
+        errors++;
+    }
+    last_fid = fid;
+    found++;
+}
+
+int
+scan(fileID lo, fileID hi) {
+    int status;
+
+    found = 0;
+    errors = 0;
+    status = Scan(lo, hi, check_file);
+    if (status != hi - lo + 1 || found != status || errors != 0) {
+        fprintf(stderr, "ERROR: Scan of %04x to %04x returned %d, %d errors!\n",
+                lo, hi, status, errors);
+        return -1;
+    }
+    return 0;
+}
+
+int
+main(int argc, char **argv) {
+    int status;
+    int i;
+    char data[32];
+
+    if (argc < 2) {
+        fprintf(stderr,
+                "Process index argument missing: run with ## on command line.\n");
+        exit(1);
+    }
+
+    Idx = atoi(argv[1]);    /* number from 0 to 31 */
+    Nid = GetNodeID();
+
+    fprintf(stderr, "Pid %d nodeID %04x index %d\n", GetPid(), Nid, Idx);
+
+    /* same join schedule as store1.c */
+    if (Idx != 0) {
+        MilliSleep(25 * 1000);
+    }
+    status = Join(Nid);
+    if (status != 0) {
+        fprintf(stderr, "ERROR: Join returned %d!\n", status);
+        exit(1);
+    }
+    if (Idx == 0) {
+        MilliSleep(25 * 1000);
+    }
+    MilliSleep(25 * 1000);
+
+    if (Idx == 5) {
+        for (i = 0; i < NUM_FILES; i++) {
+            sprintf(data, "file %04x", FID_BASE + i);
+            status = Insert(FID_BASE + i, data, strlen(data) + 1);
+            if (status != 0) {
+                fprintf(stderr, "ERROR: Insert %d returned %d!\n", i, status);
+                exit(1);
+            }
+        }
+    }
+
+    MilliSleep(25 * 1000);  /* allow all Inserts to finish first */
+
+    if (Idx == 12) {
+        if (scan(FID_BASE, FID_BASE + NUM_FILES - 1) != 0) {
+            exit(1);
+        }
+        if (scan(FID_BASE + NUM_FILES / 4, FID_BASE + NUM_FILES / 2) != 0) {
+            exit(1);
+        }
+        fprintf(stderr, "Scan tests passed\n");
+    }
+
+    MilliSleep(25 * 1000);
+    exit(0);
+}
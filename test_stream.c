@@ -0,0 +1,100 @@
+/**
+ * This test is used to verify streamed files. After all nodes join,
+ * process index 3 inserts a file spanning many chunks with InsertStream.
+ * Process index 20 then reads it back with LookupStream, checks every
+ * byte, reclaims it and makes sure the manifest is gone.
+ */
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rednet.h>
+#include <rednet-p2p.h>
+
+#include "overlay.h"
+
+#define FID1        0x7a00
+/* not a multiple of the chunk size so that the last chunk is partial */
+#define STREAM_LEN  (20 * P2P_FILE_MAXSIZE + 123)
+
+nodeID Nid;
+int Idx;
+
+char data[STREAM_LEN];
+char buff[STREAM_LEN];
+
+int
+main(int argc, char **argv) {
+    int status;
+    int i;
+
+    if (argc < 2) {
+        fprintf(stderr,
+                "Process index argument missing: run with ## on command line.\n");
+        exit(1);
+    }
+
+    Idx = atoi(argv[1]);    /* number from 0 to 31 */
+    Nid = GetNodeID();
+
+    fprintf(stderr, "Pid %d nodeID %04x index %d\n", GetPid(), Nid, Idx);
+
+    for (i = 0; i < STREAM_LEN; i++) {
+        data[i] = (char) (i * 7 + i / P2P_FILE_MAXSIZE);
+    }
+
+    /* same join schedule as store1.c */
+    if (Idx != 0) {
+        MilliSleep(25 * 1000);
+    }
+    status = Join(Nid);
+    if (status != 0) {
+        fprintf(stderr, "ERROR: Join returned %d!\n", status);
+        exit(1);
+    }
+    if (Idx == 0) {
+        MilliSleep(25 * 1000);
+    }
+    MilliSleep(25 * 1000);
+
+    if (Idx == 3) {
+        status = InsertStream(FID1, data, sizeof(data));
+        if (status != 0) {
+            fprintf(stderr, "ERROR: InsertStream returned %d!\n", status);
+            exit(1);
+        }
+    }
+
+    MilliSleep(25 * 1000);  /* allow the stream insert to finish first */
+
+    if (Idx == 20) {
+        status = LookupStream(FID1, buff, sizeof(buff));
+        if (status != STREAM_LEN || memcmp(buff, data, STREAM_LEN) != 0) {
+            fprintf(stderr, "ERROR: LookupStream returned %d!\n", status);
+            exit(1);
+        }
+        /* a short buffer only receives the head of the stream */
+        memset(buff, 0, sizeof(buff));
+        status = LookupStream(FID1, buff, P2P_FILE_MAXSIZE + 10);
+        if (status != P2P_FILE_MAXSIZE + 10 || memcmp(buff, data, status) != 0) {
+            fprintf(stderr, "ERROR: short LookupStream returned %d!\n", status);
+            exit(1);
+        }
+        status = ReclaimStream(FID1);
+        if (status != 0) {
+            fprintf(stderr, "ERROR: ReclaimStream returned %d!\n", status);
+            exit(1);
+        }
+        status = LookupStream(FID1, buff, sizeof(buff));
+        if (status >= 0) {
+            fprintf(stderr, "ERROR: LookupStream after reclaim returned %d!\n", status);
+            exit(1);
+        }
+        fprintf(stderr, "Stream tests passed\n");
+    }
+
+    MilliSleep(25 * 1000);
+    exit(0);
+}
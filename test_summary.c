@@ -0,0 +1,129 @@
+/**
+ * This test is used to verify look ups of files that aren't at their root.
+ * Most processes join first and process index 3 inserts NUM_FILES files
+ * spread over the ring. Then the processes from index LATE_INDEX on join,
+ * and become the root of some of the files, which are still held by the
+ * old root, now only a member of the new root's leaf set. Process index 12
+ * looks every file up while the late nodes join and once more after the
+ * files moved. Every file should be found in every round, so no look up
+ * may be failed early from a key summary that doesn't show the old root's
+ * files yet.
+ */
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rednet.h>
+#include <rednet-p2p.h>
+
+#include "overlay.h"
+
+#define NUM_FILES   60
+#define LATE_INDEX  24
+#define ROUNDS      6
+
+nodeID Nid;
+int Idx;
+
+fileID fids[NUM_FILES];
+char data[32];
+char buff[P2P_FILE_MAXSIZE];
+
+int
+lookup_all(int round) {
+    int status;
+    int i;
+    int found = 0;
+
+    for (i = 0; i < NUM_FILES; i++) {
+        sprintf(data, "summary test file %04x", fids[i]);
+        status = Lookup(fids[i], buff, sizeof(buff));
+        if (status < 0) {
+            fprintf(stderr, "ERROR: round %d, Lookup of file %04x returned %d!\n",
+                    round, fids[i], status);
+        } else if (strcmp(buff, data) != 0) {
+            fprintf(stderr, "ERROR: round %d, file %04x has content %s!\n",
+                    round, fids[i], buff);
+        } else {
+            found++;
+        }
+    }
+    printf("round %d: found %d of %d files\n", round, found, NUM_FILES);
+    return found;
+}
+
+int
+main(int argc, char **argv) {
+    int status;
+    int i;
+    int fid;
+    int round;
+    int n = 0;
+
+    if (argc < 2) {
+        fprintf(stderr,
+                "Process index argument missing: run with ## on command line.\n");
+        exit(1);
+    }
+
+    Idx = atoi(argv[1]);    /* number from 0 to 31 */
+    Nid = GetNodeID();
+
+    fprintf(stderr, "Pid %d nodeID %04x index %d\n", GetPid(), Nid, Idx);
+
+    for (fid = 0x0123; n < NUM_FILES; fid += 0x0400) {
+        if (fid >= 0xb000 && fid < 0xc000) {
+            continue;   /* reserved for the chunks of streams */
+        }
+        fids[n++] = fid;
+    }
+
+    /* same join schedule as store1.c, except that the late nodes join last */
+    if (Idx >= LATE_INDEX) {
+        MilliSleep(75 * 1000);
+    } else if (Idx != 0) {
+        MilliSleep(25 * 1000);
+    }
+    status = Join(Nid);
+    if (status != 0) {
+        fprintf(stderr, "ERROR: Join returned %d!\n", status);
+        exit(1);
+    }
+    if (Idx >= LATE_INDEX) {
+        MilliSleep(1000 * 1000);
+        exit(0);
+    }
+    if (Idx == 0) {
+        MilliSleep(25 * 1000);
+    }
+    MilliSleep(25 * 1000);
+
+    if (Idx == 3) {
+        for (i = 0; i < NUM_FILES; i++) {
+            sprintf(data, "summary test file %04x", fids[i]);
+            status = Insert(fids[i], data, strlen(data) + 1);
+            if (status != 0) {
+                fprintf(stderr, "ERROR: Insert of file %04x returned %d!\n", fids[i], status);
+                exit(1);
+            }
+        }
+    }
+
+    MilliSleep(25 * 1000);  /* the late nodes join now */
+
+    if (Idx == 12) {
+        for (round = 0; round < ROUNDS; round++) {
+            lookup_all(round);
+            MilliSleep(2 * 1000);
+        }
+        MilliSleep(25 * 1000);  /* allow the files to move to their new roots */
+        if (lookup_all(ROUNDS) == NUM_FILES) {
+            fprintf(stderr, "Summary tests passed\n");
+        }
+    }
+
+    MilliSleep(1000 * 1000);
+    exit(0);
+}
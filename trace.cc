@@ -0,0 +1,78 @@
+#include "trace.h"
+#include "message.h"
+
+thread_local long long replay_time = -1;
+
+TraceWriter::TraceWriter(): file(NULL), payloads(false) {}
+
+TraceWriter::~TraceWriter() {
+    Close();
+}
+
+bool TraceWriter::Open(const char* path, int pid, bool with_payloads) {
+    Close();
+    file = std::fopen(path, "wb");
+    if (file == NULL) {
+        return false;
+    }
+    payloads = with_payloads;
+    TraceHeader header = {trace_magic, trace_version, pid, payloads ? 1 : 0};
+    std::fwrite(&header, sizeof(TraceHeader), 1, file);
+    return true;
+}
+
+void TraceWriter::Record(long long time, int src, int dest, const void* msg, int len) {
+    if (file == NULL) {
+        return;
+    }
+    TraceEvent event = {time, src, dest, len, -1, ContentHash(msg, len)};
+    if (len >= (int) sizeof(int)) {
+        event.type = ((const Message*) msg)->type;
+    }
+    std::fwrite(&event, sizeof(TraceEvent), 1, file);
+    if (payloads && len > 0) {
+        std::fwrite(msg, 1, len, file);
+    }
+}
+
+void TraceWriter::Flush() {
+    if (file != NULL) {
+        std::fflush(file);
+    }
+}
+
+void TraceWriter::Close() {
+    if (file != NULL) {
+        std::fclose(file);
+        file = NULL;
+    }
+}
+
+TraceReader::TraceReader(): file(NULL) {}
+
+TraceReader::~TraceReader() {
+    if (file != NULL) {
+        std::fclose(file);
+    }
+}
+
+bool TraceReader::Open(const char* path) {
+    file = std::fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+    return std::fread(&header, sizeof(TraceHeader), 1, file) == 1
+        && header.magic == trace_magic && header.version == trace_version;
+}
+
+bool TraceReader::Next(TraceEvent* event, std::vector<char>* payload) {
+    if (std::fread(event, sizeof(TraceEvent), 1, file) != 1 || event->len < 0) {
+        return false;
+    }
+    payload->clear();
+    if (!header.payloads || event->len == 0) {
+        return true;
+    }
+    payload->resize(event->len);
+    return (int) std::fread(payload->data(), 1, event->len, file) == event->len;
+}
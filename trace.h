@@ -0,0 +1,88 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstdio>
+#include <vector>
+
+// "TRCE", first int of every message log
+const int trace_magic = 0x45435254;
+const int trace_version = 1;
+
+/**
+ * Start of a message log. Every kernel writes its own log.
+ */
+struct TraceHeader {
+    int magic;
+    int version;
+    // pid of the kernel that handled the messages
+    int pid;
+    // whether every event is followed by the len bytes of its message
+    int payloads;
+};
+
+/**
+ * A call of HandleMessage. The alarm is recorded as src 0, dest 0 and len 0.
+ */
+struct TraceEvent {
+    // milliseconds on the monotonic clock of the kernel
+    long long time;
+    int src;
+    int dest;
+    int len;
+    // first int of the message, -1 if it is shorter than that
+    int type;
+    // ContentHash() of the message
+    unsigned long long hash;
+};
+
+/**
+ * Appends the messages a kernel handles to a log file.
+ */
+struct TraceWriter {
+    FILE* file;
+    bool payloads;
+    TraceWriter();
+    ~TraceWriter();
+    /**
+     * Create the log and write its header
+     * @param  path     file to write
+     * @param  pid      pid of the kernel
+     * @param  payloads whether to write the messages, without them the log can't be replayed
+     * @return          whether the file could be created
+     */
+    bool Open(const char* path, int pid, bool payloads);
+    void Record(long long time, int src, int dest, const void* msg, int len);
+    void Flush();
+    void Close();
+};
+
+/**
+ * Reads a log written by TraceWriter.
+ */
+struct TraceReader {
+    FILE* file;
+    TraceHeader header;
+    TraceReader();
+    ~TraceReader();
+    /**
+     * Open a log and read its header
+     * @param  path file to read
+     * @return      whether the file is a log of this version
+     */
+    bool Open(const char* path);
+    /**
+     * Read the next event
+     * @param  event   set to the event
+     * @param  payload set to the message if the log has payloads
+     * @return         false at the end of the log or if the event is cut off
+     */
+    bool Next(TraceEvent* event, std::vector<char>* payload);
+};
+
+/**
+ * Time NowMillis() of the kernel returns while a log is replayed or the kernel is
+ * simulated, -1 otherwise. Every simulator thread has its own.
+ */
+extern thread_local long long replay_time;
+
+#endif